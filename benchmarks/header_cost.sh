@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+#  header_cost.sh
+#  docopt
+#
+#  What including docopt.h costs a translation unit: how much the preprocessor hands the compiler,
+#  and how long compiling a file that only includes it takes. Compares the working tree against
+#  another revision (the parent commit by default).
+#
+#  Usage: benchmarks/header_cost.sh [revision] [runs]
+#
+#  CXX and CXXFLAGS are used as usual; the include path for Boost must be in CXXFLAGS if it is not
+#  in a default location.
+
+set -e
+
+BASELINE=${1:-HEAD~1}
+RUNS=${2:-10}
+CXX=${CXX:-c++}
+CXXFLAGS=${CXXFLAGS:--std=c++11 -O2}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir "$WORK/baseline"
+git -C "$ROOT" archive "$BASELINE" | tar -x -C "$WORK/baseline"
+
+# a typical user of the library: it reads a few arguments and nothing else
+cat > "$WORK/tu.cpp" <<'EOF'
+#include "docopt.h"
+
+long speed(std::map<std::string, docopt::value> const& args)
+{
+	return args.find("--speed")->second.asLong();
+}
+EOF
+
+measure() {
+	label=$1
+	include=$2
+
+	bytes=$($CXX $CXXFLAGS -I"$include" -E "$WORK/tu.cpp" | wc -c)
+	lines=$($CXX $CXXFLAGS -I"$include" -E -P "$WORK/tu.cpp" | wc -l)
+
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		$CXX $CXXFLAGS -I"$include" -c "$WORK/tu.cpp" -o "$WORK/tu.o"
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+
+	printf '%-10s %12s bytes %10s lines %8s ms/compile\n' \
+		"$label" "$bytes" "$lines" $(( (end - start) / 1000000 / RUNS ))
+}
+
+echo "docopt.h in one translation unit ($CXX $CXXFLAGS, $RUNS compiles each)"
+measure "$BASELINE" "$WORK/baseline"
+measure "working" "$ROOT"
@@ -0,0 +1,232 @@
+//
+//  replay.cpp
+//  docopt
+//
+//  docopt-replay: runs the parses of a capture log (see docopt::CaptureLog) through this build of
+//  the library, and reports throughput, latency percentiles and allocations per parse. Capture a
+//  production workload once, then replay it against each change to the library.
+//
+
+#include "docopt.h"
+
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+static const char USAGE[] =
+"docopt-replay.\n"
+"\n"
+"Replays the parses of a capture log through this build of docopt.\n"
+"\n"
+"Usage:\n"
+"  docopt-replay [options] <log> <doc>...\n"
+"  docopt-replay (-h | --help)\n"
+"\n"
+"Options:\n"
+"  -h --help      Show this screen.\n"
+"  --threads=<n>  Replay on this many threads, each taking every n-th record [default: 1].\n"
+"  --repeat=<n>   Go through the log this many times [default: 1].\n"
+"  --mode=<mode>  What to call for each record: parse, result (parse_result) or validate\n"
+"                 [default: parse].\n";
+
+#pragma mark -
+#pragma mark Allocation counting
+
+// Every allocation of the process goes through here, the library's included
+static boost::atomic<unsigned long> gAllocations(0);
+static boost::atomic<unsigned long> gAllocatedBytes(0);
+
+void* operator new(std::size_t size)
+{
+	gAllocations.fetch_add(1, boost::memory_order_relaxed);
+	gAllocatedBytes.fetch_add(size, boost::memory_order_relaxed);
+	void* ret = std::malloc(size ? size : 1);
+	if (!ret)
+		throw std::bad_alloc();
+	return ret;
+}
+
+void operator delete(void* ptr) throw()
+{
+	std::free(ptr);
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete[](void* ptr) throw() { operator delete(ptr); }
+
+#pragma mark -
+#pragma mark Replaying
+
+namespace {
+	enum Mode {
+		Parse,
+		ParseResult,
+		Validate
+	};
+
+	struct Job {
+		docopt::Parser const* parser;
+		docopt::CaptureRecord const* record;
+	};
+
+	// What one thread saw
+	struct Tally {
+		Tally() : accepted(0), rejected(0), exits(0) {}
+
+		std::vector<double> latencies; // in microseconds
+		unsigned long accepted;
+		unsigned long rejected;
+		unsigned long exits; // --help or --version
+	};
+
+	void replay_one(Job const& job, Mode mode, Tally& tally)
+	{
+		docopt::CaptureRecord const& record = *job.record;
+		try {
+			if (mode == Validate) {
+				docopt::Validation const verdict = job.parser->validate(record.argv, record.help, record.version, record.options_first);
+				if (verdict == docopt::Accepted)
+					++tally.accepted;
+				else if (verdict == docopt::HelpRequested || verdict == docopt::VersionRequested)
+					++tally.exits;
+				else
+					++tally.rejected;
+				return;
+			}
+
+			if (mode == ParseResult)
+				job.parser->parse_result(record.argv, record.help, record.version, record.options_first);
+			else
+				job.parser->parse(record.argv, record.help, record.version, record.options_first);
+			++tally.accepted;
+		} catch (docopt::DocoptArgumentError const&) {
+			++tally.rejected;
+		} catch (docopt::DocoptExitHelp const&) {
+			++tally.exits;
+		} catch (docopt::DocoptExitVersion const&) {
+			++tally.exits;
+		}
+	}
+
+	void replay(std::vector<Job> const& jobs, size_t first, size_t stride, unsigned repeat, Mode mode, Tally* tally)
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		tally->latencies.reserve((jobs.size() / stride + 1) * repeat);
+		for (unsigned r = 0; r < repeat; ++r) {
+			for (size_t i = first; i < jobs.size(); i += stride) {
+				Clock::time_point const start = Clock::now();
+				replay_one(jobs[i], mode, *tally);
+				std::chrono::duration<double, std::micro> const took = Clock::now() - start;
+				tally->latencies.push_back(took.count());
+			}
+		}
+	}
+
+	double percentile(std::vector<double> const& sorted, double p)
+	{
+		if (sorted.empty())
+			return 0;
+		size_t const at = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(at, sorted.size() - 1)];
+	}
+
+	Mode mode_named(std::string const& name)
+	{
+		if (name == "parse")
+			return Parse;
+		if (name == "result")
+			return ParseResult;
+		if (name == "validate")
+			return Validate;
+		throw docopt::DocoptArgumentError("Unknown --mode: " + name);
+	}
+}
+
+int main(int argc, char const** argv)
+{
+	docopt::Parser const usage(USAGE);
+	std::map<std::string, docopt::value> args = docopt::docopt(usage, std::vector<std::string>(argv + 1, argv + argc));
+
+	unsigned threads = 1;
+	unsigned repeat = 1;
+	Mode mode = Parse;
+	std::vector<docopt::CaptureRecord> records;
+	std::map<uint64_t, docopt::Parser> parsers;
+	try {
+		threads = static_cast<unsigned>(std::max(1L, args["--threads"].asLong()));
+		repeat = static_cast<unsigned>(std::max(1L, args["--repeat"].asLong()));
+		mode = mode_named(args["--mode"].asString());
+
+		std::vector<std::string> const& docs = args["<doc>"].asStringList();
+		for (std::vector<std::string>::const_iterator doc = docs.begin(); doc != docs.end(); ++doc) {
+			docopt::Parser const parser = docopt::Parser::from_file(*doc);
+			parsers[docopt::doc_fingerprint(parser.doc())] = parser;
+		}
+		records = docopt::CaptureLog::read(args["<log>"].asString());
+	} catch (std::exception const& error) {
+		std::fprintf(stderr, "docopt-replay: %s\n", error.what());
+		return 1;
+	}
+
+	// records for docs that were not given are skipped
+	std::vector<Job> jobs;
+	jobs.reserve(records.size());
+	for (std::vector<docopt::CaptureRecord>::const_iterator record = records.begin(); record != records.end(); ++record) {
+		std::map<uint64_t, docopt::Parser>::const_iterator parser = parsers.find(record->doc);
+		if (parser == parsers.end())
+			continue;
+		Job job = { &parser->second, &*record };
+		jobs.push_back(job);
+	}
+	std::printf("%lu records, %lu for the %lu docs given; %u thread(s), %u pass(es)\n",
+		    static_cast<unsigned long>(records.size()), static_cast<unsigned long>(jobs.size()),
+		    static_cast<unsigned long>(parsers.size()), threads, repeat);
+	if (jobs.empty())
+		return 0;
+
+	std::vector<Tally> tallies(threads);
+	unsigned long const allocationsBefore = gAllocations.load();
+	unsigned long const bytesBefore = gAllocatedBytes.load();
+	std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+	if (threads == 1) {
+		replay(jobs, 0, 1, repeat, mode, &tallies[0]);
+	} else {
+		boost::thread_group group;
+		for (unsigned t = 0; t < threads; ++t)
+			group.create_thread(boost::bind(&replay, boost::cref(jobs), t, threads, repeat, mode, &tallies[t]));
+		group.join_all();
+	}
+	std::chrono::duration<double> const wall = std::chrono::steady_clock::now() - start;
+	unsigned long const allocations = gAllocations.load() - allocationsBefore;
+	unsigned long const bytes = gAllocatedBytes.load() - bytesBefore;
+
+	Tally all;
+	for (std::vector<Tally>::const_iterator tally = tallies.begin(); tally != tallies.end(); ++tally) {
+		all.latencies.insert(all.latencies.end(), tally->latencies.begin(), tally->latencies.end());
+		all.accepted += tally->accepted;
+		all.rejected += tally->rejected;
+		all.exits += tally->exits;
+	}
+	std::sort(all.latencies.begin(), all.latencies.end());
+	double const parses = static_cast<double>(all.latencies.size());
+
+	std::printf("outcomes    %lu accepted, %lu rejected, %lu help/version\n", all.accepted, all.rejected, all.exits);
+	std::printf("throughput  %.0f parses/s (%.3f s)\n", parses / wall.count(), wall.count());
+	std::printf("latency     p50 %.2f us  p90 %.2f us  p99 %.2f us  p99.9 %.2f us  max %.2f us\n",
+		    percentile(all.latencies, 50), percentile(all.latencies, 90), percentile(all.latencies, 99),
+		    percentile(all.latencies, 99.9), all.latencies.back());
+	// the latency vectors were reserved up front, so these are the library's allocations
+	std::printf("allocations %.1f per parse, %.0f bytes per parse\n", allocations / parses, bytes / parses);
+	return 0;
+}
@@ -0,0 +1,148 @@
+//
+//  validate.cpp
+//  docopt
+//
+//  Parser::validate against a full Parser::parse, over the same invocations: what skipping the
+//  collected values and the result map saves when only acceptance is wanted.
+//
+//  Usage: validate [iterations]
+//
+
+#include "docopt.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace {
+	char const kNavalFate[] =
+		"Naval Fate.\n"
+		"\n"
+		"Usage:\n"
+		"  naval_fate ship new <name>...\n"
+		"  naval_fate ship <name> move <x> <y> [--speed=<kn>]\n"
+		"  naval_fate ship shoot <x> <y>\n"
+		"  naval_fate mine (set|remove) <x> <y> [--moored | --drifting]\n"
+		"  naval_fate (-h | --help)\n"
+		"  naval_fate --version\n"
+		"\n"
+		"Options:\n"
+		"  -h --help     Show this screen.\n"
+		"  --version     Show version.\n"
+		"  --speed=<kn>  Speed in knots [default: 10].\n"
+		"  --moored      Moored (anchored) mine.\n"
+		"  --drifting    Drifting mine.\n";
+
+	struct Workload {
+		char const* name;
+		docopt::Parser parser;
+		std::vector<std::vector<std::string> > argvs;
+	};
+
+	std::vector<std::string> split_words(std::string const& line)
+	{
+		std::vector<std::string> ret;
+		std::string::size_type begin = 0;
+		while (begin < line.size()) {
+			std::string::size_type end = line.find(' ', begin);
+			if (end == std::string::npos)
+				end = line.size();
+			ret.push_back(line.substr(begin, end - begin));
+			begin = end + 1;
+		}
+		return ret;
+	}
+
+	Workload naval_fate()
+	{
+		Workload ret;
+		ret.name = "naval_fate";
+		ret.parser = docopt::Parser(kNavalFate);
+
+		char const* const lines[] = {
+			"ship new a b c",
+			"ship a move 1 2",
+			"ship a move 1 2 --speed=3",
+			"ship shoot 1 2",
+			"mine set 1 2 --drifting",
+			"mine remove 1 2 --moored --drifting", // rejected
+			"ship a move 1",                       // rejected
+		};
+		for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+			ret.argvs.push_back(split_words(lines[i]));
+		return ret;
+	}
+
+	// a tool with many options behind [options] and long argument lists
+	Workload wide()
+	{
+		std::string doc =
+			"Usage: tool [options] <file>...\n"
+			"       tool [options] --batch=<list> <file>...\n"
+			"\n"
+			"Options:\n";
+		for (int i = 0; i < 200; ++i) {
+			char line[64];
+			std::sprintf(line, "  --opt%d=<v>  Option %d [default: %d].\n", i, i, i);
+			doc += line;
+		}
+
+		Workload ret;
+		ret.name = "wide";
+		ret.parser = docopt::Parser(doc);
+
+		std::string line = "--opt3=x --opt150=y --opt7=z";
+		for (int i = 0; i < 50; ++i) {
+			char file[32];
+			std::sprintf(file, " f%d", i);
+			line += file;
+		}
+		ret.argvs.push_back(split_words(line));
+		ret.argvs.push_back(split_words("--batch=a --opt1=b f"));
+		ret.argvs.push_back(split_words("--opt1=b")); // rejected
+		return ret;
+	}
+
+	double seconds(std::clock_t start)
+	{
+		return double(std::clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	void run(Workload const& workload, int iterations)
+	{
+		unsigned long accepted = 0;
+		std::clock_t start = std::clock();
+		for (int i = 0; i < iterations; ++i) {
+			for (size_t a = 0; a < workload.argvs.size(); ++a) {
+				try {
+					accepted += workload.parser.parse(workload.argvs[a], false, false).empty() ? 0 : 1;
+				} catch (docopt::DocoptArgumentError const&) {
+				}
+			}
+		}
+		double const parse = seconds(start);
+
+		unsigned long validated = 0;
+		start = std::clock();
+		for (int i = 0; i < iterations; ++i) {
+			for (size_t a = 0; a < workload.argvs.size(); ++a)
+				validated += workload.parser.validate(workload.argvs[a], false, false) == docopt::Accepted ? 1 : 0;
+		}
+		double const validate = seconds(start);
+
+		double const calls = double(iterations) * workload.argvs.size();
+		std::printf("%-12s parse %8.2f us/argv   validate %8.2f us/argv   (%lu/%lu accepted)\n",
+			    workload.name, parse * 1e6 / calls, validate * 1e6 / calls, validated, accepted);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int const iterations = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+	run(naval_fate(), iterations);
+	run(wide(), iterations);
+	return 0;
+}
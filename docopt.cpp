@@ -14,17 +14,98 @@
 
 #include <vector>
 #include <map>
+#include <list>
 #include <string>
 #include <iostream>
+#include <stdexcept>
 #include <cassert>
+#include <cctype>
 #include <cstddef>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
+#if defined(__unix__) || defined(__APPLE__)
+	#define DOCOPT_HAS_MMAP 1
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#else
+	#define DOCOPT_HAS_MMAP 0
+	#include <fstream>
+	#include <iterator>
+#endif
+
+#include <boost/bind/bind.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/format.hpp>
+#include <boost/function.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/pointer_cast.hpp>
+#include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 using namespace docopt;
 
+#pragma mark -
+#pragma mark Values
+
+DOCOPT_INLINE
+size_t docopt::value::hash() const
+{
+	switch (kind) {
+		case String:
+			return boost::hash<std::string>()(variant.strValue);
+
+		case StringList: {
+			size_t seed = boost::hash<size_t>()(variant.strList.size());
+			for(std::vector<std::string>::const_iterator it = variant.strList.begin(); it != variant.strList.end(); ++it)
+			{
+				boost::hash_combine(seed, *it);
+			}
+			return seed;
+		}
+
+		case Bool:
+			return boost::hash<bool>()(variant.boolValue);
+
+		case Long:
+			return boost::hash<long>()(variant.longValue);
+
+		case Empty:
+		default:
+			return boost::hash<void*>()(NULL);
+	}
+}
+
+DOCOPT_INLINE
+docopt::value::value(std::string v)
+: kind(String),
+  numeric(false)
+{
+	variant.strValue.swap(v);
+
+	// Convert anything that looks like a number now, so asLong() never has to. Only an optional
+	// sign and digits can convert, which spares lexical_cast (and its exception) the other strings.
+	std::string const& str = variant.strValue;
+	size_t const digits = (!str.empty() && (str[0] == '+' || str[0] == '-')) ? 1 : 0;
+	if (str.size() > digits && str.find_first_not_of("0123456789", digits) == std::string::npos) {
+		try {
+			variant.longValue = boost::lexical_cast<long>(str);
+			numeric = true;
+		} catch(const boost::bad_lexical_cast&) {
+			// too big for a long
+		}
+	}
+}
+
 DOCOPT_INLINE
 std::ostream& docopt::operator<<(std::ostream& os, value const& val)
 {
@@ -56,37 +137,178 @@ std::ostream& docopt::operator<<(std::ostream& os, value const& val)
 	return os;
 }
 
+#pragma mark -
+#pragma mark Fingerprints
+
+namespace {
+	// 64-bit FNV-1a, fed the way docopt::fingerprint documents
+	class Fnv {
+	public:
+		Fnv() : fHash(14695981039346656037ULL) {}
+
+		void add(unsigned char byte) {
+			fHash ^= byte;
+			fHash *= 1099511628211ULL;
+		}
+
+		void add(std::string const& str) {
+			add(static_cast<uint64_t>(str.size()));
+			for (std::string::const_iterator c = str.begin(); c != str.end(); ++c)
+				add(static_cast<unsigned char>(*c));
+		}
+
+		// little-endian, whatever the platform's byte order
+		void add(uint64_t number) {
+			for (int i = 0; i < 8; ++i)
+				add(static_cast<unsigned char>(number >> (8 * i)));
+		}
+
+		uint64_t hash() const { return fHash; }
+
+	private:
+		uint64_t fHash;
+	};
+
+	uint64_t entry_fingerprint(std::string const& key, value const& val)
+	{
+		Fnv fnv;
+		for (std::string::const_iterator c = key.begin(); c != key.end(); ++c)
+			fnv.add(static_cast<unsigned char>(*c));
+		fnv.add(static_cast<unsigned char>(0));
+
+		if (val.isBool()) {
+			fnv.add(static_cast<unsigned char>(1));
+			fnv.add(static_cast<unsigned char>(val.asBool() ? 1 : 0));
+		} else if (val.isLong()) {
+			fnv.add(static_cast<unsigned char>(2));
+			fnv.add(static_cast<uint64_t>(static_cast<int64_t>(val.asLong())));
+		} else if (val.isString()) {
+			fnv.add(static_cast<unsigned char>(3));
+			fnv.add(val.asString());
+		} else if (val.isStringList()) {
+			std::vector<std::string> const& list = val.asStringList();
+			fnv.add(static_cast<unsigned char>(4));
+			fnv.add(static_cast<uint64_t>(list.size()));
+			for (std::vector<std::string>::const_iterator el = list.begin(); el != list.end(); ++el)
+				fnv.add(*el);
+		} else {
+			fnv.add(static_cast<unsigned char>(0));
+		}
+		return fnv.hash();
+	}
+
+	// args[key] = val, keeping '*sum' (when given) the fingerprint of 'args' as entries come and go
+	void set_arg(std::map<std::string, value>& args, std::string const& key, value const& val, uint64_t* sum)
+	{
+		if (!sum) {
+			args[key] = val;
+			return;
+		}
+
+		std::pair<std::map<std::string, value>::iterator, bool> entry = args.insert(std::make_pair(key, val));
+		if (!entry.second) {
+			*sum -= entry_fingerprint(key, entry.first->second);
+			entry.first->second = val;
+		}
+		*sum += entry_fingerprint(key, val);
+	}
+}
+
+DOCOPT_INLINE
+uint64_t docopt::fingerprint(std::map<std::string, value> const& args)
+{
+	uint64_t sum = 0;
+	for (std::map<std::string, value>::const_iterator arg = args.begin(); arg != args.end(); ++arg)
+		sum += entry_fingerprint(arg->first, arg->second);
+	return sum;
+}
+
 #pragma mark -
 #pragma mark Parsing stuff
 
+// What an argv element is, decided from its first bytes (and its '=' for long options)
+struct ArgvToken {
+	enum Kind {
+		Positional,	// 'x', '-' or ''
+		Short,		// '-abc'
+		Long,		// '--name'
+		LongWithValue,	// '--name=value'
+		Separator	// '--'
+	};
+
+	Kind kind;
+	size_t equal; // offset of the first '=' in a LongWithValue token, npos otherwise
+};
+
+// Classify the elements [begin, end) of 'argv' in one pass, appending them to 'kinds'. The elements
+// are packed into one buffer so the '=' search is a single vector sweep instead of a find per token.
+static void classify_argv(std::vector<std::string> const& argv, size_t begin, size_t end, std::vector<ArgvToken>& kinds)
+{
+	std::string packed;
+	std::vector<size_t> starts;
+	starts.reserve(end - begin + 1);
+	size_t total = 0;
+	for(size_t i = begin; i < end; ++i)
+		total += argv[i].size();
+	packed.reserve(total);
+	for(size_t i = begin; i < end; ++i)
+	{
+		starts.push_back(packed.size());
+		packed.append(argv[i]);
+	}
+	starts.push_back(packed.size());
+
+	std::vector<size_t> equals;
+	find_all(packed.data(), packed.size(), '=', equals);
+
+	std::vector<size_t>::const_iterator eq = equals.begin();
+	for(size_t i = 0; i < end - begin; ++i)
+	{
+		char const* token = packed.data() + starts[i];
+		size_t const length = starts[i+1] - starts[i];
+
+		// the first '=' of this token, if any; later ones belong to the value
+		size_t equal = std::string::npos;
+		for (; eq != equals.end() && *eq < starts[i+1]; ++eq) {
+			if (equal == std::string::npos)
+				equal = *eq - starts[i];
+		}
+
+		kinds.push_back(ArgvToken());
+		ArgvToken& out = kinds.back();
+		out.equal = std::string::npos;
+		if (length < 2 || token[0] != '-') {
+			out.kind = ArgvToken::Positional;
+		} else if (token[1] != '-') {
+			out.kind = ArgvToken::Short;
+		} else if (length == 2) {
+			out.kind = ArgvToken::Separator;
+		} else if (equal != std::string::npos) {
+			out.kind = ArgvToken::LongWithValue;
+			out.equal = equal;
+		} else {
+			out.kind = ArgvToken::Long;
+		}
+	}
+}
+
 class Tokens {
 public:
-	Tokens(std::vector<std::string> tokens, bool isParsingArgv = true)
-	: fTokens(tokens),
+	// 'tokens' is read in place, so it must outlive this
+	Tokens(std::vector<std::string> const& tokens, bool isParsingArgv = true)
+	: fTokens(&tokens),
 	  fIndex(0),
-	  fIsParsingArgv(isParsingArgv)
+	  fIsParsingArgv(isParsingArgv),
+	  fEnd()
 	{}
 
 	operator bool() const {
-		return fIndex < fTokens.size();
+		return fIndex < fTokens->size();
 	}
 
 	static Tokens from_pattern(std::string const& source) {
-		static const boost::regex re_separators(
-			"(?:\\s*)" // any spaces (non-matching subgroup)
-			"("
-			"[\\[\\]\\(\\)\\|]" // one character of brackets or parens or pipe character
-			"|"
-			"\\.\\.\\."  // elipsis
-			")");
-
-		static const boost::regex re_strings(
-			"(?:\\s*)" // any spaces (non-matching subgroup)
-			"("
-			"\\S*<.*?>"  // strings, but make sure to keep "< >" strings together
-			"|"
-			"[^<>\\s]+"     // string without <>
-			")");
+		boost::regex const& re_separators = grammar().pattern_separators;
+		boost::regex const& re_strings = grammar().pattern_strings;
 
 		// We do two stages of regex matching. The '[]()' and '...' are strong delimeters
 		// and need to be split out anywhere they occur (even at the end of a token). We
@@ -94,7 +316,8 @@ public:
 		// tokens. This is a little harder than the python version, since they have regex.split
 		// and we dont have anything like that.
 
-		std::vector<std::string> tokens;
+		boost::shared_ptr<std::vector<std::string> > owned = boost::make_shared<std::vector<std::string> >();
+		std::vector<std::string>& tokens = *owned;
 		for(boost::sregex_iterator match(source.begin(), source.end(), re_separators); match != boost::sregex_iterator(); ++match)
 		{
 			// handle anything before the separator (this is the "stuff" between the delimeters)
@@ -113,27 +336,46 @@ public:
 			}
 		}
 
-		return Tokens(tokens, false);
+		Tokens ret(tokens, false);
+		ret.fOwned = owned;
+		return ret;
 	}
 
 	std::string const& current() const {
 		if (*this)
-			return fTokens[fIndex];
-
-		static std::string const empty;
-		return empty;
+			return (*fTokens)[fIndex];
+		return fEnd;
 	}
 
 	std::string the_rest() const {
 		if (!*this)
 			return "";
-		return join(fTokens.begin()+static_cast<std::ptrdiff_t>(fIndex),
-				fTokens.end(),
+		return join(fTokens->begin()+static_cast<std::ptrdiff_t>(fIndex),
+				fTokens->end(),
 				" ");
 	}
 
 	std::string pop() {
-		return fTokens.at(fIndex++);
+		return fTokens->at(fIndex++);
+	}
+
+	// how many tokens have been popped so far
+	size_t index() const { return fIndex; }
+
+	size_t size() const { return fTokens->size(); }
+
+	// pass over the tokens that are left without looking at them
+	void skip_rest() { fIndex = fTokens->size(); }
+
+	// The classification of current(); only available when parsing argv. Argv is classified a block
+	// at a time as parsing reaches it, so elements that are skipped over are never read.
+	ArgvToken const& kind() {
+		assert(fIsParsingArgv && *this);
+		if (fIndex >= fKinds.size()) {
+			size_t const end = std::min(fTokens->size(), fIndex + kClassifyBlock);
+			classify_argv(*fTokens, fKinds.size(), end, fKinds);
+		}
+		return fKinds[fIndex];
 	}
 
 	bool isParsingArgv() const { return fIsParsingArgv; }
@@ -143,9 +385,14 @@ public:
 		OptionError(const std::string& str) : std::runtime_error(str) {}
 	};
 private:
-	std::vector<std::string> fTokens;
+	static const size_t kClassifyBlock = 64;
+
+	std::vector<std::string> const* fTokens;
+	boost::shared_ptr<std::vector<std::string> > fOwned; // what fTokens points to, for those made here
+	std::vector<ArgvToken> fKinds; // the start of fTokens classified so far, when parsing argv
 	size_t fIndex;
 	bool fIsParsingArgv;
+	std::string const fEnd; // what current() reports once every token is consumed
 };
 
 template<typename T>
@@ -165,24 +412,12 @@ std::vector<T*> flat_filter(Pattern& pattern) {
 	return ret;
 }
 
-static std::vector<std::string> parse_section(std::string const& name, std::string const& source) {
-	// ECMAScript regex only has "?=" for a non-matching lookahead. In order to make sure we always have
-	// a newline to anchor our matching, we have to avoid matching the final newline of each grouping.
-	// Therefore, our regex is adjusted from the docopt Python one to use ?= to match the newlines before
-	// the following lines, rather than after.
-	boost::regex const re_section_pattern(
-		"(?:^|\\n)"  // anchored at a linebreak (or start of string)
-		"("
-		   "[^\\n]*" + name + "[^\\n]*(?=\\n?)" // a line that contains the name
-		   "(?:\\n[ \\t].*?(?=\\n|$))*"         // followed by any number of lines that are indented
-		")",
-		boost::regex::icase
-	);
-
-	std::vector<std::string> ret;
-	for(boost::sregex_iterator match(source.begin(), source.end(), re_section_pattern); match != boost::sregex_iterator(); ++match)
+// The sections are left in 'source', which must outlive them
+static std::vector<StringView> parse_section(boost::regex const& re_section_pattern, StringView source) {
+	std::vector<StringView> ret;
+	for(boost::cregex_iterator match(source.begin(), source.end(), re_section_pattern); match != boost::cregex_iterator(); ++match)
 	{
-		ret.push_back(trim((*match)[1].str()));
+		ret.push_back(trim(StringView((*match)[1].first, (*match)[1].second)));
 	}
 
 	return ret;
@@ -209,6 +444,15 @@ static bool is_argument_spec(std::string const& token) {
 	return all_of;
 }
 
+// Whether 'word' is a command word on its own (not an option, argument or group)
+static bool is_plain_command(std::string const& word) {
+	return !word.empty()
+		&& word[0] != '-'
+		&& word.find_first_of("[]()|<>.") == std::string::npos
+		&& word != "options"
+		&& !is_argument_spec(word);
+}
+
 template <typename I>
 std::vector<std::string> longOptions(I iter, I end) {
 	std::vector<std::string> ret;
@@ -225,10 +469,23 @@ static PatternList parse_long(Tokens& tokens, std::vector<Option>& options)
 	std::string longOpt, equal;
 	value val;
 
-	StringTriplet partitioned = partition(tokens.pop(), "=");
-	longOpt = partitioned.first;
-	equal = partitioned.second;
-	val = partitioned.third;
+	if (tokens.isParsingArgv()) {
+		// argv tokens already know where their '=' is
+		size_t const split = tokens.kind().equal;
+		std::string const token = tokens.pop();
+		if (split == std::string::npos) {
+			longOpt = token;
+		} else {
+			longOpt = token.substr(0, split);
+			equal = "=";
+			val = token.substr(split + 1);
+		}
+	} else {
+		StringTriplet partitioned = partition(tokens.pop(), "=");
+		longOpt = partitioned.first;
+		equal = partitioned.second;
+		val = partitioned.third;
+	}
 
 	assert(starts_with(longOpt, "--"));
 
@@ -376,10 +633,11 @@ static PatternList parse_atom(Tokens& tokens, std::vector<Option>& options)
 
 		PatternList expr = parse_expr(tokens, options);
 
-		std::string trailing = tokens.pop();
-		if (trailing != "]") {
+		// an unclosed bracket runs out of tokens
+		if (tokens.current() != "]") {
 			throw DocoptLanguageError("Mismatched '['");
 		}
+		tokens.pop();
 
 		ret.push_back(boost::make_shared<Optional>(expr));
 	} else if (token=="(") {
@@ -387,10 +645,10 @@ static PatternList parse_atom(Tokens& tokens, std::vector<Option>& options)
 
 		PatternList expr = parse_expr(tokens, options);
 
-		std::string trailing = tokens.pop();
-		if (trailing != ")") {
+		if (tokens.current() != ")") {
 			throw DocoptLanguageError("Mismatched '('");
 		}
+		tokens.pop();
 
 		ret.push_back(boost::make_shared<Required>(expr));
 	} else if (token == "options") {
@@ -506,7 +764,75 @@ static std::string formal_usage(std::string const& section) {
 	return ret;
 }
 
-static PatternList parse_argv(Tokens tokens, std::vector<Option>& options, bool options_first)
+static std::vector<Option> parse_option_descriptions(StringView text);
+
+// The options sections that belong to one subcommand, for parsers that scope their options. A
+// section headed "Remote options:" belongs to 'remote' when the usage has that command; every other
+// section is global. Argv is read with only the global options until a positional argument names a
+// subcommand, which then brings its own into the lookups.
+class OptionScopes {
+public:
+	OptionScopes(StringView doc, std::string const& usage);
+
+	bool empty() const { return fScopes.empty(); }
+
+	// whether only a subcommand's section describes 'option'
+	bool scoped(Option const& option) const { return fScoped.count(option.name()) != 0; }
+
+	// 'options' without the scoped ones
+	std::vector<Option> globals(std::vector<Option> const& options) const {
+		std::vector<Option> ret;
+		ret.reserve(options.size());
+		for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option) {
+			if (!scoped(*option))
+				ret.push_back(*option);
+		}
+		return ret;
+	}
+
+	// the options 'word' brings into scope, or NULL if it is not a subcommand with a section
+	std::vector<Option> const* scope(std::string const& word) const {
+		Scopes::const_iterator found = fScopes.find(word);
+		return found == fScopes.end() ? NULL : &found->second;
+	}
+
+	void add_footprint(Footprint& footprint) const;
+
+private:
+	typedef std::map<std::string, std::vector<Option> > Scopes;
+
+	Scopes fScopes; // by command
+	std::set<std::string> fScoped; // the names of the options in fScopes that no global section has
+};
+
+// Add a subcommand's options to those argv is read with. Anything argv added before the scope opened
+// (an unknown option used ahead of its command, or another scope's option of the same name) is
+// replaced, so that it is not an ambiguous prefix of itself from then on; 'described' entries of
+// 'options' are the global ones, which stay.
+static void open_scope(std::vector<Option>& options, size_t described, std::vector<Option> const& scope)
+{
+	for (std::vector<Option>::const_iterator option = scope.begin(); option != scope.end(); ++option) {
+		for (size_t i = options.size(); i-- > described; ) {
+			bool const sameLong = !option->longOption().empty() && options[i].longOption() == option->longOption();
+			bool const sameShort = !option->shortOption().empty() && options[i].shortOption() == option->shortOption();
+			if (sameLong || sameShort)
+				options.erase(options.begin() + static_cast<std::ptrdiff_t>(i));
+		}
+	}
+	options.insert(options.end(), scope.begin(), scope.end());
+}
+
+// Each leaf returned knows its position in the returned list; 'argv_indices' gets the index into
+// argv of the token each one was read from (several options can share one '-abc' token).
+//
+// With options_first and a 'pass_through' argument, what follows the first positional argument is
+// left in argv: a single ArgvTail for that argument stands for all of it.
+//
+// With 'scopes', 'options' should hold the global options; each subcommand's are added to them when
+// a positional argument first names it.
+static PatternList parse_argv(Tokens tokens, std::vector<Option>& options, bool options_first,
+			      std::string const& pass_through, std::vector<size_t>& argv_indices,
+			      OptionScopes const* scopes = NULL)
 {
 	// Parse command-line argument vector.
 	//
@@ -516,60 +842,156 @@ static PatternList parse_argv(Tokens tokens, std::vector<Option>& options, bool
 	//    argv ::= [ long | shorts | argument ]* [ '--' [ argument ]* ] ;
 
 	PatternList ret;
+	std::vector<std::vector<Option> const*> opened; // the scopes added to 'options' so far
+	size_t const described = options.size(); // the global options; the rest are added as argv goes
+	argv_indices.clear();
 	while (tokens) {
-		const std::string& token = tokens.current();
+		ArgvToken::Kind const kind = tokens.kind().kind;
+		size_t const index = tokens.index();
 
-		if (token=="--") {
+		if (kind==ArgvToken::Separator) {
 			// option list is done; convert all the rest to arguments
 			while (tokens) {
+				argv_indices.push_back(tokens.index());
 				ret.push_back(boost::make_shared<Argument>("", tokens.pop()));
 			}
-		} else if (starts_with(token, "--")) {
+		} else if (kind==ArgvToken::Long || kind==ArgvToken::LongWithValue) {
 			PatternList parsed = parse_long(tokens, options);
 			for(PatternList::const_iterator it = parsed.begin(); it != parsed.end(); ++it)
 			{
+				argv_indices.push_back(index);
 				ret.push_back(*it);
 			}
-		} else if (token[0]=='-' && token != "-") {
+		} else if (kind==ArgvToken::Short) {
 			PatternList parsed = parse_short(tokens, options);
 			for(PatternList::const_iterator it = parsed.begin(); it != parsed.end(); ++it)
 			{
+				argv_indices.push_back(index);
 				ret.push_back(*it);
 			}
 		} else if (options_first) {
+			if (!pass_through.empty()) {
+				argv_indices.push_back(index);
+				ret.push_back(boost::make_shared<Argument>("", tokens.pop()));
+				if (tokens) {
+					argv_indices.push_back(tokens.index());
+					ret.push_back(boost::make_shared<ArgvTail>(pass_through, tokens.index(), tokens.size()));
+					tokens.skip_rest();
+				}
+			}
+
 			// option list is done; convert all the rest to arguments
 			while (tokens) {
+				argv_indices.push_back(tokens.index());
 				ret.push_back(boost::make_shared<Argument>("", tokens.pop()));
 			}
 		} else {
+			std::vector<Option> const* scope = scopes ? scopes->scope(tokens.current()) : NULL;
+			if (scope && std::find(opened.begin(), opened.end(), scope) == opened.end()) {
+				opened.push_back(scope);
+				open_scope(options, described, *scope);
+			}
+
+			argv_indices.push_back(index);
 			ret.push_back(boost::make_shared<Argument>("", tokens.pop()));
 		}
 	}
 
+	for(size_t i = 0; i < ret.size(); ++i)
+	{
+		static_cast<LeafPattern&>(*ret[i]).setArgvPosition(i);
+	}
+
+	return ret;
+}
+
+// The options described by the lines of an options section (without its "options:" heading)
+static std::vector<Option> parse_option_descriptions(StringView text) {
+	std::vector<Option> ret;
+	std::vector<StringView> split = regex_split(text, grammar().options_delimiter);
+	for(std::vector<StringView>::const_iterator opt = split.begin(); opt != split.end(); ++opt)
+	{
+		// only the lines that describe an option are copied out
+		if (!opt->empty() && *opt->begin() == '-') {
+			ret.push_back(Option::parse(opt->str()));
+		}
+	}
 	return ret;
 }
 
-std::vector<Option> parse_defaults(std::string const& doc) {
-	// This pattern is a delimiter by which we split the options.
-	// The delimiter is a new line followed by a whitespace(s) followed by one or two hyphens.
-	static boost::regex const re_delimiter(
-		"(?:^|\\n)[ \\t]*"  // a new line with leading whitespace
-		"(?=-{1,2})"        // [split happens here] (positive lookahead) ... and followed by one or two hyphes
-	);
+static std::string lower_case(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+	return str;
+}
 
-	std::vector<Option> defaults;
-	std::vector<std::string> parsed = parse_section("options:", doc);
-	for(std::vector<std::string>::iterator s = parsed.begin(); s != parsed.end(); ++s)
+// The heading word of an options section in lower case: "remote" for "Remote options:", and
+// nothing for "Options:"
+static std::string section_heading(StringView section)
+{
+	std::string heading = lower_case(std::string(section.begin(), std::find(section.begin(), section.end(), ':')));
+
+	std::string::size_type const options = heading.rfind("options");
+	if (options == std::string::npos)
+		return std::string();
+	heading.erase(options);
+
+	std::string::size_type const last = heading.find_last_not_of(" \t");
+	if (last == std::string::npos)
+		return std::string();
+	heading.erase(last + 1);
+
+	std::string::size_type const space = heading.find_last_of(" \t");
+	return space == std::string::npos ? heading : heading.substr(space + 1);
+}
+
+DOCOPT_INLINE
+OptionScopes::OptionScopes(StringView doc, std::string const& usage)
+{
+	// the usage's commands, by their lower case spelling
+	std::map<std::string, std::string> commands;
+	for (Tokens tokens = Tokens::from_pattern(formal_usage(usage)); tokens; ) {
+		std::string const word = tokens.pop();
+		if (!is_plain_command(word))
+			continue;
+		commands.insert(std::make_pair(lower_case(word), word));
+	}
+
+	std::set<std::string> global;
+	std::vector<StringView> parsed = parse_section(grammar().options_section, doc);
+	for(std::vector<StringView>::const_iterator s = parsed.begin(); s != parsed.end(); ++s)
 	{
-		s->erase(s->begin(), s->begin() + static_cast<std::ptrdiff_t>(s->find(':')) + 1); // get rid of "options:"
+		char const* colon = std::find(s->begin(), s->end(), ':');
+		StringView const described_text(colon == s->end() ? s->begin() : colon + 1, s->end());
+		std::vector<Option> const described = parse_option_descriptions(described_text);
 
-		std::vector<std::string> split = regex_split(*s, re_delimiter);
-		for(std::vector<std::string>::const_iterator opt = split.begin(); opt != split.end(); ++opt)
-		{
-			if (starts_with(*opt, "-")) {
-				defaults.push_back(Option::parse(*opt));
-			}
+		std::map<std::string, std::string>::const_iterator command = commands.find(section_heading(*s));
+		if (command == commands.end()) {
+			for (std::vector<Option>::const_iterator option = described.begin(); option != described.end(); ++option)
+				global.insert(option->name());
+			continue;
 		}
+
+		std::vector<Option>& scope = fScopes[command->second];
+		scope.insert(scope.end(), described.begin(), described.end());
+		for (std::vector<Option>::const_iterator option = described.begin(); option != described.end(); ++option)
+			fScoped.insert(option->name());
+	}
+
+	for (std::set<std::string>::const_iterator name = global.begin(); name != global.end(); ++name)
+		fScoped.erase(*name);
+}
+
+std::vector<Option> parse_defaults(StringView doc) {
+	std::vector<Option> defaults;
+	std::vector<StringView> parsed = parse_section(grammar().options_section, doc);
+	for(std::vector<StringView>::const_iterator s = parsed.begin(); s != parsed.end(); ++s)
+	{
+		char const* colon = std::find(s->begin(), s->end(), ':');
+		StringView const described_text(colon == s->end() ? s->begin() : colon + 1, s->end()); // get rid of "options:"
+
+		std::vector<Option> const described = parse_option_descriptions(described_text);
+		defaults.insert(defaults.end(), described.begin(), described.end());
 	}
 
 	return defaults;
@@ -599,31 +1021,29 @@ static void extras(bool help, bool version, PatternList const& options) {
 }
 
 
-// Parse the doc string and generate the Pattern tree
-static std::pair<Required, std::vector<Option> > create_pattern_tree(std::string const& doc)
+static std::string usage_section(StringView doc)
 {
-	std::vector<std::string> usage_sections = parse_section("usage:", doc);
+	std::vector<StringView> usage_sections = parse_section(grammar().usage_section, doc);
 	if (usage_sections.empty()) {
 		throw DocoptLanguageError("'usage:' (case-insensitive) not found.");
 	}
 	if (usage_sections.size() > 1) {
 		throw DocoptLanguageError("More than one 'usage:' (case-insensitive).");
 	}
+	return usage_sections[0].str();
+}
 
-	std::vector<Option> options = parse_defaults(doc);
-	Required pattern = parse_pattern(formal_usage(usage_sections[0]), options);
-
+// Fix up any "[options]" shortcuts in 'pattern' with the doc options it does not name itself
+static void fill_options_shortcuts(Required& pattern, std::vector<Option> const& doc_options)
+{
 	std::vector<Option const*> pattern_options = flat_filter<Option const>(pattern);
 
 	typedef std::set<Option const*, PatternLess, std::allocator<Option const*> > UniqueOptions;
 	UniqueOptions const uniq_pattern_options(pattern_options.begin(), pattern_options.end());
 
-	// Fix up any "[options]" shortcuts with the actual option tree
 	std::vector<OptionsShortcut*> filtered = flat_filter<OptionsShortcut>(pattern);
 	for(std::vector<OptionsShortcut*>::iterator options_shortcut = filtered.begin(); options_shortcut != filtered.end(); ++options_shortcut)
 	{
-		std::vector<Option> doc_options = parse_defaults(doc);
-
 		// set(doc_options) - set(pattern_options)
 		UniqueOptions uniq_doc_options;
 		for(std::vector<Option>::const_iterator opt = doc_options.begin(); opt != doc_options.end(); ++opt)
@@ -643,53 +1063,162 @@ static std::pair<Required, std::vector<Option> > create_pattern_tree(std::string
 
 		(*options_shortcut)->setChildren(children);
 	}
+}
+
+// Generate the Pattern tree from the doc's usage section and the options it describes
+static std::pair<Required, std::vector<Option> > create_pattern_tree(std::string const& usage, std::vector<Option> const& doc_options)
+{
+	std::vector<Option> options = doc_options;
+	Required pattern = parse_pattern(formal_usage(usage), options);
 
+	fill_options_shortcuts(pattern, doc_options);
 
 	return std::make_pair(pattern, options);
 }
 
-DOCOPT_INLINE
-std::map<std::string, value>
-docopt::docopt_parse(std::string const& doc,
-			 std::vector<std::string> const& argv,
-			 bool help,
-			 bool version,
-			 bool options_first)
+// Read argv for matching (see parse_argv), reporting bad options as argument errors
+static PatternList read_argv(std::vector<std::string> const& argv, std::vector<Option>& options, bool options_first,
+			     std::string const& pass_through, std::vector<size_t>& argv_indices, OptionScopes const* scopes)
 {
-	Required pattern;
-	std::vector<Option> options;
 	try {
-		std::pair<Required, std::vector<Option> > patternTree = create_pattern_tree(doc);
-		pattern = patternTree.first;
-		options = patternTree.second;
+		return parse_argv(Tokens(argv), options, options_first, pass_through, argv_indices, scopes);
 	} catch (Tokens::OptionError const& error) {
-		throw DocoptLanguageError(error.what());
+		throw DocoptArgumentError(error.what());
 	}
+}
 
-	PatternList argv_patterns;
-	try {
-		argv_patterns = parse_argv(Tokens(argv), options, options_first);
-	} catch (Tokens::OptionError const& error) {
-		throw DocoptArgumentError(error.what());
+// The tail parse_argv left for a pass-through argument, if 'argv_patterns' has one
+static ArgvTail const* argv_tail(PatternList const& argv_patterns)
+{
+	return argv_patterns.empty() ? NULL : dynamic_cast<ArgvTail const*>(argv_patterns.back().get());
+}
+
+// The argv elements the pass-through argument's 'slot' took while matching, if they are one run at the
+// end of argv: that run goes into 'range', and the argument is left an empty list. Anything else
+// stays read into the argument, and 'range' is left empty at the end of argv.
+static void pass_through_range(MatchState& state, size_t slot, std::vector<size_t> const& argv_indices,
+			       ArgvTail const* tail, size_t tailPosition, size_t argc, ArgvRange& range)
+{
+	std::vector<size_t> taken; // argv indexes
+	for (std::vector<MatchState::Consumed>::const_iterator c = state.consumed.begin(); c != state.consumed.end(); ++c) {
+		if (c->slot != slot)
+			continue;
+		if (tail && c->position == tailPosition) {
+			for (size_t index = tail->begin(); index < tail->end(); ++index)
+				taken.push_back(index);
+		} else {
+			taken.push_back(argv_indices[c->position]);
+		}
 	}
+	if (taken.empty())
+		return;
+
+	std::sort(taken.begin(), taken.end());
+	if (taken.back() + 1 != argc || taken.back() - taken.front() + 1 != taken.size())
+		return;
+
+	range.begin = taken.front();
+	state.set(slot, value(std::vector<std::string>()));
+}
+
+// Match the user's argv against a compiled pattern. 'options' is taken by value since reading the
+// argv adds any unknown options it sees (and, with 'scopes', the options of the subcommands it names). If 'occurrences' is given, it gets what each argv element
+// matched, in argv order. 'defaults' are entries for names the pattern does not have.
+static std::map<std::string, value> match_argv(Required& pattern,
+					       std::vector<Option> options,
+					       std::vector<std::string> const& argv,
+					       bool help,
+					       bool version,
+					       bool options_first,
+					       std::vector<Occurrence>* occurrences = NULL,
+					       std::string const& pass_through = std::string(),
+					       ArgvRange* tail = NULL,
+					       uint64_t* fingerprint = NULL,
+					       OptionScopes const* scopes = NULL,
+					       std::map<std::string, value> const* defaults = NULL)
+{
+	// With a pass-through argument, what follows the first positional argument is left in argv as a
+	// tail, which the matcher only hands to that argument. Which elements it took is then recorded, to
+	// report them as a range.
+	bool const passing = tail && options_first && !pass_through.empty();
+	std::vector<Option> const described = passing ? options : std::vector<Option>();
+	if (tail)
+		tail->begin = tail->end = argv.size();
 
+	std::vector<size_t> argv_indices;
+	PatternList argv_patterns = read_argv(argv, options, options_first, passing ? pass_through : std::string(), argv_indices, scopes);
 	extras(help, version, argv_patterns);
 
-	std::vector<boost::shared_ptr<LeafPattern> > collected;
-	bool matched = pattern.fix().match(argv_patterns, collected);
+	// (values are only kept for the slots the pattern has, however many its context numbers)
+	std::vector<LeafPattern*> const leaves = pattern.leaves();
+	std::vector<size_t> slots;
+	slots.reserve(leaves.size());
+	for (std::vector<LeafPattern*>::const_iterator p = leaves.begin(); p != leaves.end(); ++p)
+		slots.push_back((*p)->slot());
+	std::sort(slots.begin(), slots.end());
+	slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+	MatchState state(occurrences != NULL || passing, true, slots);
+	MatchState::Mark const start = state.mark();
+	ArgvTail const* argvTail = argv_tail(argv_patterns);
+	boost::shared_ptr<Pattern> const keepTail = argvTail ? argv_patterns.back() : boost::shared_ptr<Pattern>();
+	size_t const tailPosition = argv_patterns.size() - 1;
+	bool matched = pattern.match(argv_patterns, state);
+	if (argvTail && !(matched && argv_patterns.empty())) {
+		// The tail was cut at the first positional argument, but the usage line argv fits takes other
+		// arguments after that one, or the pass-through argument is that one: read it element by
+		// element after all
+		state.undo(start);
+		options = described;
+		argv_patterns = read_argv(argv, options, options_first, std::string(), argv_indices, scopes);
+		argvTail = NULL;
+		matched = pattern.match(argv_patterns, state);
+	}
+
 	if (matched && argv_patterns.empty()) {
 		std::map<std::string, value> ret;
+		uint64_t sum = 0;
+		uint64_t* const summing = fingerprint ? &sum : NULL;
 
-		// (a.name, a.value) for a in (pattern.flat() + collected)
-		std::vector<LeafPattern*> leaves = pattern.leaves();
+		// (a.name, a.value) for a in pattern.flat(), with what its slot collected in place of the default
+		if (passing) {
+			for (std::vector<LeafPattern*>::const_iterator p = leaves.begin(); p != leaves.end(); ++p) {
+				if ((*p)->name() == pass_through) {
+					pass_through_range(state, (*p)->slot(), argv_indices, argvTail, tailPosition, argv.size(), *tail);
+					break;
+				}
+			}
+		}
 		for(std::vector<LeafPattern*>::const_iterator p = leaves.begin(); p != leaves.end(); ++p)
 		{
-			ret[(*p)->name()] = (*p)->getValue();
+			value const& collected = state.get((*p)->slot());
+			set_arg(ret, (*p)->name(), collected ? collected : (*p)->getValue(), summing);
+		}
+		if (defaults) {
+			for (std::map<std::string, value>::const_iterator arg = defaults->begin(); arg != defaults->end(); ++arg) {
+				if (!ret.count(arg->first))
+					set_arg(ret, arg->first, arg->second, summing);
+			}
 		}
 
-		for(std::vector<boost::shared_ptr<LeafPattern> >::const_iterator p = collected.begin(); p != collected.end(); ++p)
-		{
-			ret[(*p)->name()] = (*p)->getValue();
+		if (fingerprint)
+			*fingerprint = sum;
+
+		if (occurrences) {
+			// every parsed argv element was consumed exactly once, so they can be laid out by position
+			std::vector<MatchState::Consumed const*> byPosition(argv_indices.size());
+			for(std::vector<MatchState::Consumed>::const_iterator c = state.consumed.begin(); c != state.consumed.end(); ++c)
+			{
+				byPosition[c->position] = &*c;
+			}
+
+			occurrences->clear();
+			occurrences->reserve(state.consumed.size());
+			for(size_t position = 0; position < byPosition.size(); ++position)
+			{
+				MatchState::Consumed const& c = *byPosition[position];
+				occurrences->push_back(Occurrence(c.slot, argv_indices[position], c.val));
+			}
 		}
 
 		return ret;
@@ -703,30 +1232,3018 @@ docopt::docopt_parse(std::string const& doc,
 	throw DocoptArgumentError("Arguments did not match expected patterns"); // BLEH. Bad error.
 }
 
-DOCOPT_INLINE
-std::map<std::string, value>
-docopt::docopt(std::string const& doc,
-		   std::vector<std::string> const& argv,
-		   bool help,
-		   std::string const& version,
-		   bool options_first)
+// Whether argv matches a compiled pattern, found the way match_argv finds it but without
+// collecting values or building a result
+static Validation validate_argv(Required const& pattern,
+				std::vector<Option> options,
+				std::vector<std::string> const& argv,
+				bool help,
+				bool version,
+				bool options_first,
+				std::string const& pass_through = std::string(),
+				OptionScopes const* scopes = NULL)
 {
+	bool const passing = options_first && !pass_through.empty();
+	std::vector<Option> const described = passing ? options : std::vector<Option>();
+
+	PatternList argv_patterns;
+	std::vector<size_t> argv_indices;
 	try {
-		return docopt_parse(doc, argv, help, !version.empty(), options_first);
-	} catch (DocoptExitHelp const&) {
-		std::cout << doc << std::endl;
-		std::exit(0);
-	} catch (DocoptExitVersion const&) {
-		std::cout << version << std::endl;
-		std::exit(0);
-	} catch (DocoptLanguageError const& error) {
-		std::cerr << "Docopt usage string could not be parsed" << std::endl;
-		std::cerr << error.what() << std::endl;
-		std::exit(-1);
-	} catch (DocoptArgumentError const& error) {
-		std::cerr << error.what();
-		std::cout << std::endl;
-		std::cout << doc << std::endl;
+		argv_patterns = parse_argv(Tokens(argv), options, options_first, passing ? pass_through : std::string(), argv_indices, scopes);
+	} catch (Tokens::OptionError const&) {
+		return BadOption;
+	}
+
+	// as in extras()
+	if (help && isOptionSet(argv_patterns, "-h", "--help"))
+		return HelpRequested;
+	if (version && isOptionSet(argv_patterns, "--version"))
+		return VersionRequested;
+
+	MatchState state(false, false);
+	bool const split = argv_tail(argv_patterns) != NULL;
+	bool matched = pattern.match(argv_patterns, state);
+	if (split && !(matched && argv_patterns.empty())) {
+		// as in match_argv()
+		options = described;
+		try {
+			argv_patterns = parse_argv(Tokens(argv), options, options_first, std::string(), argv_indices, scopes);
+		} catch (Tokens::OptionError const&) {
+			return BadOption;
+		}
+		matched = pattern.match(argv_patterns, state);
+	}
+	if (!matched)
+		return NoMatch;
+	return argv_patterns.empty() ? Accepted : UnexpectedArgument;
+}
+
+// The options to start reading argv with, out of all of a pattern's 'options'
+static std::vector<Option> argv_options(OptionScopes const* scopes, std::vector<Option> const& options)
+{
+	return scopes ? scopes->globals(options) : options;
+}
+
+// The option, whether 'options' holds them or points at them
+static Option const& option_of(Option const& option) { return option; }
+static Option const& option_of(boost::shared_ptr<Option const> const& option) { return *option; }
+
+// Whether the option argv spells 'name' (a long one possibly abbreviated) takes an argument
+template <typename Options>
+static bool takes_argument(Options const& options, std::string const& name)
+{
+	bool const isLong = starts_with(name, "--");
+	Option const* found = NULL;
+	for (typename Options::const_iterator each = options.begin(); each != options.end(); ++each) {
+		Option const& option = option_of(*each);
+		std::string const& candidate = isLong ? option.longOption() : option.shortOption();
+		if (candidate == name)
+			return option.argCount() != 0;
+		if (isLong && !candidate.empty() && starts_with(candidate, name))
+			found = found ? NULL : &option; // only a unique prefix counts
+	}
+	return found && found->argCount() != 0;
+}
+
+// The first argv token that is neither an option nor an option's argument: the command, if argv
+// names one
+template <typename Options>
+static std::string first_positional(Options const& options, std::vector<std::string> const& argv)
+{
+	for (std::vector<std::string>::const_iterator token = argv.begin(); token != argv.end(); ++token) {
+		if (*token == "--")
+			return token + 1 == argv.end() ? "" : *(token + 1);
+
+		if (starts_with(*token, "--")) {
+			if (token->find('=') == std::string::npos && takes_argument(options, *token))
+				++token;
+		} else if ((*token)[0] == '-' && *token != "-") {
+			for (std::string::const_iterator c = token->begin() + 1; c != token->end(); ++c) {
+				if (takes_argument(options, std::string("-") + *c)) {
+					if (c + 1 == token->end())
+						++token;
+					break;
+				}
+			}
+		} else {
+			return *token;
+		}
+
+		if (token == argv.end())
+			break;
+	}
+	return "";
+}
+
+#pragma mark -
+#pragma mark Slots
+
+// Numbers the names a parser's leaves can set, so an occurrence can say which one it set without
+// carrying the name around. Numbers are handed out on first use and never change.
+class SlotTable {
+public:
+	size_t id(std::string const& name) {
+		boost::mutex::scoped_lock lock(fMutex);
+		std::pair<Ids::iterator, bool> inserted = fIds.insert(std::make_pair(name, fNames.size()));
+		if (inserted.second)
+			fNames.push_back(&inserted.first->first);
+		return inserted.first->second;
+	}
+
+	std::string const& name(size_t slot) const {
+		boost::mutex::scoped_lock lock(fMutex);
+		if (slot >= fNames.size())
+			throw std::out_of_range("No such slot: " + boost::lexical_cast<std::string>(slot));
+		return *fNames[slot];
+	}
+
+	size_t size() const {
+		boost::mutex::scoped_lock lock(fMutex);
+		return fNames.size();
+	}
+
+	// numbers every leaf of 'pattern', in name order for names not seen before
+	void assign(Pattern& pattern) {
+		std::vector<LeafPattern*> leaves = pattern.leaves();
+		std::set<std::string> names;
+		for (std::vector<LeafPattern*>::const_iterator leaf = leaves.begin(); leaf != leaves.end(); ++leaf)
+			names.insert((*leaf)->name());
+		for (std::set<std::string>::const_iterator name = names.begin(); name != names.end(); ++name)
+			id(*name);
+		for (std::vector<LeafPattern*>::const_iterator leaf = leaves.begin(); leaf != leaves.end(); ++leaf)
+			(*leaf)->setSlot(id((*leaf)->name()));
+	}
+
+	void add_footprint(Footprint& footprint) const;
+
+private:
+	typedef std::map<std::string, size_t> Ids;
+
+	Ids fIds;
+	std::vector<std::string const*> fNames; // by slot; they point at the keys of 'fIds'
+	mutable boost::mutex fMutex;
+};
+
+#pragma mark -
+#pragma mark Lazily compiled usage lines
+
+// The usage section of a doc, split into its alternatives but only compiling each one when an argv
+// first needs it. An alternative starting with a plain command word is only needed by argv whose
+// first positional argument is that word; all others are needed by every argv.
+//
+// When the whole usage is compiled together, a name that can repeat in one alternative becomes a
+// count or a list in all of them. So that compiling alternatives one at a time gives the same
+// values, each alternative's tokens are skimmed up front (without building any patterns) for the
+// names that can repeat.
+//
+// The skim also finds the options each alternative names without describing, so argv is read with
+// every option a full compile would know, and the names of every alternative, so that a result
+// matched against only some of them still has an entry (its default) for all of them.
+//
+// Alternatives can also be added and removed later. Each one keeps what it contributes to the
+// shared state (its leading command, the names it repeats, the options it names or describes), so
+// a change only touches that alternative, plus those already compiled ones it changes the meaning
+// of (by making a name repeatable, say, or changing what "[options]" stands for).
+class LazyUsage {
+public:
+	// What to match one argv against
+	struct Selection {
+		Selection() : everything(false), byCommand(false) {}
+
+		boost::shared_ptr<Required> pattern;
+		std::vector<Option> options;
+		bool everything; // whether 'pattern' holds every alternative of the usage
+		// whether argv's first positional argument picked the alternatives: those led by another
+		// command cannot match it, so what 'pattern' makes of argv is what the whole usage would
+		bool byCommand;
+
+		// every name of the usage with the value it has when argv does not set it, for the names
+		// 'pattern' lacks unless it holds everything
+		boost::shared_ptr<std::map<std::string, value> const> defaults;
+	};
+
+	LazyUsage(std::string const& section, std::vector<Option> const& doc_options, SlotTable& slots)
+	: fDocOptions(doc_options),
+	  fSlots(slots),
+	  fLive(0),
+	  fShortcutLines(0),
+	  fAdaptive(false)
+	{
+		split_alternatives(section);
+		rebuild_options();
+	}
+
+	Selection select(std::vector<std::string> const& argv) {
+		boost::mutex::scoped_lock lock(fMutex);
+
+		Index::const_iterator command = fByCommand.find(first_positional(fOptions, argv));
+		if (command == fByCommand.end())
+			return selection(fUnindexed, "");
+		Selection ret = selection(command->second, command->first);
+		ret.byCommand = true;
+		return ret;
+	}
+
+	// The word 'select' picks the lines for 'argv' by
+	std::string command(std::vector<std::string> const& argv) const {
+		boost::mutex::scoped_lock lock(fMutex);
+		return first_positional(fOptions, argv);
+	}
+
+	Selection select_all() {
+		boost::mutex::scoped_lock lock(fMutex);
+
+		std::vector<size_t> all;
+		all.reserve(fLive);
+		for (size_t i = 0; i < fLines.size(); ++i) {
+			if (!fLines[i].removed)
+				all.push_back(i);
+		}
+		return selection(all, "*");
+	}
+
+	// Add an alternative (the words after the program name) along with the options it describes,
+	// returning its line number
+	size_t add(std::string const& source, std::vector<Option> const& options) {
+		boost::mutex::scoped_lock lock(fMutex);
+
+		for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option) {
+			if ((!option->longOption().empty() && doc_option(option->longOption(), true))
+			    || (!option->shortOption().empty() && doc_option(option->shortOption(), false)))
+				throw DocoptLanguageError("Option described twice: " + option->name());
+		}
+
+		fDocOptions.insert(fDocOptions.end(), options.begin(), options.end());
+
+		Changes changes;
+		changes.shortcuts = !options.empty();
+		reanalyze_naming(options, changes);
+
+		size_t const index = add_line(source, changes);
+		fLines[index].docOptions = options;
+
+		rebuild_options();
+		invalidate(changes, index);
+		return index;
+	}
+
+	void remove(size_t index) {
+		boost::mutex::scoped_lock lock(fMutex);
+
+		if (index >= fLines.size() || fLines[index].removed)
+			throw std::runtime_error("Logic error: no usage line " + boost::lexical_cast<std::string>(index) + " to remove");
+
+		Line& line = fLines[index];
+		Changes changes;
+		account(line, -1, changes);
+		unindex(index);
+
+		// the options it described (those it only named go with it when the options are rebuilt)
+		std::vector<Option> const described = line.docOptions;
+		for (std::vector<Option>::const_iterator option = described.begin(); option != described.end(); ++option)
+			erase_option(fDocOptions, *option);
+
+		line = Line();
+		line.removed = true;
+		--fLive;
+
+		changes.shortcuts = changes.shortcuts || !described.empty();
+		reanalyze_naming(described, changes);
+		rebuild_options();
+		invalidate(changes, index);
+	}
+
+	void setAdaptive(bool adaptive) {
+		boost::mutex::scoped_lock lock(fMutex);
+		fAdaptive = adaptive;
+		for (Assembled::const_iterator pattern = fAssembled.begin(); pattern != fAssembled.end(); ++pattern)
+			set_adaptive(*pattern->second);
+	}
+
+	void add_footprint(Footprint& footprint) const;
+
+private:
+	struct Line {
+		Line() : hasShortcut(false), removed(false) {}
+
+		std::string source;                  // the words after the program name
+		std::string leading;                 // its leading command word, or empty
+		boost::shared_ptr<Pattern> pattern;  // empty until first needed
+		std::vector<std::string> names;      // every name it has
+		std::vector<std::string> repeated;   // the names that can repeat in it
+		std::vector<std::string> optionNames;// the option names it spells out
+		std::vector<Option> docOptions;      // the options described along with it
+		std::vector<Option> usageOptions;    // the options it names that nothing describes
+		bool hasShortcut;                    // whether it has "[options]"
+		bool removed;
+	};
+	typedef std::map<std::string, std::vector<size_t> > Index;
+	typedef std::map<std::string, boost::shared_ptr<Required> > Assembled;
+	typedef std::map<std::string, unsigned> Counts;
+
+	// What an added or removed alternative changed for the others
+	struct Changes {
+		Changes() : shortcuts(false) {}
+
+		std::set<std::string> repeated; // names that started or stopped repeating
+		bool shortcuts;                 // whether "[options]" stands for other options now
+	};
+
+	// The words of 'section' from 'pos' on, as [begin, end) offsets, without copying them
+	static bool next_word(std::string const& section, size_t& pos, size_t& begin, size_t& end) {
+		const char* const anySpace = " \t\r\n\v\f";
+
+		begin = section.find_first_not_of(anySpace, pos);
+		if (begin == std::string::npos)
+			return false;
+		end = section.find_first_of(anySpace, begin);
+		if (end == std::string::npos)
+			end = section.size();
+		pos = end;
+		return true;
+	}
+
+	void split_alternatives(std::string const& section) {
+		// same split as formal_usage: every occurrence of the program name starts a new alternative
+		size_t pos = section.find(':') + 1;  // skip past "usage:"
+		size_t begin, end;
+		if (!next_word(section, pos, begin, end))
+			return;
+		std::string const program = section.substr(begin, end - begin);
+
+		Changes changes; // nothing is compiled yet, so nothing can be affected
+		size_t lineStart = end;
+		while (next_word(section, pos, begin, end)) {
+			if (section.compare(begin, end - begin, program) == 0) {
+				add_line(section.substr(lineStart, begin - lineStart), changes);
+				lineStart = end;
+			}
+		}
+		add_line(section.substr(lineStart), changes);
+	}
+
+	size_t add_line(std::string const& source, Changes& changes) {
+		size_t const index = fLines.size();
+		fLines.push_back(Line());
+		Line& line = fLines.back();
+		line.source = source;
+		analyze(line);
+		account(line, 1, changes);
+		++fLive;
+
+		if (line.leading.empty()) {
+			fUnindexed.push_back(index);
+			for (Index::iterator command = fByCommand.begin(); command != fByCommand.end(); ++command)
+				command->second.push_back(index);
+		} else {
+			std::vector<size_t>& lines = fByCommand[line.leading];
+			if (lines.empty())
+				lines = fUnindexed;
+			lines.push_back(index);
+		}
+		return index;
+	}
+
+	void unindex(size_t index) {
+		Line const& line = fLines[index];
+		if (line.leading.empty()) {
+			fUnindexed.erase(std::find(fUnindexed.begin(), fUnindexed.end(), index));
+			for (Index::iterator command = fByCommand.begin(); command != fByCommand.end(); ++command)
+				command->second.erase(std::find(command->second.begin(), command->second.end(), index));
+		} else {
+			Index::iterator command = fByCommand.find(line.leading);
+			command->second.erase(std::find(command->second.begin(), command->second.end(), index));
+			if (command->second.size() == fUnindexed.size())
+				fByCommand.erase(command); // only the lines every argv needs are left
+		}
+	}
+
+	// Skim the tokens of an alternative (without building any patterns) for what it shares with the others
+	void analyze(Line& line) const {
+		std::vector<std::string> const tokens = quick_tokens(line.source);
+		size_t pos = 0;
+		Counts const counts = occurrences_expr(tokens, pos);
+
+		line.names.clear();
+		line.repeated.clear();
+		for (Counts::const_iterator count = counts.begin(); count != counts.end(); ++count) {
+			line.names.push_back(count->first);
+			if (count->second > 1)
+				line.repeated.push_back(count->first);
+		}
+
+		line.leading.clear();
+		line.hasShortcut = std::find(tokens.begin(), tokens.end(), "options") != tokens.end();
+		line.usageOptions = usage_options(tokens);
+
+		std::set<std::string> optionNames;
+		size_t wordPos = 0, begin, end;
+		bool first = true;
+		while (next_word(line.source, wordPos, begin, end)) {
+			if (first) {
+				std::string const word = line.source.substr(begin, end - begin);
+				if (is_plain_command(word))
+					line.leading = word;
+				first = false;
+			}
+			note_option_names(line.source, begin, end, optionNames);
+		}
+		line.optionNames.assign(optionNames.begin(), optionNames.end());
+	}
+
+	// The options 'tokens' name that no description covers, as parse_long and parse_short make them
+	// when the alternative is compiled
+	std::vector<Option> usage_options(std::vector<std::string> const& tokens) const {
+		std::vector<Option> ret;
+		for (std::vector<std::string>::const_iterator token = tokens.begin(); token != tokens.end(); ++token) {
+			if (starts_with(*token, "--") && *token != "--") {
+				std::string::size_type const equal = token->find('=');
+				std::string const longOpt = token->substr(0, equal);
+				if (!doc_option(longOpt, true) && !find_option(ret, longOpt))
+					ret.push_back(Option("", longOpt, equal == std::string::npos ? 0 : 1));
+			} else if (starts_with(*token, "-") && *token != "-" && *token != "--") {
+				for (std::string::size_type i = 1; i < token->size(); ++i) {
+					std::string const shortOpt = std::string("-") + (*token)[i];
+					if (Option const* option = doc_option(shortOpt, false)) {
+						if (option->argCount())
+							break; // the rest of the token is its argument
+					} else if (!find_option(ret, shortOpt)) {
+						ret.push_back(Option(shortOpt, "", 0));
+					}
+				}
+			}
+		}
+		return ret;
+	}
+
+	// the option in 'options' with the short or long form 'name'
+	static Option const* find_option(std::vector<Option> const& options, std::string const& name) {
+		for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option) {
+			if (option->longOption() == name || option->shortOption() == name)
+				return &*option;
+		}
+		return NULL;
+	}
+
+	// What argv is read with: the described options, then those the alternatives only name, first
+	// named first, the way a full compile collects them
+	void rebuild_options() {
+		fOptions = fDocOptions;
+		for (std::vector<Line>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+			for (std::vector<Option>::const_iterator option = line->usageOptions.begin(); option != line->usageOptions.end(); ++option) {
+				std::string const& name = option->longOption().empty() ? option->shortOption() : option->longOption();
+				if (!find_option(fOptions, name))
+					fOptions.push_back(*option);
+			}
+		}
+	}
+
+	// The value a full compile gives 'name' when argv does not set it
+	value default_value(std::string const& name) const {
+		boost::shared_ptr<LeafPattern> leaf;
+		if (starts_with(name, "-") && name != "-" && name != "--") {
+			Option const* option = find_option(fOptions, name);
+			leaf = boost::make_shared<Option>(option ? *option : starts_with(name, "--") ? Option("", name) : Option(name, ""));
+		} else if (is_argument_spec(name)) {
+			leaf = boost::make_shared<Argument>(name);
+		} else {
+			leaf = boost::make_shared<Command>(name);
+		}
+		if (fRepeated.count(name))
+			make_repeatable(leaf.get());
+		return leaf->getValue();
+	}
+
+	boost::shared_ptr<std::map<std::string, value> const> defaults() {
+		if (fDefaults)
+			return fDefaults;
+
+		boost::shared_ptr<std::map<std::string, value> > ret = boost::make_shared<std::map<std::string, value> >();
+		for (std::vector<Line>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+			if (line->removed)
+				continue;
+			for (std::vector<std::string>::const_iterator name = line->names.begin(); name != line->names.end(); ++name) {
+				if (!ret->count(*name))
+					(*ret)[*name] = default_value(*name);
+			}
+		}
+		if (fShortcutLines > 0) {
+			// and what "[options]" stands for
+			for (std::vector<Option>::const_iterator opt = fDocOptions.begin(); opt != fDocOptions.end(); ++opt) {
+				if (fUsageOptionNames.count(opt->name()) || fUsageOptionNames.count(opt->shortOption()) || ret->count(opt->name()))
+					continue;
+				(*ret)[opt->name()] = default_value(opt->name());
+			}
+		}
+		fDefaults = ret;
+		return fDefaults;
+	}
+
+	// Add (or with -1, take back) what an alternative contributes to the shared state
+	void account(Line const& line, int delta, Changes& changes) {
+		for (std::vector<std::string>::const_iterator name = line.repeated.begin(); name != line.repeated.end(); ++name) {
+			if (adjust(fRepeated, *name, delta))
+				changes.repeated.insert(*name);
+		}
+		for (std::vector<std::string>::const_iterator name = line.optionNames.begin(); name != line.optionNames.end(); ++name) {
+			if (adjust(fUsageOptionNames, *name, delta))
+				changes.shortcuts = true;
+		}
+		if (line.hasShortcut)
+			fShortcutLines += delta;
+	}
+
+	// returns whether 'name' came or went
+	static bool adjust(Counts& counts, std::string const& name, int delta) {
+		if (delta > 0)
+			return ++counts[name] == 1;
+
+		Counts::iterator count = counts.find(name);
+		if (--count->second != 0)
+			return false;
+		counts.erase(count);
+		return true;
+	}
+
+	static void erase_option(std::vector<Option>& options, Option const& option) {
+		for (std::vector<Option>::iterator it = options.begin(); it != options.end(); ++it) {
+			if (it->shortOption() == option.shortOption() && it->longOption() == option.longOption()) {
+				options.erase(it);
+				return;
+			}
+		}
+	}
+
+	// Whether an alternative skimmed with other options described is read the same way now
+	// depends on whether it names any of 'options'; skim those again
+	void reanalyze_naming(std::vector<Option> const& options, Changes& changes) {
+		if (options.empty())
+			return;
+
+		std::set<std::string> names;
+		for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option) {
+			if (!option->shortOption().empty())
+				names.insert(option->shortOption());
+			if (!option->longOption().empty())
+				names.insert(option->longOption());
+		}
+
+		for (std::vector<Line>::iterator line = fLines.begin(); line != fLines.end(); ++line) {
+			if (line->removed || !names_any(line->optionNames, names))
+				continue;
+			account(*line, -1, changes);
+			analyze(*line);
+			account(*line, 1, changes);
+			line->pattern.reset();
+		}
+	}
+
+	static bool names_any(std::vector<std::string> const& names, std::set<std::string> const& wanted) {
+		for (std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); ++name) {
+			if (wanted.count(*name))
+				return true;
+		}
+		return false;
+	}
+
+	// Drop the compiled patterns that 'changes' made stale, to be compiled again when next needed
+	void invalidate(Changes const& changes, size_t changed) {
+		bool const shortcuts = changes.shortcuts && fShortcutLines > 0;
+		if (shortcuts || !changes.repeated.empty()) {
+			for (size_t i = 0; i < fLines.size(); ++i) {
+				Line& line = fLines[i];
+				if (i == changed || !line.pattern)
+					continue;
+				if ((shortcuts && line.hasShortcut) || names_any(line.names, changes.repeated))
+					line.pattern.reset();
+			}
+		}
+
+		// the assembled patterns are only lists of the compiled ones, cheap to put together again
+		fAssembled.clear();
+		fDefaults.reset();
+	}
+
+	// The tokens Tokens::from_pattern finds in 'source', split by hand rather than by regex
+	static std::vector<std::string> quick_tokens(std::string const& source) {
+		std::vector<std::string> tokens;
+		std::string::size_type pos = 0;
+		while (pos < source.size()) {
+			char const c = source[pos];
+			if (isspace(static_cast<unsigned char>(c))) {
+				++pos;
+			} else if (c == '[' || c == ']' || c == '(' || c == ')' || c == '|') {
+				tokens.push_back(std::string(1, c));
+				++pos;
+			} else if (source.compare(pos, 3, "...") == 0) {
+				tokens.push_back("...");
+				pos += 3;
+			} else {
+				std::string::size_type end = pos;
+				while (end < source.size() && !isspace(static_cast<unsigned char>(source[end]))
+				       && source.find_first_of("[]()|", end) != end && source.compare(end, 3, "...") != 0) {
+					if (source[end] == '<') {
+						// keep "<...>" together, spaces and all
+						std::string::size_type close = source.find('>', end);
+						if (close != std::string::npos) {
+							end = close;
+						}
+					}
+					++end;
+				}
+				tokens.push_back(source.substr(pos, end - pos));
+				pos = end;
+			}
+		}
+		return tokens;
+	}
+
+	static void add_counts(Counts& total, Counts const& more, unsigned times) {
+		for (Counts::const_iterator count = more.begin(); count != more.end(); ++count) {
+			unsigned& sum = total[count->first];
+			sum = std::min(2u, sum + times * count->second);
+		}
+	}
+
+	// How often each leaf name can occur in one expansion of the alternative (capped at 2), the same
+	// way fix_repeating_arguments counts them: all of a sequence, the most of any one branch of an
+	// either, and twice whatever is followed by '...'
+	Counts occurrences_expr(std::vector<std::string> const& tokens, size_t& pos) const {
+		Counts ret = occurrences_seq(tokens, pos);
+		while (pos < tokens.size() && tokens[pos] == "|") {
+			++pos;
+			Counts const branch = occurrences_seq(tokens, pos);
+			for (Counts::const_iterator count = branch.begin(); count != branch.end(); ++count) {
+				unsigned& most = ret[count->first];
+				most = std::max(most, count->second);
+			}
+		}
+		return ret;
+	}
+
+	Counts occurrences_seq(std::vector<std::string> const& tokens, size_t& pos) const {
+		Counts ret;
+		while (pos < tokens.size() && tokens[pos] != "]" && tokens[pos] != ")" && tokens[pos] != "|") {
+			Counts const atom = occurrences_atom(tokens, pos);
+			unsigned times = 1;
+			if (pos < tokens.size() && tokens[pos] == "...") {
+				times = 2;
+				++pos;
+			}
+			add_counts(ret, atom, times);
+		}
+		return ret;
+	}
+
+	Counts occurrences_atom(std::vector<std::string> const& tokens, size_t& pos) const {
+		std::string const& token = tokens[pos++];
+
+		Counts ret;
+		if (token == "[" || token == "(") {
+			ret = occurrences_expr(tokens, pos);
+			++pos; // the closing bracket
+		} else if (token == "options") {
+			// the options of "[options]" are never named elsewhere in the usage
+		} else if (starts_with(token, "--") && token != "--") {
+			std::string::size_type const equal = token.find('=');
+			Option const* option = doc_option(token.substr(0, equal), true);
+			ret[option ? option->name() : token.substr(0, equal)] = 1;
+			if (option && option->argCount() && equal == std::string::npos)
+				++pos; // the option's argument
+		} else if (starts_with(token, "-") && token != "-") {
+			for (std::string::size_type i = 1; i < token.size(); ++i) {
+				std::string const shortOpt = std::string("-") + token[i];
+				Option const* option = doc_option(shortOpt, false);
+				ret[option ? option->name() : shortOpt] = 1;
+				if (option && option->argCount()) {
+					if (i + 1 == token.size())
+						++pos; // the option's argument
+					break;
+				}
+			}
+		} else {
+			ret[token] = 1;
+		}
+		return ret;
+	}
+
+	Option const* doc_option(std::string const& name, bool isLong) const {
+		for (std::vector<Option>::const_iterator option = fDocOptions.begin(); option != fDocOptions.end(); ++option) {
+			if ((isLong ? option->longOption() : option->shortOption()) == name)
+				return &*option;
+		}
+		return NULL;
+	}
+
+	// Remember the options the usage names, which "[options]" leaves out, without compiling anything
+	static void note_option_names(std::string const& section, size_t begin, size_t end, std::set<std::string>& names) {
+		std::string word = section.substr(begin, end - begin);
+		size_t const name_start = word.find_first_not_of("[(|");
+		if (name_start == std::string::npos || word[name_start] != '-' || word.size() - name_start < 2)
+			return;
+		word = word.substr(name_start, word.find_first_of("=[]()|.", name_start + 1) - name_start);
+
+		if (starts_with(word, "--")) {
+			names.insert(word);
+		} else {
+			for (std::string::const_iterator c = word.begin() + 1; c != word.end(); ++c)
+				names.insert(std::string("-") + *c);
+		}
+	}
+
+	Selection selection(std::vector<size_t> const& lines, std::string const& key) {
+		Selection ret;
+		ret.everything = lines.size() == fLive;
+
+		Assembled::const_iterator assembled = fAssembled.find(key);
+		if (assembled != fAssembled.end()) {
+			ret.pattern = assembled->second;
+		} else {
+			PatternList alternatives;
+			for (std::vector<size_t>::const_iterator line = lines.begin(); line != lines.end(); ++line)
+				alternatives.push_back(compile(fLines[*line]));
+
+			if (alternatives.size() == 1) {
+				ret.pattern = boost::make_shared<Required>(alternatives);
+			} else {
+				// (no alternatives at all gives an either that never matches)
+				ret.pattern = boost::make_shared<Required>(PatternList(1, boost::make_shared<Either>(alternatives)));
+			}
+			set_adaptive(*ret.pattern);
+			fAssembled[key] = ret.pattern;
+		}
+
+		ret.options = fOptions;
+		if (!ret.everything)
+			ret.defaults = defaults();
+		return ret;
+	}
+
+	boost::shared_ptr<Pattern> compile(Line& line) {
+		if (line.pattern)
+			return line.pattern;
+
+		size_t const known = fOptions.size();
+		try {
+			Required parsed = parse_pattern("( " + line.source + " )", fOptions);
+			line.pattern = parsed.children()[0];
+		} catch (Tokens::OptionError const& error) {
+			throw DocoptLanguageError(error.what());
+		}
+		// (anything the skim missed stays named by this line from now on)
+		line.usageOptions.insert(line.usageOptions.end(), fOptions.begin() + static_cast<std::ptrdiff_t>(known), fOptions.end());
+
+		// Fix up any "[options]" shortcuts with the options the usage does not name
+		std::vector<OptionsShortcut*> shortcuts = flat_filter<OptionsShortcut>(*line.pattern);
+		for (std::vector<OptionsShortcut*>::iterator shortcut = shortcuts.begin(); shortcut != shortcuts.end(); ++shortcut)
+		{
+			PatternList children;
+			for (std::vector<Option>::const_iterator opt = fDocOptions.begin(); opt != fDocOptions.end(); ++opt)
+			{
+				if (fUsageOptionNames.count(opt->name()) || fUsageOptionNames.count(opt->shortOption()))
+					continue;
+				children.push_back(boost::make_shared<Option>(*opt));
+			}
+			(*shortcut)->setChildren(children);
+		}
+
+		Required(PatternList(1, line.pattern)).fix();
+
+		// and whatever repeats in other alternatives
+		std::vector<LeafPattern*> leaves = line.pattern->leaves();
+		for (std::vector<LeafPattern*>::const_iterator leaf = leaves.begin(); leaf != leaves.end(); ++leaf) {
+			if (fRepeated.count((*leaf)->name()))
+				make_repeatable(*leaf);
+		}
+		fSlots.assign(*line.pattern);
+		return line.pattern;
+	}
+
+	void set_adaptive(Required& pattern) const {
+		std::vector<Either*> eithers = flat_filter<Either>(pattern);
+		for (std::vector<Either*>::const_iterator either = eithers.begin(); either != eithers.end(); ++either)
+			(*either)->setAdaptive(fAdaptive);
+	}
+
+	std::vector<Option> fDocOptions;
+	SlotTable& fSlots;
+	Counts fUsageOptionNames;            // option names the usage spells out -> how many alternatives do
+	Counts fRepeated;                    // names that can occur several times -> in how many alternatives
+	std::vector<Line> fLines;            // by line number; removed ones stay behind, emptied
+	size_t fLive;                        // how many are not removed
+	int fShortcutLines;                  // how many have "[options]"
+	Index fByCommand;                    // leading command -> the lines that argv starting with it needs
+	std::vector<size_t> fUnindexed;      // lines every argv needs
+	Assembled fAssembled;                // the patterns built so far, by leading command
+
+	std::vector<Option> fOptions;        // doc options plus those only the usage names
+	boost::shared_ptr<std::map<std::string, value> const> fDefaults; // made when first needed
+	bool fAdaptive;
+	mutable boost::mutex fMutex;
+};
+
+#pragma mark -
+#pragma mark Usage files
+
+// The contents of a file, mapped into memory where the platform allows and read in otherwise
+class MappedFile {
+public:
+	explicit MappedFile(std::string const& path)
+	: fData(""),
+	  fSize(0)
+	{
+#if DOCOPT_HAS_MMAP
+		int const fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			fail(path);
+
+		struct stat info;
+		if (::fstat(fd, &info) != 0) {
+			int const error = errno;
+			::close(fd);
+			errno = error;
+			fail(path);
+		}
+
+		// an empty file cannot be mapped, and has nothing to map anyway
+		if (info.st_size > 0) {
+			void* const mapped = ::mmap(NULL, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped == MAP_FAILED) {
+				int const error = errno;
+				::close(fd);
+				errno = error;
+				fail(path);
+			}
+			fData = static_cast<char const*>(mapped);
+			fSize = static_cast<size_t>(info.st_size);
+		}
+		::close(fd); // the mapping stays valid without it
+#else
+		std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+		if (!in)
+			fail(path);
+		fContents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		if (in.bad())
+			fail(path);
+		fData = fContents.data();
+		fSize = fContents.size();
+#endif
+	}
+
+	~MappedFile() {
+#if DOCOPT_HAS_MMAP
+		if (fSize)
+			::munmap(const_cast<char*>(fData), fSize);
+#endif
+	}
+
+	char const* data() const { return fData; }
+	size_t size() const { return fSize; }
+
+private:
+	MappedFile(MappedFile const&);
+	MappedFile& operator=(MappedFile const&);
+
+	static void fail(std::string const& path) {
+		throw std::runtime_error("Cannot read '" + path + "': " + std::strerror(errno));
+	}
+
+	char const* fData;
+	size_t fSize;
+#if !DOCOPT_HAS_MMAP
+	std::string fContents;
+#endif
+};
+
+#pragma mark -
+#pragma mark Usage text
+
+// The usage lines to show with an argument error, worked out once at compile time: all of them, or
+// just those for the command an argv starts with.
+class UsageText {
+public:
+	UsageText() {}
+
+	explicit UsageText(std::string const& section) {
+		// same split as formal_usage: every occurrence of the program name starts a new alternative
+		size_t const colon = section.find(':');
+		fHeading = section.substr(0, colon + 1);
+		std::vector<std::string> const words = split(section, colon + 1);
+		if (words.empty())
+			return;
+
+		fProgram = words[0];
+		std::vector<std::string> line;
+		for (size_t i = 1; i <= words.size(); ++i) {
+			if (i == words.size() || words[i] == fProgram) {
+				add(join(line.begin(), line.end(), " "));
+				line.clear();
+			} else {
+				line.push_back(words[i]);
+			}
+		}
+		rebuild();
+	}
+
+	// A new alternative (the words after the program name), numbered like LazyUsage numbers it
+	void add_line(std::string const& source) {
+		add(join_words(source));
+		rebuild();
+	}
+
+	void remove(size_t index) {
+		if (index < fLines.size())
+			fLines[index].removed = true;
+		rebuild();
+	}
+
+	// The heading and the lines for 'command' (see first_positional), or every line if no line
+	// starts with it
+	std::string const& for_command(std::string const& command) const {
+		std::map<std::string, std::string>::const_iterator found = fByCommand.find(command);
+		return found == fByCommand.end() ? fAll : found->second;
+	}
+
+	std::string const& all() const { return fAll; }
+
+	void add_footprint(Footprint& footprint) const;
+
+private:
+	struct Line {
+		std::string leading; // its leading command word, or empty
+		std::string text;    // the line as shown, program name and all
+		bool removed;
+	};
+
+	static std::string join_words(std::string const& source) {
+		std::vector<std::string> const words = split(source);
+		return join(words.begin(), words.end(), " ");
+	}
+
+	void add(std::string const& source) {
+		Line line;
+		line.text = "    " + fProgram + (source.empty() ? "" : " ") + source + "\n";
+		size_t const space = source.find(' ');
+		std::string const first = source.substr(0, space);
+		if (is_plain_command(first))
+			line.leading = first;
+		line.removed = false;
+		fLines.push_back(line);
+	}
+
+	void rebuild() {
+		fAll = fHeading + "\n";
+		fByCommand.clear();
+		for (std::vector<Line>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+			if (line->removed)
+				continue;
+			fAll += line->text;
+			if (!line->leading.empty()) {
+				std::string& text = fByCommand[line->leading];
+				if (text.empty())
+					text = fHeading + "\n";
+				text += line->text;
+			}
+		}
+	}
+
+	std::string fHeading; // "Usage:", as the doc spells it
+	std::string fProgram;
+	std::vector<Line> fLines;
+	std::string fAll;
+	std::map<std::string, std::string> fByCommand;
+};
+
+#pragma mark -
+#pragma mark Shared contexts
+
+// Results, parsers, elements and contexts share their state between copies through a 'refs' count in it,
+// which starts out at 1 for whoever created it.
+template <typename T>
+static T* retain(T* shared)
+{
+	if (shared)
+		shared->refs.fetch_add(1, boost::memory_order_relaxed);
+	return shared;
+}
+
+template <typename T>
+static void release(T* shared)
+{
+	if (shared && shared->refs.fetch_sub(1, boost::memory_order_acq_rel) == 1)
+		delete shared;
+}
+
+// Option descriptions as a compiled parser keeps them: each one may be shared with other parsers
+typedef std::vector<boost::shared_ptr<Option const> > SharedOptions;
+
+// Whether two leaves are the same in everything a compiled parser reads from them
+static bool same_leaf(LeafPattern const& a, LeafPattern const& b)
+{
+	if (typeid(a) != typeid(b) || a.name() != b.name() || a.slot() != b.slot() || !(a.getValue() == b.getValue()))
+		return false;
+	if (Option const* option = dynamic_cast<Option const*>(&a)) {
+		Option const& other = static_cast<Option const&>(b);
+		return option->shortOption() == other.shortOption()
+			&& option->longOption() == other.longOption()
+			&& option->argCount() == other.argCount();
+	}
+	return true;
+}
+
+// What parsers compiled with one ParserContext share. Content is looked up by hash, the way
+// fix_identities tells equal patterns apart, but each hash keeps every distinct entry that has it, so
+// a collision never hands one doc another's option; leaves also go by slot, which the shared
+// numbering makes the same for a name in every parser.
+struct docopt::ParserContext::Impl {
+	Impl() : refs(1) {}
+
+	// the context's option equal to 'option', which becomes it if there is none yet
+	boost::shared_ptr<Option const> intern(Option const& option) {
+		boost::mutex::scoped_lock lock(mutex);
+		std::vector<boost::shared_ptr<Option const> >& bucket = options[option.hash()];
+		for (size_t i = 0; i < bucket.size(); ++i) {
+			if (same_leaf(*bucket[i], option))
+				return bucket[i];
+		}
+		bucket.push_back(boost::make_shared<Option>(option));
+		return bucket.back();
+	}
+
+	// the same for a compiled (and numbered) leaf
+	boost::shared_ptr<Pattern> intern(boost::shared_ptr<Pattern> const& leaf) {
+		LeafPattern const& content = static_cast<LeafPattern const&>(*leaf);
+		boost::mutex::scoped_lock lock(mutex);
+		std::vector<boost::shared_ptr<Pattern> >& bucket = leaves[std::make_pair(leaf->hash(), content.slot())];
+		for (size_t i = 0; i < bucket.size(); ++i) {
+			if (same_leaf(static_cast<LeafPattern const&>(*bucket[i]), content))
+				return bucket[i];
+		}
+		bucket.push_back(leaf);
+		return leaf;
+	}
+
+	// has 'branch', and everything below it, hold the context's leaves instead of its own
+	void intern_leaves(BranchPattern& branch) {
+		PatternList children = branch.children();
+		for (PatternList::iterator child = children.begin(); child != children.end(); ++child) {
+			if (BranchPattern* sub = dynamic_cast<BranchPattern*>(child->get()))
+				intern_leaves(*sub);
+			else
+				*child = intern(*child);
+		}
+		branch.setChildren(children);
+	}
+
+	void add_footprint(Footprint& footprint) const;
+
+	typedef std::map<size_t, std::vector<boost::shared_ptr<Option const> > > Options;
+	typedef std::map<std::pair<size_t, size_t>, std::vector<boost::shared_ptr<Pattern> > > Leaves;
+
+	boost::atomic<unsigned long> refs;
+	SlotTable slots;
+	Options options;
+	Leaves leaves;
+	mutable boost::mutex mutex;
+};
+
+DOCOPT_INLINE
+docopt::ParserContext::ParserContext()
+: fImpl(new Impl())
+{}
+
+DOCOPT_INLINE
+docopt::ParserContext::ParserContext(ParserContext const& other)
+: fImpl(retain(other.fImpl))
+{}
+
+DOCOPT_INLINE
+docopt::ParserContext& docopt::ParserContext::operator=(ParserContext const& other)
+{
+	ParserContext copy(other);
+	std::swap(fImpl, copy.fImpl);
+	return *this;
+}
+
+DOCOPT_INLINE
+docopt::ParserContext::~ParserContext()
+{
+	release(fImpl);
+}
+
+// Options for a parser of its own
+static SharedOptions share(std::vector<Option> const& options)
+{
+	SharedOptions ret;
+	ret.reserve(options.size());
+	for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option)
+		ret.push_back(boost::make_shared<Option>(*option));
+	return ret;
+}
+
+// What matching takes, and adds the unknown options argv has to
+static std::vector<Option> unshare(SharedOptions const& options)
+{
+	std::vector<Option> ret;
+	ret.reserve(options.size());
+	for (SharedOptions::const_iterator option = options.begin(); option != options.end(); ++option)
+		ret.push_back(**option);
+	return ret;
+}
+
+#pragma mark -
+#pragma mark Compiled parsers
+
+struct docopt::Result::Data {
+	Data() : refs(1), fingerprint(0) {}
+
+	boost::atomic<unsigned long> refs;
+	std::map<std::string, value> args;
+	std::vector<Occurrence> occurrences;
+	ArgvRange passThrough;
+	uint64_t fingerprint;
+};
+
+DOCOPT_INLINE
+docopt::Result::Result()
+: fData(NULL)
+{}
+
+DOCOPT_INLINE
+docopt::Result::Result(std::map<std::string, value>& args, std::vector<Occurrence>& occurrences,
+		       ArgvRange const& passThrough, uint64_t fingerprint)
+: fData(new Data())
+{
+	fData->args.swap(args);
+	fData->occurrences.swap(occurrences);
+	fData->passThrough = passThrough;
+	fData->fingerprint = fingerprint;
+}
+
+DOCOPT_INLINE
+docopt::Result docopt::Result::adopt(std::map<std::string, value>& args)
+{
+	std::vector<Occurrence> none;
+	uint64_t const sum = docopt::fingerprint(args);
+	return Result(args, none, ArgvRange(), sum);
+}
+
+DOCOPT_INLINE
+docopt::Result::Result(Result const& other)
+: fData(retain(other.fData))
+{}
+
+DOCOPT_INLINE
+docopt::Result& docopt::Result::operator=(Result const& other)
+{
+	Result copy(other);
+	std::swap(fData, copy.fData);
+	return *this;
+}
+
+DOCOPT_INLINE
+docopt::Result::~Result()
+{
+	release(fData);
+}
+
+DOCOPT_INLINE
+std::map<std::string, value> const& docopt::Result::args() const
+{
+	if (!fData)
+		throw std::runtime_error("Logic error: args() called on an empty Result");
+	return fData->args;
+}
+
+DOCOPT_INLINE
+std::vector<Occurrence> const& docopt::Result::occurrences() const
+{
+	if (!fData)
+		throw std::runtime_error("Logic error: occurrences() called on an empty Result");
+	return fData->occurrences;
+}
+
+DOCOPT_INLINE
+ArgvRange docopt::Result::passThrough() const
+{
+	if (!fData)
+		throw std::runtime_error("Logic error: passThrough() called on an empty Result");
+	return fData->passThrough;
+}
+
+DOCOPT_INLINE
+uint64_t docopt::Result::fingerprint() const
+{
+	if (!fData)
+		throw std::runtime_error("Logic error: fingerprint() called on an empty Result");
+	return fData->fingerprint;
+}
+
+DOCOPT_INLINE
+value const& docopt::Result::operator[](std::string const& key) const
+{
+	std::map<std::string, value> const& all = args();
+	std::map<std::string, value>::const_iterator found = all.find(key);
+	if (found == all.end())
+		throw std::out_of_range("No such option, argument or command: " + key);
+	return found->second;
+}
+
+#pragma mark -
+#pragma mark Capture
+
+namespace {
+	char const kCaptureMagic[8] = { 'd', 'o', 'c', 'o', 'p', 't', '\0', '\1' };
+
+	// records are written out once this much is buffered
+	size_t const kCaptureBlock = 64 * 1024;
+
+	enum CaptureFlags {
+		kCaptureHelp = 1,
+		kCaptureVersion = 2,
+		kCaptureOptionsFirst = 4
+	};
+
+	void put_leb128(std::string& out, uint64_t number)
+	{
+		while (number >= 0x80) {
+			out += static_cast<char>((number & 0x7f) | 0x80);
+			number >>= 7;
+		}
+		out += static_cast<char>(number);
+	}
+
+	// Reads what put_leb128 and CaptureLog::record write, throwing if the data ends first
+	class CaptureReader {
+	public:
+		CaptureReader(char const* data, size_t size) : fData(data), fSize(size), fAt(0) {}
+
+		bool done() const { return fAt == fSize; }
+
+		unsigned char byte() {
+			need(1);
+			return static_cast<unsigned char>(fData[fAt++]);
+		}
+
+		uint64_t fixed64() {
+			uint64_t ret = 0;
+			for (int i = 0; i < 8; ++i)
+				ret |= static_cast<uint64_t>(byte()) << (8 * i);
+			return ret;
+		}
+
+		uint64_t leb128() {
+			uint64_t ret = 0;
+			for (int shift = 0; shift < 64; shift += 7) {
+				unsigned char const b = byte();
+				ret |= static_cast<uint64_t>(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return ret;
+			}
+			throw std::runtime_error("Corrupt capture log: number too long");
+		}
+
+		std::string string() {
+			uint64_t const size = leb128();
+			need(size);
+			std::string ret(fData + fAt, static_cast<size_t>(size));
+			fAt += static_cast<size_t>(size);
+			return ret;
+		}
+
+	private:
+		void need(uint64_t bytes) const {
+			if (bytes > fSize - fAt)
+				throw std::runtime_error("Corrupt capture log: a record is cut short");
+		}
+
+		char const* fData;
+		size_t fSize;
+		size_t fAt;
+	};
+}
+
+DOCOPT_INLINE
+uint64_t docopt::doc_fingerprint(std::string const& doc)
+{
+	Fnv fnv;
+	for (std::string::const_iterator c = doc.begin(); c != doc.end(); ++c)
+		fnv.add(static_cast<unsigned char>(*c));
+	return fnv.hash();
+}
+
+struct docopt::CaptureLog::Impl {
+	Impl() : file(NULL), failed(false) {}
+
+	// writes out the buffered records; the caller holds 'mutex'
+	void write() {
+		if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+			failed = true;
+		if (std::fflush(file) != 0)
+			failed = true;
+		buffer.clear();
+	}
+
+	std::FILE* file;
+	std::string buffer;
+	bool failed;
+	boost::mutex mutex;
+};
+
+DOCOPT_INLINE
+docopt::CaptureLog::CaptureLog(std::string const& path)
+: fImpl(NULL)
+{
+	// a log that is already there must be one, to add to it
+	bool fresh = true;
+	if (std::FILE* existing = std::fopen(path.c_str(), "rb")) {
+		char magic[sizeof(kCaptureMagic)];
+		size_t const read = std::fread(magic, 1, sizeof(magic), existing);
+		std::fclose(existing);
+		if (read != 0 && (read != sizeof(magic) || std::memcmp(magic, kCaptureMagic, sizeof(magic)) != 0))
+			throw std::runtime_error("'" + path + "' is not a capture log");
+		fresh = read == 0;
+	}
+
+	std::FILE* file = std::fopen(path.c_str(), "ab");
+	if (!file)
+		throw std::runtime_error("Cannot write '" + path + "': " + std::strerror(errno));
+
+	fImpl = new Impl();
+	fImpl->file = file;
+	if (fresh)
+		fImpl->buffer.assign(kCaptureMagic, sizeof(kCaptureMagic));
+	fImpl->buffer.reserve(kCaptureBlock + 4096);
+}
+
+DOCOPT_INLINE
+docopt::CaptureLog::~CaptureLog()
+{
+	{
+		boost::mutex::scoped_lock lock(fImpl->mutex);
+		fImpl->write();
+	}
+	std::fclose(fImpl->file);
+	delete fImpl;
+}
+
+DOCOPT_INLINE
+void docopt::CaptureLog::record(uint64_t doc,
+				std::vector<std::string> const& argv,
+				bool help,
+				bool version,
+				bool options_first)
+{
+	boost::mutex::scoped_lock lock(fImpl->mutex);
+
+	std::string& out = fImpl->buffer;
+	for (int i = 0; i < 8; ++i)
+		out += static_cast<char>(doc >> (8 * i));
+	out += static_cast<char>((help ? kCaptureHelp : 0) | (version ? kCaptureVersion : 0) | (options_first ? kCaptureOptionsFirst : 0));
+	put_leb128(out, argv.size());
+	for (std::vector<std::string>::const_iterator arg = argv.begin(); arg != argv.end(); ++arg) {
+		put_leb128(out, arg->size());
+		out += *arg;
+	}
+
+	if (out.size() >= kCaptureBlock)
+		fImpl->write();
+}
+
+DOCOPT_INLINE
+void docopt::CaptureLog::flush()
+{
+	boost::mutex::scoped_lock lock(fImpl->mutex);
+	fImpl->write();
+	if (fImpl->failed)
+		throw std::runtime_error(std::string("Writing the capture log failed: ") + std::strerror(errno));
+}
+
+DOCOPT_INLINE
+std::vector<docopt::CaptureRecord> docopt::CaptureLog::read(std::string const& path)
+{
+	MappedFile const file(path);
+	if (file.size() < sizeof(kCaptureMagic) || std::memcmp(file.data(), kCaptureMagic, sizeof(kCaptureMagic)) != 0)
+		throw std::runtime_error("'" + path + "' is not a capture log");
+
+	std::vector<CaptureRecord> ret;
+	CaptureReader reader(file.data() + sizeof(kCaptureMagic), file.size() - sizeof(kCaptureMagic));
+	while (!reader.done()) {
+		ret.push_back(CaptureRecord());
+		CaptureRecord& record = ret.back();
+		record.doc = reader.fixed64();
+		unsigned char const flags = reader.byte();
+		record.help = (flags & kCaptureHelp) != 0;
+		record.version = (flags & kCaptureVersion) != 0;
+		record.options_first = (flags & kCaptureOptionsFirst) != 0;
+		uint64_t const count = reader.leb128();
+		for (uint64_t i = 0; i < count; ++i)
+			record.argv.push_back(reader.string());
+	}
+	return ret;
+}
+
+DOCOPT_INLINE
+void docopt::setCapture(CaptureLog* log)
+{
+	capture_log().store(log, boost::memory_order_release);
+}
+
+#pragma mark -
+#pragma mark Footprints
+
+// What the standard containers and make_shared allocate per element, as far as it can be told portably
+
+static size_t string_bytes(std::string const& str)
+{
+	// short strings live inside the object itself
+	return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+static size_t strings_bytes(std::vector<std::string> const& strs)
+{
+	size_t bytes = 0;
+	for(std::vector<std::string>::const_iterator str = strs.begin(); str != strs.end(); ++str)
+		bytes += string_bytes(*str);
+	return bytes;
+}
+
+template <typename T>
+static size_t vector_bytes(std::vector<T> const& vec)
+{
+	return vec.capacity() * sizeof(T);
+}
+
+static size_t tree_node_bytes(size_t value_size)
+{
+	// color and three links
+	return value_size + 4 * sizeof(void*);
+}
+
+static size_t list_node_bytes(size_t value_size)
+{
+	return value_size + 2 * sizeof(void*);
+}
+
+static size_t hash_node_bytes(size_t value_size)
+{
+	// a link and a bucket pointer
+	return value_size + 2 * sizeof(void*);
+}
+
+static size_t shared_object_bytes(size_t object_size)
+{
+	// make_shared puts the object next to its counts, deleter and a vtable pointer
+	return object_size + 4 * sizeof(void*);
+}
+
+static size_t value_bytes(value const& val)
+{
+	if (val.isString())
+		return string_bytes(val.asString());
+	if (val.isStringList())
+		return vector_bytes(val.asStringList()) + strings_bytes(val.asStringList());
+	return 0;
+}
+
+static size_t pattern_object_size(Pattern const* pattern)
+{
+	if (dynamic_cast<Option const*>(pattern))          return sizeof(Option);
+	if (dynamic_cast<Command const*>(pattern))         return sizeof(Command);
+	if (dynamic_cast<Argument const*>(pattern))        return sizeof(Argument);
+	if (dynamic_cast<OptionsShortcut const*>(pattern)) return sizeof(OptionsShortcut);
+	if (dynamic_cast<Optional const*>(pattern))        return sizeof(Optional);
+	if (dynamic_cast<OneOrMore const*>(pattern))       return sizeof(OneOrMore);
+	if (dynamic_cast<Either const*>(pattern))          return sizeof(Either);
+	return sizeof(Required);
+}
+
+static void add_option_strings(Option const& option, Footprint& footprint)
+{
+	footprint.strings += string_bytes(option.name());
+	footprint.strings += string_bytes(option.shortOption());
+	footprint.strings += string_bytes(option.longOption());
+	footprint.strings += value_bytes(option.getValue());
+}
+
+// Adds the children of 'branch' (not the branch object itself), counting nodes shared by fix_identities once.
+// Leaves held by a ParserContext are left to the context's footprint.
+static void add_children_footprint(BranchPattern const& branch, std::set<Pattern const*>& seen, Footprint& footprint,
+				   bool sharedLeaves = false)
+{
+	footprint.nodes += vector_bytes(branch.children());
+	footprint.indexes += branch.indexBytes();
+
+	for(PatternList::const_iterator child = branch.children().begin(); child != branch.children().end(); ++child)
+	{
+		if (!seen.insert(child->get()).second)
+			continue;
+		if (sharedLeaves && !dynamic_cast<BranchPattern const*>(child->get()))
+			continue;
+
+		footprint.nodes += shared_object_bytes(pattern_object_size(child->get()));
+
+		if (BranchPattern const* sub = dynamic_cast<BranchPattern const*>(child->get())) {
+			add_children_footprint(*sub, seen, footprint, sharedLeaves);
+		} else if (Option const* option = dynamic_cast<Option const*>(child->get())) {
+			add_option_strings(*option, footprint);
+		} else {
+			LeafPattern const* leaf = static_cast<LeafPattern const*>(child->get());
+			footprint.strings += string_bytes(leaf->name());
+			footprint.strings += value_bytes(leaf->getValue());
+		}
+	}
+}
+
+DOCOPT_INLINE
+Footprint docopt::footprint(std::map<std::string, value> const& args)
+{
+	Footprint ret;
+	for(std::map<std::string, value>::const_iterator arg = args.begin(); arg != args.end(); ++arg)
+	{
+		ret.nodes += tree_node_bytes(sizeof(*arg));
+		ret.strings += string_bytes(arg->first);
+		ret.strings += value_bytes(arg->second);
+	}
+	return ret;
+}
+
+DOCOPT_INLINE
+Footprint docopt::Result::footprint() const
+{
+	if (!fData)
+		return Footprint();
+
+	Footprint ret = docopt::footprint(fData->args);
+	ret.nodes += sizeof(Data) + vector_bytes(fData->occurrences);
+	for(std::vector<Occurrence>::const_iterator occurrence = fData->occurrences.begin(); occurrence != fData->occurrences.end(); ++occurrence)
+	{
+		ret.strings += value_bytes(occurrence->val);
+	}
+	return ret;
+}
+
+// A bounded memo of argv -> Result, dropping the least recently used entries once over budget
+class ResultCache {
+public:
+	struct Key {
+		Key(std::vector<std::string> const& argv, bool help, bool version, bool options_first, bool occurrences)
+		: argv(argv),
+		  flags((help ? 1u : 0u) | (version ? 2u : 0u) | (options_first ? 4u : 0u) | (occurrences ? 8u : 0u)),
+		  hash(boost::hash_range(argv.begin(), argv.end()))
+		{
+			boost::hash_combine(hash, flags);
+#if defined(DOCOPT_CACHE_HASH_BITS)
+			// keep only the low bits, so that different argv collide (the unit tests are built this way too)
+			hash &= (size_t(1) << DOCOPT_CACHE_HASH_BITS) - 1;
+#endif
+		}
+
+		bool operator==(Key const& other) const {
+			return hash == other.hash && flags == other.flags && argv == other.argv;
+		}
+
+		std::vector<std::string> argv;
+		unsigned flags;
+		size_t hash;
+	};
+
+	explicit ResultCache(size_t maxBytes)
+	: fMaxBytes(maxBytes)
+	{}
+
+	bool find(Key const& key, Result& result) {
+		boost::mutex::scoped_lock lock(fMutex);
+		std::pair<Index::iterator, Index::iterator> range = fIndex.equal_range(key.hash);
+		for (Index::iterator it = range.first; it != range.second; ++it) {
+			if (it->second->key == key) {
+				// move to the front: it's now the most recently used
+				fEntries.splice(fEntries.begin(), fEntries, it->second);
+				result = it->second->result;
+				++fStats.hits;
+				return true;
+			}
+		}
+		++fStats.misses;
+		return false;
+	}
+
+	void insert(Key const& key, Result const& result) {
+		// the list node, its index node, the argv copy and the result it keeps alive
+		size_t bytes = list_node_bytes(sizeof(Entry)) + hash_node_bytes(sizeof(Index::value_type));
+		bytes += vector_bytes(key.argv) + result.footprint().total();
+
+		if (bytes > fMaxBytes)
+			return;
+
+		boost::mutex::scoped_lock lock(fMutex);
+		std::pair<Index::iterator, Index::iterator> range = fIndex.equal_range(key.hash);
+		for (Index::iterator it = range.first; it != range.second; ++it) {
+			if (it->second->key == key)
+				return; // another thread parsed the same argv meanwhile
+		}
+
+		fEntries.push_front(Entry(key, result, bytes));
+		fIndex.insert(std::make_pair(key.hash, fEntries.begin()));
+		fStats.bytes += bytes;
+		++fStats.entries;
+
+		while (fStats.bytes > fMaxBytes) {
+			evict_last();
+		}
+	}
+
+	// forget every entry, as when what argv parse to has changed
+	void clear() {
+		boost::mutex::scoped_lock lock(fMutex);
+		fIndex.clear();
+		fEntries.clear();
+		fStats.bytes = 0;
+		fStats.entries = 0;
+	}
+
+	CacheStats stats() const {
+		boost::mutex::scoped_lock lock(fMutex);
+		return fStats;
+	}
+
+	// what the cache costs beyond the entries it counts towards its budget
+	size_t overheadBytes() const {
+		boost::mutex::scoped_lock lock(fMutex);
+		return sizeof(*this) + fIndex.bucket_count() * sizeof(void*);
+	}
+
+private:
+	struct Entry {
+		Entry(Key const& key, Result const& result, size_t bytes)
+		: key(key), result(result), bytes(bytes)
+		{}
+
+		Key key;
+		Result result;
+		size_t bytes;
+	};
+	typedef std::list<Entry> Entries;
+	typedef boost::unordered_multimap<size_t, Entries::iterator> Index;
+
+	void evict_last() {
+		Entries::iterator last = --fEntries.end();
+		std::pair<Index::iterator, Index::iterator> range = fIndex.equal_range(last->key.hash);
+		for (Index::iterator it = range.first; it != range.second; ++it) {
+			if (it->second == last) {
+				fIndex.erase(it);
+				break;
+			}
+		}
+		fStats.bytes -= last->bytes;
+		--fStats.entries;
+		++fStats.evictions;
+		fEntries.erase(last);
+	}
+
+	size_t const fMaxBytes;
+	Entries fEntries; // most recently used first
+	Index fIndex;
+	CacheStats fStats;
+	mutable boost::mutex fMutex;
+};
+
+struct docopt::Parser::Impl {
+	Impl() : refs(1), slots(&ownSlots), context(NULL), docFingerprint(0), recordOccurrences(false), adaptive(false), complete(false) {}
+	~Impl() { release(context); }
+
+	boost::atomic<unsigned long> refs;
+	std::string doc;
+	Required pattern;
+	SharedOptions options;
+	SlotTable ownSlots;
+	SlotTable* slots; // 'ownSlots', or the context's
+	ParserContext::Impl* context; // what this parser shares with others, if it was compiled with a context
+	boost::atomic<uint64_t> docFingerprint; // doc_fingerprint(doc), once a parse has been captured
+	boost::scoped_ptr<LazyUsage> lazy; // in place of 'pattern', for lazily compiled parsers
+	boost::scoped_ptr<ResultCache> cache;
+	UsageText usage;
+	std::string passThrough; // the argument that takes the options_first tail whole, if any
+	boost::scoped_ptr<OptionScopes> scopes; // if options are scoped by subcommand (and the doc has any such scopes)
+	SharedOptions globalOptions; // 'options' without the scoped ones, when 'scopes' is set
+	bool recordOccurrences;
+	bool adaptive;
+	bool complete; // whether 'lazy' stands in for a full compile, its results holding every alternative
+};
+
+DOCOPT_INLINE
+docopt::Parser::Parser()
+: fImpl(NULL)
+{}
+
+DOCOPT_INLINE
+docopt::Parser::Parser(std::string const& doc)
+: fImpl(NULL)
+{
+	compile(doc.data(), doc.size());
+}
+
+DOCOPT_INLINE
+docopt::Parser::Parser(char const* doc, size_t size)
+: fImpl(NULL)
+{
+	compile(doc, size);
+}
+
+DOCOPT_INLINE
+docopt::Parser docopt::Parser::from_file(std::string const& path)
+{
+	MappedFile const file(path);
+	Parser ret;
+	ret.compile(file.data(), file.size());
+	return ret;
+}
+
+DOCOPT_INLINE
+docopt::Parser::Parser(std::string const& doc, ParserContext const& context)
+: fImpl(NULL)
+{
+	compile(doc.data(), doc.size(), context.fImpl);
+}
+
+DOCOPT_INLINE
+void docopt::Parser::compile(char const* doc, size_t size, ParserContext::Impl* context)
+{
+	// compile into a parser of its own, so a doc with errors leaves nothing behind
+	Parser compiled;
+	compiled.fImpl = new Impl();
+	if (context) {
+		compiled.fImpl->context = retain(context);
+		compiled.fImpl->slots = &context->slots;
+	}
+	compiled.fImpl->doc.assign(doc, size);
+	try {
+		StringView const text(doc, size);
+		std::string const usage = usage_section(text);
+		std::pair<Required, std::vector<Option> > patternTree = create_pattern_tree(usage, parse_defaults(text));
+		compiled.fImpl->usage = UsageText(usage);
+		compiled.fImpl->pattern = patternTree.first;
+		if (!context) {
+			compiled.fImpl->options = share(patternTree.second);
+		} else {
+			std::vector<Option> const& options = patternTree.second;
+			compiled.fImpl->options.reserve(options.size());
+			for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option)
+				compiled.fImpl->options.push_back(context->intern(*option));
+		}
+	} catch (Tokens::OptionError const& error) {
+		throw DocoptLanguageError(error.what());
+	}
+	compiled.fImpl->pattern.fix();
+	compiled.fImpl->slots->assign(compiled.fImpl->pattern);
+	if (context)
+		context->intern_leaves(compiled.fImpl->pattern);
+	std::swap(fImpl, compiled.fImpl);
+}
+
+DOCOPT_INLINE
+docopt::Parser::Parser(Parser const& other)
+: fImpl(retain(other.fImpl))
+{}
+
+DOCOPT_INLINE
+docopt::Parser& docopt::Parser::operator=(Parser const& other)
+{
+	Parser copy(other);
+	std::swap(fImpl, copy.fImpl);
+	return *this;
+}
+
+DOCOPT_INLINE
+docopt::Parser::~Parser()
+{
+	release(fImpl);
+}
+
+DOCOPT_INLINE
+docopt::Parser docopt::Parser::lazy(std::string const& doc)
+{
+	Parser ret;
+	ret.fImpl = new Impl();
+	ret.fImpl->doc = doc;
+	try {
+		std::string const usage = usage_section(doc);
+		std::vector<Option> const doc_options = parse_defaults(doc);
+		ret.fImpl->lazy.reset(new LazyUsage(usage, doc_options, *ret.fImpl->slots));
+		ret.fImpl->options = share(doc_options);
+		ret.fImpl->usage = UsageText(usage);
+	} catch (Tokens::OptionError const& error) {
+		throw DocoptLanguageError(error.what());
+	}
+	return ret;
+}
+
+DOCOPT_INLINE
+std::string const& docopt::Parser::usageFor(std::vector<std::string> const& argv) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: usageFor() called on an empty Parser");
+
+	// the command as argv is read for matching, skipping the arguments of the options before it
+	OptionScopes const* scopes = fImpl->scopes.get();
+	std::string const command = fImpl->lazy ? fImpl->lazy->command(argv)
+						: first_positional(scopes ? fImpl->globalOptions : fImpl->options, argv);
+	return fImpl->usage.for_command(command);
+}
+
+DOCOPT_INLINE
+std::string const& docopt::Parser::doc() const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: doc() called on an empty Parser");
+	return fImpl->doc;
+}
+
+DOCOPT_INLINE
+void docopt::Parser::setAdaptiveOrdering(bool adaptive)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: setAdaptiveOrdering() called on an empty Parser");
+
+	fImpl->adaptive = adaptive;
+	if (fImpl->lazy) {
+		fImpl->lazy->setAdaptive(adaptive);
+		return;
+	}
+
+	std::vector<Either*> eithers = flat_filter<Either>(fImpl->pattern);
+	for(std::vector<Either*>::const_iterator either = eithers.begin(); either != eithers.end(); ++either)
+	{
+		(*either)->setAdaptive(adaptive);
+	}
+}
+
+DOCOPT_INLINE
+std::map<std::string, value>
+docopt::Parser::parse(std::vector<std::string> const& argv,
+		      bool help,
+		      bool version,
+		      bool options_first) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: parse() called on an empty Parser");
+	capture(argv, help, version, options_first);
+
+	return match(argv, help, version, options_first, NULL);
+}
+
+DOCOPT_INLINE
+void docopt::Parser::capture(std::vector<std::string> const& argv, bool help, bool version, bool options_first) const
+{
+	CaptureLog* log = capture_log().load(boost::memory_order_acquire);
+	if (!log)
+		return;
+
+	// several threads may work this out at once; they all store the same number
+	uint64_t doc = fImpl->docFingerprint.load(boost::memory_order_relaxed);
+	if (!doc) {
+		doc = doc_fingerprint(fImpl->doc);
+		fImpl->docFingerprint.store(doc, boost::memory_order_relaxed);
+	}
+	log->record(doc, argv, help, version, options_first);
+}
+
+DOCOPT_INLINE
+std::map<std::string, value>
+docopt::Parser::match(std::vector<std::string> const& argv,
+		      bool help,
+		      bool version,
+		      bool options_first,
+		      std::vector<Occurrence>* occurrences,
+		      ArgvRange* passThrough,
+		      uint64_t* fingerprint) const
+{
+	std::string const& tailArgument = fImpl->passThrough;
+	OptionScopes const* scopes = fImpl->scopes.get();
+	if (!fImpl->lazy)
+		return match_argv(fImpl->pattern, unshare(scopes ? fImpl->globalOptions : fImpl->options), argv, help, version, options_first, occurrences, tailArgument, passThrough, fingerprint, scopes);
+
+	LazyUsage::Selection selection = fImpl->complete ? fImpl->lazy->select_all() : fImpl->lazy->select(argv);
+	if (selection.byCommand)
+		return match_argv(*selection.pattern, argv_options(scopes, selection.options), argv, help, version, options_first, occurrences, tailArgument, passThrough, fingerprint, scopes, selection.defaults.get());
+	if (!selection.everything) {
+		try {
+			return match_argv(*selection.pattern, argv_options(scopes, selection.options), argv, help, version, options_first, occurrences, tailArgument, passThrough, fingerprint, scopes, selection.defaults.get());
+		} catch (DocoptArgumentError const&) {
+			// argv names no command a line starts with, as far as reading it without the patterns
+			// tells: the lines that do start with one are tried too, the way a full compile would
+		}
+		selection = fImpl->lazy->select_all();
+	}
+	return match_argv(*selection.pattern, argv_options(scopes, selection.options), argv, help, version, options_first, occurrences, tailArgument, passThrough, fingerprint, scopes);
+}
+
+DOCOPT_INLINE
+docopt::Validation
+docopt::Parser::validate(std::vector<std::string> const& argv,
+			 bool help,
+			 bool version,
+			 bool options_first) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: validate() called on an empty Parser");
+
+	OptionScopes const* scopes = fImpl->scopes.get();
+	if (!fImpl->lazy)
+		return validate_argv(fImpl->pattern, unshare(scopes ? fImpl->globalOptions : fImpl->options), argv, help, version, options_first, fImpl->passThrough, scopes);
+
+	// the same fallback as in match()
+	LazyUsage::Selection selection = fImpl->complete ? fImpl->lazy->select_all() : fImpl->lazy->select(argv);
+	if (!selection.everything && !selection.byCommand) {
+		Validation const ret = validate_argv(*selection.pattern, argv_options(scopes, selection.options), argv, help, version, options_first, fImpl->passThrough, scopes);
+		if (ret == Accepted || ret == HelpRequested || ret == VersionRequested)
+			return ret;
+		selection = fImpl->lazy->select_all();
+	}
+	return validate_argv(*selection.pattern, argv_options(scopes, selection.options), argv, help, version, options_first, fImpl->passThrough, scopes);
+}
+
+DOCOPT_INLINE
+docopt::Result
+docopt::Parser::parse_result(std::vector<std::string> const& argv,
+			     bool help,
+			     bool version,
+			     bool options_first) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: parse_result() called on an empty Parser");
+	capture(argv, help, version, options_first);
+
+	bool const record = fImpl->recordOccurrences;
+	std::vector<Occurrence> occurrences;
+	ArgvRange tail;
+
+	uint64_t fingerprint = 0;
+
+	ResultCache* cache = fImpl->cache.get();
+	if (!cache) {
+		std::map<std::string, value> args = match(argv, help, version, options_first, record ? &occurrences : NULL, &tail, &fingerprint);
+		return Result(args, occurrences, tail, fingerprint);
+	}
+
+	ResultCache::Key key(argv, help, version, options_first, record);
+	Result result;
+	if (!cache->find(key, result)) {
+		std::map<std::string, value> args = match(argv, help, version, options_first, record ? &occurrences : NULL, &tail, &fingerprint);
+		result = Result(args, occurrences, tail, fingerprint);
+		cache->insert(key, result);
+	}
+	return result;
+}
+
+DOCOPT_INLINE
+void docopt::Parser::setPassThrough(std::string const& argument)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: setPassThrough() called on an empty Parser");
+
+	fImpl->passThrough = argument;
+	if (fImpl->cache)
+		fImpl->cache->clear();
+}
+
+DOCOPT_INLINE
+size_t docopt::Parser::addUsage(std::string const& line, std::string const& options)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: addUsage() called on an empty Parser");
+
+	std::vector<Option> described;
+	try {
+		described = parse_option_descriptions(options);
+	} catch (Tokens::OptionError const& error) {
+		throw DocoptLanguageError(error.what());
+	}
+
+	make_changeable();
+	size_t const ret = fImpl->lazy->add(line, described);
+	fImpl->usage.add_line(line);
+	if (fImpl->cache)
+		fImpl->cache->clear();
+	return ret;
+}
+
+DOCOPT_INLINE
+void docopt::Parser::removeUsage(size_t line)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: removeUsage() called on an empty Parser");
+
+	make_changeable();
+	fImpl->lazy->remove(line);
+	fImpl->usage.remove(line);
+	if (fImpl->cache)
+		fImpl->cache->clear();
+}
+
+// A parser compiled in full keeps its usage as one tree, which has to be taken apart into its
+// alternatives (once) before they can change one at a time
+DOCOPT_INLINE
+void docopt::Parser::make_changeable()
+{
+	if (!fImpl->lazy) {
+		try {
+			fImpl->lazy.reset(new LazyUsage(usage_section(fImpl->doc), parse_defaults(fImpl->doc), *fImpl->slots));
+		} catch (Tokens::OptionError const& error) {
+			throw DocoptLanguageError(error.what());
+		}
+		fImpl->lazy->setAdaptive(fImpl->adaptive);
+		fImpl->pattern = Required();
+		fImpl->complete = true;
+	}
+}
+
+DOCOPT_INLINE
+void docopt::Parser::setOptionScoping(bool scoped)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: setOptionScoping() called on an empty Parser");
+
+	fImpl->scopes.reset();
+	fImpl->globalOptions.clear();
+	if (scoped) {
+		boost::scoped_ptr<OptionScopes> scopes(new OptionScopes(fImpl->doc, usage_section(fImpl->doc)));
+		if (!scopes->empty()) {
+			for (SharedOptions::const_iterator option = fImpl->options.begin(); option != fImpl->options.end(); ++option) {
+				if (!scopes->scoped(**option))
+					fImpl->globalOptions.push_back(*option);
+			}
+			fImpl->scopes.swap(scopes);
+		}
+	}
+	if (fImpl->cache)
+		fImpl->cache->clear();
+}
+
+DOCOPT_INLINE
+void docopt::Parser::setRecordOccurrences(bool record)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: setRecordOccurrences() called on an empty Parser");
+
+	fImpl->recordOccurrences = record;
+}
+
+DOCOPT_INLINE
+std::string const& docopt::Parser::slotName(size_t slot) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: slotName() called on an empty Parser");
+
+	return fImpl->slots->name(slot);
+}
+
+DOCOPT_INLINE
+size_t docopt::Parser::slotCount() const
+{
+	if (!fImpl)
+		return 0;
+	return fImpl->slots->size();
+}
+
+DOCOPT_INLINE
+void docopt::Parser::enableCache(size_t maxBytes)
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: enableCache() called on an empty Parser");
+
+	fImpl->cache.reset(maxBytes ? new ResultCache(maxBytes) : NULL);
+}
+
+DOCOPT_INLINE
+CacheStats docopt::Parser::cacheStats() const
+{
+	if (!fImpl || !fImpl->cache)
+		return CacheStats();
+	return fImpl->cache->stats();
+}
+
+DOCOPT_INLINE
+Footprint docopt::Parser::footprint() const
+{
+	Footprint ret;
+	if (!fImpl)
+		return ret;
+
+	// what is shared through a context is in the context's footprint
+	bool const shared = fImpl->context != NULL;
+
+	ret.nodes += sizeof(Impl);
+	ret.strings += string_bytes(fImpl->doc);
+	if (!shared)
+		fImpl->slots->add_footprint(ret);
+	fImpl->usage.add_footprint(ret);
+	ret.strings += string_bytes(fImpl->passThrough);
+
+	std::set<Pattern const*> seen;
+	add_children_footprint(fImpl->pattern, seen, ret, shared);
+	if (fImpl->lazy) {
+		ret.nodes += sizeof(LazyUsage);
+		fImpl->lazy->add_footprint(ret);
+	}
+
+	ret.options += vector_bytes(fImpl->options);
+	for(SharedOptions::const_iterator option = fImpl->options.begin(); !shared && option != fImpl->options.end(); ++option)
+	{
+		ret.options += shared_object_bytes(sizeof(Option));
+		add_option_strings(**option, ret);
+	}
+
+	if (fImpl->scopes) {
+		ret.nodes += sizeof(OptionScopes);
+		fImpl->scopes->add_footprint(ret);
+		ret.options += vector_bytes(fImpl->globalOptions);
+	}
+
+	if (fImpl->cache) {
+		ret.indexes += fImpl->cache->overheadBytes() + fImpl->cache->stats().bytes;
+	}
+
+	return ret;
+}
+
+DOCOPT_INLINE
+Footprint docopt::ParserContext::footprint() const
+{
+	Footprint ret;
+	ret.nodes += sizeof(Impl);
+	fImpl->add_footprint(ret);
+	return ret;
+}
+
+DOCOPT_INLINE
+void docopt::ParserContext::Impl::add_footprint(Footprint& footprint) const
+{
+	slots.add_footprint(footprint);
+
+	boost::mutex::scoped_lock lock(mutex);
+
+	footprint.indexes += options.size() * tree_node_bytes(sizeof(Options::value_type));
+	for (Options::const_iterator bucket = options.begin(); bucket != options.end(); ++bucket) {
+		footprint.indexes += vector_bytes(bucket->second);
+		for (size_t i = 0; i < bucket->second.size(); ++i) {
+			footprint.options += shared_object_bytes(sizeof(Option));
+			add_option_strings(*bucket->second[i], footprint);
+		}
+	}
+
+	footprint.indexes += leaves.size() * tree_node_bytes(sizeof(Leaves::value_type));
+	for (Leaves::const_iterator bucket = leaves.begin(); bucket != leaves.end(); ++bucket) {
+		footprint.indexes += vector_bytes(bucket->second);
+		for (size_t i = 0; i < bucket->second.size(); ++i) {
+			Pattern const* leaf = bucket->second[i].get();
+			footprint.nodes += shared_object_bytes(pattern_object_size(leaf));
+			if (Option const* option = dynamic_cast<Option const*>(leaf)) {
+				add_option_strings(*option, footprint);
+			} else {
+				LeafPattern const& other = static_cast<LeafPattern const&>(*leaf);
+				footprint.strings += string_bytes(other.name());
+				footprint.strings += value_bytes(other.getValue());
+			}
+		}
+	}
+}
+
+DOCOPT_INLINE
+void UsageText::add_footprint(Footprint& footprint) const
+{
+	footprint.strings += string_bytes(fHeading) + string_bytes(fProgram) + string_bytes(fAll);
+	footprint.nodes += vector_bytes(fLines);
+	for (std::vector<Line>::const_iterator line = fLines.begin(); line != fLines.end(); ++line)
+		footprint.strings += string_bytes(line->leading) + string_bytes(line->text);
+
+	footprint.indexes += fByCommand.size() * tree_node_bytes(sizeof(std::map<std::string, std::string>::value_type));
+	for (std::map<std::string, std::string>::const_iterator command = fByCommand.begin(); command != fByCommand.end(); ++command)
+		footprint.strings += string_bytes(command->first) + string_bytes(command->second);
+}
+
+DOCOPT_INLINE
+void OptionScopes::add_footprint(Footprint& footprint) const
+{
+	for (Scopes::const_iterator scope = fScopes.begin(); scope != fScopes.end(); ++scope) {
+		footprint.indexes += tree_node_bytes(sizeof(*scope)) + string_bytes(scope->first);
+		footprint.options += vector_bytes(scope->second);
+		for (std::vector<Option>::const_iterator option = scope->second.begin(); option != scope->second.end(); ++option)
+			add_option_strings(*option, footprint);
+	}
+	for (std::set<std::string>::const_iterator name = fScoped.begin(); name != fScoped.end(); ++name)
+		footprint.indexes += tree_node_bytes(sizeof(*name)) + string_bytes(*name);
+}
+
+DOCOPT_INLINE
+void SlotTable::add_footprint(Footprint& footprint) const
+{
+	boost::mutex::scoped_lock lock(fMutex);
+
+	footprint.indexes += vector_bytes(fNames) + fIds.size() * tree_node_bytes(sizeof(Ids::value_type));
+	for (Ids::const_iterator slot = fIds.begin(); slot != fIds.end(); ++slot)
+		footprint.strings += string_bytes(slot->first);
+}
+
+DOCOPT_INLINE
+void LazyUsage::add_footprint(Footprint& footprint) const
+{
+	boost::mutex::scoped_lock lock(fMutex);
+
+	footprint.options += vector_bytes(fDocOptions) + vector_bytes(fOptions);
+	for (std::vector<Option>::const_iterator option = fDocOptions.begin(); option != fDocOptions.end(); ++option)
+		add_option_strings(*option, footprint);
+	for (std::vector<Option>::const_iterator option = fOptions.begin(); option != fOptions.end(); ++option)
+		add_option_strings(*option, footprint);
+
+	footprint.nodes += vector_bytes(fLines);
+	footprint.indexes += vector_bytes(fUnindexed);
+	for (std::vector<Line>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+		footprint.strings += string_bytes(line->source) + string_bytes(line->leading);
+		footprint.indexes += vector_bytes(line->names) + strings_bytes(line->names);
+		footprint.indexes += vector_bytes(line->repeated) + strings_bytes(line->repeated);
+		footprint.indexes += vector_bytes(line->optionNames) + strings_bytes(line->optionNames);
+		footprint.options += vector_bytes(line->docOptions) + vector_bytes(line->usageOptions);
+		for (std::vector<Option>::const_iterator option = line->docOptions.begin(); option != line->docOptions.end(); ++option)
+			add_option_strings(*option, footprint);
+		for (std::vector<Option>::const_iterator option = line->usageOptions.begin(); option != line->usageOptions.end(); ++option)
+			add_option_strings(*option, footprint);
+	}
+	if (fDefaults) {
+		footprint.indexes += shared_object_bytes(sizeof(*fDefaults));
+		for (std::map<std::string, value>::const_iterator name = fDefaults->begin(); name != fDefaults->end(); ++name)
+			footprint.indexes += tree_node_bytes(sizeof(*name)) + string_bytes(name->first) + value_bytes(name->second);
+	}
+
+	for (Counts::const_iterator name = fUsageOptionNames.begin(); name != fUsageOptionNames.end(); ++name)
+		footprint.indexes += tree_node_bytes(sizeof(*name)) + string_bytes(name->first);
+	for (Counts::const_iterator name = fRepeated.begin(); name != fRepeated.end(); ++name)
+		footprint.indexes += tree_node_bytes(sizeof(*name)) + string_bytes(name->first);
+	for (Index::const_iterator command = fByCommand.begin(); command != fByCommand.end(); ++command)
+		footprint.indexes += tree_node_bytes(sizeof(*command)) + string_bytes(command->first) + vector_bytes(command->second);
+
+	std::set<Pattern const*> seen;
+	for (Assembled::const_iterator pattern = fAssembled.begin(); pattern != fAssembled.end(); ++pattern) {
+		footprint.indexes += tree_node_bytes(sizeof(*pattern)) + string_bytes(pattern->first);
+		footprint.nodes += shared_object_bytes(sizeof(Required));
+		add_children_footprint(*pattern->second, seen, footprint);
+	}
+}
+
+#pragma mark -
+#pragma mark Building usages in code
+
+struct docopt::Element::Node {
+	enum Kind {
+		kCommand,
+		kArgument,
+		kOption,
+		kOptions,
+		kRequired,
+		kOptional,
+		kEither,
+		kOneOrMore
+	};
+
+	Node(Kind kind, std::string const& name = std::string()) : refs(1), kind(kind), name(name) {}
+
+	// a copy is a new node, with no one else holding it yet
+	Node(Node const& other) : refs(1), kind(other.kind), name(other.name), children(other.children) {}
+
+	bool isGroup() const { return kind >= kRequired; }
+
+	boost::atomic<unsigned long> refs;
+	Kind kind;
+	std::string name;              // for commands, arguments and options
+	std::vector<Element> children; // for groups
+};
+
+static bool has_space(std::string const& str)
+{
+	for (std::string::const_iterator c = str.begin(); c != str.end(); ++c) {
+		if (isspace(static_cast<unsigned char>(*c)))
+			return true;
+	}
+	return false;
+}
+
+// whether 'name' would be read back as a single option token of the given kind
+static bool is_short_option(std::string const& name)
+{
+	return name.size() == 2 && name[0] == '-' && name[1] != '-' && !isspace(static_cast<unsigned char>(name[1]));
+}
+
+static bool is_long_option(std::string const& name)
+{
+	return name.size() > 2 && starts_with(name, "--") && name.find('=') == std::string::npos && !has_space(name);
+}
+
+DOCOPT_INLINE
+docopt::Element::Element(Element const& other)
+: fNode(retain(other.fNode))
+{}
+
+DOCOPT_INLINE
+Element& docopt::Element::operator=(Element const& other)
+{
+	Element copy(other);
+	std::swap(fNode, copy.fNode);
+	return *this;
+}
+
+DOCOPT_INLINE
+docopt::Element::~Element()
+{
+	release(fNode);
+}
+
+DOCOPT_INLINE
+Element docopt::Element::command(std::string const& name)
+{
+	if (name.empty() || name[0] == '-' || has_space(name) || is_argument_spec(name)
+	    || name == "options" || name == "..." || name == "|"
+	    || name.find_first_of("[]()") != std::string::npos)
+		throw DocoptLanguageError("Not a command word: '" + name + "'");
+	return Element(new Node(Node::kCommand, name));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::argument(std::string const& name)
+{
+	if (!is_argument_spec(name) || has_space(name))
+		throw DocoptLanguageError("Not an argument name (like <name> or NAME): '" + name + "'");
+	return Element(new Node(Node::kArgument, name));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::option(std::string const& name)
+{
+	if (!is_short_option(name) && !is_long_option(name))
+		throw DocoptLanguageError("Not an option name (like -o or --option): '" + name + "'");
+	return Element(new Node(Node::kOption, name));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::options()
+{
+	return Element(new Node(Node::kOptions));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::required()
+{
+	return Element(new Node(Node::kRequired));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::required(Element const& child)
+{
+	return required().add(child);
+}
+
+DOCOPT_INLINE
+Element docopt::Element::optional()
+{
+	return Element(new Node(Node::kOptional));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::optional(Element const& child)
+{
+	return optional().add(child);
+}
+
+DOCOPT_INLINE
+Element docopt::Element::either()
+{
+	return Element(new Node(Node::kEither));
+}
+
+DOCOPT_INLINE
+Element docopt::Element::either(Element const& first, Element const& second)
+{
+	return either().add(first).add(second);
+}
+
+DOCOPT_INLINE
+Element docopt::Element::one_or_more(Element const& child)
+{
+	Element ret(new Node(Node::kOneOrMore));
+	ret.fNode->children.push_back(child);
+	return ret;
+}
+
+DOCOPT_INLINE
+Element docopt::Element::add(Element const& child) const
+{
+	if (!fNode->isGroup() || fNode->kind == Node::kOneOrMore)
+		throw DocoptLanguageError("Logic error: add() called on an element that is not a group");
+
+	// children are shared, never changed, so a shallow copy will do
+	Element ret(new Node(*fNode));
+	ret.fNode->children.push_back(child);
+	return ret;
+}
+
+// The pattern a doc spelling out 'node' would have been read into
+static boost::shared_ptr<Pattern> build_pattern(Element::Node const& node, std::vector<Option>& options)
+{
+	switch (node.kind) {
+		case Element::Node::kCommand:
+			return boost::make_shared<Command>(node.name);
+
+		case Element::Node::kArgument:
+			return boost::make_shared<Argument>(node.name);
+
+		case Element::Node::kOption: {
+			for (std::vector<Option>::const_iterator option = options.begin(); option != options.end(); ++option) {
+				if (option->shortOption() == node.name || option->longOption() == node.name)
+					return boost::make_shared<Option>(*option);
+			}
+
+			// named in the usage only, so it is a flag
+			if (starts_with(node.name, "--")) {
+				options.push_back(Option("", node.name));
+			} else {
+				options.push_back(Option(node.name, ""));
+			}
+			return boost::make_shared<Option>(options.back());
+		}
+
+		case Element::Node::kOptions:
+			// "[options]"
+			return boost::make_shared<Optional>(PatternList(1, boost::make_shared<OptionsShortcut>()));
+
+		default:
+			break;
+	}
+
+	PatternList children;
+	for (std::vector<Element>::const_iterator child = node.children.begin(); child != node.children.end(); ++child)
+		children.push_back(build_pattern(child->node(), options));
+
+	switch (node.kind) {
+		case Element::Node::kOptional:
+			return boost::make_shared<Optional>(children);
+
+		case Element::Node::kEither:
+			if (children.empty())
+				throw DocoptLanguageError("An either group needs at least one alternative");
+			return boost::make_shared<Either>(children);
+
+		case Element::Node::kOneOrMore:
+			return boost::make_shared<OneOrMore>(children);
+
+		default:
+			return boost::make_shared<Required>(children);
+	}
+}
+
+typedef std::map<std::string, std::string> OptionSpellings;
+
+static std::string render_element(Element::Node const& node, OptionSpellings const& spellings);
+
+static std::string render_children(Element::Node const& node, OptionSpellings const& spellings, char const* separator)
+{
+	std::vector<std::string> parts;
+	for (std::vector<Element>::const_iterator child = node.children.begin(); child != node.children.end(); ++child)
+		parts.push_back(render_element(child->node(), spellings));
+	return join(parts.begin(), parts.end(), separator);
+}
+
+static std::string render_alternatives(Element::Node const& node, OptionSpellings const& spellings)
+{
+	std::vector<std::string> parts;
+	for (std::vector<Element>::const_iterator child = node.children.begin(); child != node.children.end(); ++child)
+	{
+		// a sequence needs no parentheses of its own between '|'s
+		Element::Node const& alternative = child->node();
+		if (alternative.kind == Element::Node::kRequired && !alternative.children.empty()) {
+			parts.push_back(render_children(alternative, spellings, " "));
+		} else {
+			parts.push_back(render_element(alternative, spellings));
+		}
+	}
+	return join(parts.begin(), parts.end(), " | ");
+}
+
+// 'node' the way a doc would spell it in a usage line
+static std::string render_element(Element::Node const& node, OptionSpellings const& spellings)
+{
+	switch (node.kind) {
+		case Element::Node::kCommand:
+		case Element::Node::kArgument:
+			return node.name;
+
+		case Element::Node::kOption: {
+			OptionSpellings::const_iterator spelling = spellings.find(node.name);
+			return spelling == spellings.end() ? node.name : spelling->second;
+		}
+
+		case Element::Node::kOptions:
+			return "[options]";
+
+		case Element::Node::kOptional:
+			if (node.children.size() == 1 && node.children[0].node().kind == Element::Node::kEither)
+				return "[" + render_alternatives(node.children[0].node(), spellings) + "]";
+			return "[" + render_children(node, spellings, " ") + "]";
+
+		case Element::Node::kEither:
+			return "(" + render_alternatives(node, spellings) + ")";
+
+		case Element::Node::kOneOrMore:
+			return render_children(node, spellings, " ") + "...";
+
+		case Element::Node::kRequired:
+		default:
+			return "(" + render_children(node, spellings, " ") + ")";
+	}
+}
+
+DOCOPT_INLINE
+docopt::UsageBuilder::UsageBuilder(std::string const& program)
+: fProgram(program)
+{
+	if (fProgram.empty() || has_space(fProgram))
+		throw DocoptLanguageError("Not a program name: '" + program + "'");
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::description(std::string const& text)
+{
+	fDescription = text;
+	return *this;
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::usage(Element const& line)
+{
+	fLines.push_back(line);
+	return *this;
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::flag(std::string const& shortName,
+					 std::string const& longName,
+					 std::string const& description)
+{
+	OptionSpec spec;
+	spec.shortName = shortName;
+	spec.longName = longName;
+	spec.description = description;
+	spec.hasDefault = false;
+	return declare(spec);
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::option(std::string const& shortName,
+					   std::string const& longName,
+					   std::string const& argName,
+					   std::string const& description)
+{
+	OptionSpec spec;
+	spec.shortName = shortName;
+	spec.longName = longName;
+	spec.argName = argName;
+	spec.description = description;
+	spec.hasDefault = false;
+	if (!is_argument_spec(argName) || has_space(argName))
+		throw DocoptLanguageError("Not an option argument name (like <name> or NAME): '" + argName + "'");
+	return declare(spec);
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::option(std::string const& shortName,
+					   std::string const& longName,
+					   std::string const& argName,
+					   std::string const& description,
+					   std::string const& defaultValue)
+{
+	option(shortName, longName, argName, description);
+	fOptions.back().defaultValue = defaultValue;
+	fOptions.back().hasDefault = true;
+	return *this;
+}
+
+DOCOPT_INLINE
+UsageBuilder& docopt::UsageBuilder::declare(OptionSpec const& spec)
+{
+	if (spec.shortName.empty() && spec.longName.empty())
+		throw DocoptLanguageError("An option needs a short or a long name");
+	if (!spec.shortName.empty() && !is_short_option(spec.shortName))
+		throw DocoptLanguageError("Not a short option name (like -o): '" + spec.shortName + "'");
+	if (!spec.longName.empty() && !is_long_option(spec.longName))
+		throw DocoptLanguageError("Not a long option name (like --option): '" + spec.longName + "'");
+	if (spec.description.find('\n') != std::string::npos)
+		throw DocoptLanguageError("Option descriptions must fit on one line");
+
+	for (std::vector<OptionSpec>::const_iterator other = fOptions.begin(); other != fOptions.end(); ++other) {
+		if ((!spec.shortName.empty() && other->shortName == spec.shortName)
+		    || (!spec.longName.empty() && other->longName == spec.longName))
+			throw DocoptLanguageError("Option declared twice: " + (spec.longName.empty() ? spec.shortName : spec.longName));
+	}
+
+	fOptions.push_back(spec);
+	return *this;
+}
+
+DOCOPT_INLINE
+std::string docopt::UsageBuilder::doc() const
+{
+	std::string ret;
+	if (!fDescription.empty()) {
+		ret += fDescription;
+		ret += "\n\n";
+	}
+
+	// options taking an argument are spelled with it wherever the usage names them
+	OptionSpellings spellings;
+	std::vector<std::string> names;
+	size_t width = 0;
+	for (std::vector<OptionSpec>::const_iterator spec = fOptions.begin(); spec != fOptions.end(); ++spec) {
+		std::string name = spec->shortName;
+		if (!spec->longName.empty())
+			name += (name.empty() ? "" : " ") + spec->longName;
+
+		if (!spec->argName.empty()) {
+			name += (spec->longName.empty() ? " " : "=") + spec->argName;
+			if (!spec->shortName.empty())
+				spellings[spec->shortName] = spec->shortName + " " + spec->argName;
+			if (!spec->longName.empty())
+				spellings[spec->longName] = spec->longName + "=" + spec->argName;
+		}
+
+		names.push_back(name);
+		width = std::max(width, name.size());
+	}
+
+	ret += "Usage:\n";
+	for (std::vector<Element>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+		Element::Node const& node = line->node();
+		ret += "  " + fProgram;
+		if (node.kind == Element::Node::kRequired) {
+			if (!node.children.empty())
+				ret += " " + render_children(node, spellings, " ");
+		} else {
+			ret += " " + render_element(node, spellings);
+		}
+		ret += "\n";
+	}
+
+	if (!fOptions.empty()) {
+		ret += "\nOptions:\n";
+		for (size_t i = 0; i < fOptions.size(); ++i) {
+			OptionSpec const& spec = fOptions[i];
+			ret += "  " + names[i] + std::string(width - names[i].size() + 2, ' ') + spec.description;
+			if (spec.hasDefault)
+				ret += (spec.description.empty() ? "" : " ") + ("[default: " + spec.defaultValue + "]");
+			ret += "\n";
+		}
+	}
+
+	return ret;
+}
+
+DOCOPT_INLINE
+docopt::Parser docopt::UsageBuilder::compile() const
+{
+	if (fLines.empty())
+		throw DocoptLanguageError("No usage lines to compile");
+
+	// what parse_defaults would have read from the options section
+	std::vector<Option> doc_options;
+	for (std::vector<OptionSpec>::const_iterator spec = fOptions.begin(); spec != fOptions.end(); ++spec) {
+		value val(false);
+		if (spec->hasDefault)
+			val = spec->defaultValue;
+		doc_options.push_back(Option(spec->shortName, spec->longName, spec->argName.empty() ? 0 : 1, val));
+	}
+
+	// and what parse_pattern would have made of the usage section
+	std::vector<Option> options = doc_options;
+	PatternList lines;
+	for (std::vector<Element>::const_iterator line = fLines.begin(); line != fLines.end(); ++line) {
+		Element::Node const& node = line->node();
+		if (node.kind == Element::Node::kRequired) {
+			lines.push_back(build_pattern(node, options));
+		} else {
+			lines.push_back(boost::make_shared<Required>(PatternList(1, build_pattern(node, options))));
+		}
+	}
+
+	Parser ret;
+	ret.fImpl = new Parser::Impl();
+	ret.fImpl->doc = doc();
+	ret.fImpl->usage = UsageText(usage_section(ret.fImpl->doc));
+	if (lines.size() == 1) {
+		ret.fImpl->pattern = Required(lines);
+	} else {
+		ret.fImpl->pattern = Required(PatternList(1, boost::make_shared<Either>(lines)));
+	}
+	fill_options_shortcuts(ret.fImpl->pattern, doc_options);
+	ret.fImpl->options = share(options);
+
+	ret.fImpl->pattern.fix();
+	ret.fImpl->slots->assign(ret.fImpl->pattern);
+	return ret;
+}
+
+#pragma mark -
+#pragma mark Batches
+
+namespace {
+	// The pool behind default_executor(): a fixed set of threads taking tasks off one queue
+	class ThreadPool : public Executor {
+	public:
+		explicit ThreadPool(unsigned threads)
+		: fThreads(threads),
+		  fStopping(false)
+		{
+			for (unsigned i = 0; i < threads; ++i) {
+				fWorkers.create_thread(boost::bind(&ThreadPool::work, this));
+			}
+		}
+
+		~ThreadPool() {
+			{
+				boost::mutex::scoped_lock lock(fMutex);
+				fStopping = true;
+			}
+			fWake.notify_all();
+			fWorkers.join_all();
+		}
+
+		void submit(Task* task) {
+			{
+				boost::mutex::scoped_lock lock(fMutex);
+				fQueue.push_back(task);
+			}
+			fWake.notify_one();
+		}
+
+		unsigned concurrency() const { return fThreads; }
+
+	private:
+		// run tasks until stopped, finishing those already queued first
+		void work() {
+			for (;;) {
+				Task* task;
+				{
+					boost::mutex::scoped_lock lock(fMutex);
+					while (fQueue.empty() && !fStopping)
+						fWake.wait(lock);
+					if (fQueue.empty())
+						return;
+					task = fQueue.front();
+					fQueue.pop_front();
+				}
+				boost::scoped_ptr<Task> done(task);
+				done->run();
+			}
+		}
+
+		unsigned const fThreads;
+		boost::thread_group fWorkers;
+		std::list<Task*> fQueue;
+		bool fStopping;
+		boost::mutex fMutex;
+		boost::condition_variable fWake;
+	};
+
+	// The items of one batch, which the thread that started it and the tasks it submitted all take
+	// from. Tasks hold on to it, since one that only starts once every item is taken may outlive
+	// the call that started the batch; by then it takes nothing, and leaves 'work' alone.
+	class Batch {
+	public:
+		// an item that throws is still done; the first error is thrown again by wait()
+		Batch(size_t count, boost::function<void(size_t)> const& work)
+		: fWork(work),
+		  fCount(count),
+		  fNext(0),
+		  fDone(0)
+		{}
+
+		// take items until none are left
+		void run() {
+			size_t done = 0;
+			boost::exception_ptr error;
+			for (size_t index = fNext++; index < fCount; index = fNext++) {
+				try {
+					fWork(index);
+				} catch (...) {
+					if (!error)
+						error = boost::current_exception();
+				}
+				++done;
+			}
+			if (done) {
+				boost::mutex::scoped_lock lock(fMutex);
+				fDone += done;
+				if (error && !fError)
+					fError = error;
+				if (fDone == fCount)
+					fFinished.notify_all();
+			}
+		}
+
+		// once every item is taken, wait for those still being worked on
+		void wait() {
+			boost::mutex::scoped_lock lock(fMutex);
+			while (fDone != fCount)
+				fFinished.wait(lock);
+			if (fError)
+				boost::rethrow_exception(fError);
+		}
+
+	private:
+		boost::function<void(size_t)> const fWork;
+		size_t const fCount;
+		boost::atomic<size_t> fNext;
+		size_t fDone;
+		boost::exception_ptr fError;
+		boost::mutex fMutex;
+		boost::condition_variable fFinished;
+	};
+
+	class BatchTask : public Executor::Task {
+	public:
+		explicit BatchTask(boost::shared_ptr<Batch> const& batch)
+		: fBatch(batch)
+		{}
+
+		void run() { fBatch->run(); }
+
+	private:
+		boost::shared_ptr<Batch> fBatch;
+	};
+
+	// Call 'work' for each index in [0, count), on at most 'threads' threads (the calling one
+	// included; 0 for as many as the executor runs at once)
+	void run_batch(size_t count, boost::function<void(size_t)> const& work, unsigned threads, Executor* executor)
+	{
+		Executor& on = executor ? *executor : default_executor();
+		if (threads == 0)
+			threads = on.concurrency();
+		if (threads > count)
+			threads = static_cast<unsigned>(count);
+
+		if (threads <= 1) {
+			for (size_t index = 0; index < count; ++index)
+				work(index);
+			return;
+		}
+
+		boost::shared_ptr<Batch> batch = boost::make_shared<Batch>(count, work);
+		for (unsigned i = 1; i < threads; ++i)
+			on.submit(new BatchTask(batch));
+		batch->run();
+		batch->wait();
+	}
+
+	struct CompileEach {
+		void operator()(size_t index) const {
+			CompileResult& result = (*results)[index];
+			try {
+				result.parser = Parser((*docs)[index]);
+				result.ok = true;
+			} catch (DocoptLanguageError const& error) {
+				// a bad doc only fails its own slot, never the whole batch
+				result.error = error.what();
+			}
+		}
+
+		std::vector<std::string> const* docs;
+		std::vector<CompileResult>* results;
+	};
+
+	struct ValidateEach {
+		void operator()(size_t index) const {
+			try {
+				(*verdicts)[index] = parser->validate((*argvs)[index], help, version, options_first);
+			} catch (DocoptLanguageError const&) {
+				// a usage line that fails to compile lazily cannot accept argv; anything else is
+				// not about argv, and leaves the batch
+				(*verdicts)[index] = NoMatch;
+			}
+		}
+
+		Parser const* parser;
+		std::vector<std::vector<std::string> > const* argvs;
+		std::vector<Validation>* verdicts;
+		bool help;
+		bool version;
+		bool options_first;
+	};
+}
+
+DOCOPT_INLINE
+Executor& docopt::default_executor()
+{
+	static ThreadPool pool(std::max(1u, boost::thread::hardware_concurrency()));
+	return pool;
+}
+
+DOCOPT_INLINE
+std::vector<CompileResult>
+docopt::compile_all(std::vector<std::string> const& docs,
+		    unsigned threads,
+		    Executor* executor)
+{
+	std::vector<CompileResult> results(docs.size());
+	CompileEach each = { &docs, &results };
+	run_batch(docs.size(), each, threads, executor);
+	return results;
+}
+
+DOCOPT_INLINE
+std::vector<Validation>
+docopt::Parser::validate_all(std::vector<std::vector<std::string> > const& argvs,
+			     bool help,
+			     bool version,
+			     bool options_first,
+			     Executor* executor) const
+{
+	if (!fImpl)
+		throw std::runtime_error("Logic error: validate_all() called on an empty Parser");
+
+	std::vector<Validation> verdicts(argvs.size(), NoMatch);
+	ValidateEach each = { this, &argvs, &verdicts, help, version, options_first };
+	run_batch(argvs.size(), each, 0, executor);
+	return verdicts;
+}
+
+// Write 'text' to 'stream' in one go (stderr has no buffer to gather several writes in), and flush it
+static void emit(std::FILE* stream, std::string const& text)
+{
+	std::fwrite(text.data(), 1, text.size(), stream);
+	std::fflush(stream);
+}
+
+DOCOPT_INLINE
+std::map<std::string, value>
+docopt::docopt_parse(std::string const& doc,
+			 std::vector<std::string> const& argv,
+			 bool help,
+			 bool version,
+			 bool options_first)
+{
+	return Parser(doc).parse(argv, help, version, options_first);
+}
+
+DOCOPT_INLINE
+std::map<std::string, value>
+docopt::docopt(std::string const& doc,
+		   std::vector<std::string> const& argv,
+		   bool help,
+		   std::string const& version,
+		   bool options_first)
+{
+	try {
+		return docopt_parse(doc, argv, help, !version.empty(), options_first);
+	} catch (DocoptExitHelp const&) {
+		emit(stdout, doc + "\n");
+		std::exit(0);
+	} catch (DocoptExitVersion const&) {
+		emit(stdout, version + "\n");
+		std::exit(0);
+	} catch (DocoptLanguageError const& error) {
+		emit(stderr, std::string("Docopt usage string could not be parsed\n") + error.what() + "\n");
+		std::exit(-1);
+	} catch (DocoptArgumentError const& error) {
+		emit(stderr, error.what());
+		emit(stdout, "\n" + doc + "\n");
+		std::exit(-1);
+	} /* Any other exception is unexpected: let std::terminate grab it */
+}
+
+DOCOPT_INLINE
+std::map<std::string, value>
+docopt::docopt(Parser const& parser,
+	       std::vector<std::string> const& argv,
+	       bool help,
+	       std::string const& version,
+	       bool options_first,
+	       ErrorOutput output)
+{
+	try {
+		return parser.parse(argv, help, !version.empty(), options_first);
+	} catch (DocoptExitHelp const&) {
+		emit(stdout, parser.doc() + "\n");
+		std::exit(0);
+	} catch (DocoptExitVersion const&) {
+		emit(stdout, version + "\n");
+		std::exit(0);
+	} catch (DocoptLanguageError const& error) {
+		// a lazily compiled parser only finds errors in an alternative once argv needs it
+		emit(stderr, std::string("Docopt usage string could not be parsed\n") + error.what() + "\n");
+		std::exit(-1);
+	} catch (DocoptArgumentError const& error) {
+		if (output == CompactUsage) {
+			emit(stderr, error.what() + ("\n" + parser.usageFor(argv)));
+		} else {
+			emit(stderr, error.what());
+			emit(stdout, "\n" + parser.doc() + "\n");
+		}
 		std::exit(-1);
 	} /* Any other exception is unexpected: let std::terminate grab it */
 }
@@ -9,30 +9,12 @@
 #ifndef docopt__docopt_h_
 #define docopt__docopt_h_
 
-#include "docopt_value.h"
+#include "docopt_value.h" // also defines DOCOPT_INLINE and DOCOPTAPI
 
 #include <map>
 #include <vector>
 #include <string>
-
-#ifdef DOCOPT_HEADER_ONLY
-	#define DOCOPT_INLINE inline
-	#define DOCOPTAPI
-#else 
-	#define DOCOPT_INLINE
-
-	// On Windows, export certain symbols so they are available
-	// to users of docopt.dll (shared library).
-	#ifdef WIN32
-		#ifdef DOCOPT_EXPORTS
-			#define DOCOPTAPI __declspec(dllexport)
-		#else
-			#define DOCOPTAPI __declspec(dllimport)
-		#endif
-	#else
-		#define DOCOPTAPI
-	#endif
-#endif
+#include <stdint.h>
 
 namespace docopt {
 
@@ -85,6 +67,583 @@ namespace docopt {
 						bool help = true,
 						std::string const& version = "",
 						bool options_first = false);
+
+	/// What 'docopt' shows along with an error in the user's argv
+	enum ErrorOutput {
+		FullDoc,      // the error on stderr, then the whole doc on stdout
+		CompactUsage  // the error and the usage lines for the command argv names (all of them if it names none) on stderr
+	};
+
+	/// What Parser::validate makes of an argv: whether 'parse' would accept it, or why not
+	enum Validation {
+		Accepted,            // parse would return a result
+		HelpRequested,       // parse would throw DocoptExitHelp
+		VersionRequested,    // parse would throw DocoptExitVersion
+		BadOption,           // an option is an ambiguous prefix, lacks its argument or has one it does not take
+		UnexpectedArgument,  // an alternative matched, but argv has more than it takes
+		NoMatch              // argv fits none of the usage alternatives
+	};
+
+	/// Heap bytes held by a compiled Parser or a parse result, by what they are spent on.
+	struct Footprint {
+		Footprint() : nodes(0), options(0), strings(0), indexes(0) {}
+
+		size_t nodes;    // pattern tree nodes, result map entries, and the objects holding them
+		size_t options;  // the option table
+		size_t strings;  // the text of the doc, names, default and parsed values
+		size_t indexes;  // lookup structures and caches
+
+		size_t total() const { return nodes + options + strings + indexes; }
+	};
+
+	/// What holding on to 'args' costs (excluding the map object itself)
+	Footprint DOCOPTAPI footprint(std::map<std::string, value> const& args);
+
+	/// One option, argument or command word as it appeared in argv.
+	struct Occurrence {
+		Occurrence() : slot(0), argvIndex(0) {}
+		Occurrence(size_t slot, size_t argvIndex, value const& val)
+		: slot(slot), argvIndex(argvIndex), val(val)
+		{}
+
+		size_t slot;      // the name it counts towards; see Parser::slotName
+		size_t argvIndex; // the argv element it was read from ('-abc' gives three with the same index)
+		value val;        // its own value, before repeats were counted or collected
+	};
+
+	/// A run of argv elements by index: [begin, end)
+	struct ArgvRange {
+		ArgvRange() : begin(0), end(0) {}
+
+		size_t begin;
+		size_t end;
+
+		bool empty() const { return begin == end; }
+		size_t size() const { return end - begin; }
+	};
+
+	/// A fingerprint of a parse result that is the same in every process, build and platform, for
+	/// grouping or deduplicating results without comparing them.
+	///
+	/// Each entry is hashed with 64-bit FNV-1a over: the key's bytes and a 0 byte; a kind byte (0
+	/// empty, 1 bool, 2 long, 3 string, 4 string list); then for a bool a 0 or 1 byte, for a long
+	/// its 8 bytes little-endian (two's complement), for a string its length as 8 bytes
+	/// little-endian and then its bytes, and for a string list its count as 8 bytes little-endian
+	/// and then each string as for a string. The fingerprint is the sum of the entries' hashes,
+	/// modulo 2^64, so it does not depend on the order the entries were set in.
+	uint64_t DOCOPTAPI fingerprint(std::map<std::string, value> const& args);
+
+	/// The outcome of a successful parse, which never changes once made.
+	///
+	/// Copies share one instance through a single (thread-safe) reference count, so a Result can be
+	/// kept, cached or handed to other threads without copying the arguments.
+	class DOCOPTAPI Result {
+	public:
+		/// An empty result, only useful as a placeholder to assign to
+		Result();
+		Result(Result const& other);
+		Result& operator=(Result const& other);
+		~Result();
+
+		/// A result holding 'args' (from 'docopt_parse', say), which is left empty. Handing the
+		/// result on to other threads then shares it instead of copying the map for each of them.
+		static Result adopt(std::map<std::string, value>& args);
+
+		// Test if this holds a parse at all
+		bool empty() const { return fData == 0; }
+
+		/// The options, arguments and commands, as 'docopt_parse' returns them
+		std::map<std::string, value> const& args() const;
+
+		/// @throws std::out_of_range if 'key' is not an option, argument or command of the usage
+		value const& operator[](std::string const& key) const;
+
+		/// Everything argv held, in argv order, if the parser records occurrences (and empty otherwise)
+		std::vector<Occurrence> const& occurrences() const;
+
+		/// The argv elements the parser's pass-through argument took (see Parser::setPassThrough).
+		/// Empty, at the end of argv, if there were none or the parser has no pass-through argument.
+		ArgvRange passThrough() const;
+
+		/// docopt::fingerprint(args()), worked out while the parse set the values rather than
+		/// afterwards
+		uint64_t fingerprint() const;
+
+		/// What this result costs, including its shared bookkeeping
+		Footprint footprint() const;
+
+	private:
+		friend class Parser;
+
+		struct Data;
+
+		// takes over the contents of 'args' and 'occurrences'; 'fingerprint' is that of 'args'
+		Result(std::map<std::string, value>& args, std::vector<Occurrence>& occurrences,
+		       ArgvRange const& passThrough, uint64_t fingerprint);
+
+		Data* fData;
+	};
+
+	/// How well a Parser's result cache is doing
+	struct CacheStats {
+		CacheStats() : hits(0), misses(0), evictions(0), entries(0), bytes(0) {}
+
+		unsigned long hits;
+		unsigned long misses;
+		unsigned long evictions;
+		size_t entries;
+		size_t bytes;
+	};
+
+	/// Lets parsers compiled with it share what their docs have in common, for registries of many
+	/// docs that repeat the same options: option descriptions, and the options, arguments and
+	/// commands of the usage patterns (names and defaults), are kept once per distinct content,
+	/// however many docs have them.
+	///
+	/// Its parsers number slots together, in the order names are first compiled, so a name has the
+	/// same slot in all of them. Copies share one context, which may be used from several threads
+	/// at once and lives as long as any parser compiled with it.
+	class DOCOPTAPI ParserContext {
+	public:
+		ParserContext();
+		ParserContext(ParserContext const& other);
+		ParserContext& operator=(ParserContext const& other);
+		~ParserContext();
+
+		/// What the shared content costs. Parsers compiled with the context leave it out of theirs.
+		Footprint footprint() const;
+
+	private:
+		friend class Parser;
+
+		struct Impl;
+		Impl* fImpl;
+	};
+
+	/// Where the library runs the batches it spreads over threads (compile_all, Parser::validate_all).
+	/// Implement it to have them run on a scheduler the program already has, rather than on threads
+	/// of the library's own.
+	///
+	/// A batch is cut into tasks that each take items from it until none are left. The thread that
+	/// started the batch takes items as well, and waits for the last ones itself, so a batch can
+	/// be started from one of the executor's own tasks and does not need a wait of the executor's.
+	class DOCOPTAPI Executor {
+	public:
+		/// One task of a batch
+		class Task {
+		public:
+			virtual ~Task() {}
+			virtual void run() = 0;
+		};
+
+		virtual ~Executor() {}
+
+		/// Run 'task' once, on any thread, and then delete it. This may return before it has run
+		/// (or even started), but not block on other tasks of the executor.
+		virtual void submit(Task* task) = 0;
+
+		/// How many tasks can usefully run at once; a batch submits one fewer than this
+		virtual unsigned concurrency() const = 0;
+	};
+
+	/// The executor used when none is given: a pool of one thread per hardware thread, started the
+	/// first time it is needed and shared by every batch of the program.
+	Executor& DOCOPTAPI default_executor();
+
+	/// A usage string that has already been parsed, ready to match any number of argument vectors.
+	///
+	/// Compiling reads the doc once (usage section, option descriptions and usage patterns); each
+	/// call to 'parse' then only has to match the argv. Copies are cheap and share the compiled
+	/// state, and a Parser may be used from several threads at once.
+	class DOCOPTAPI Parser {
+	public:
+		/// An empty parser, only useful as a placeholder to assign a compiled one to
+		Parser();
+		Parser(Parser const& other);
+		Parser& operator=(Parser const& other);
+		~Parser();
+
+		/// @throws DocoptLanguageError if the doc usage string had errors itself
+		explicit Parser(std::string const& doc);
+
+		/// The same, for a doc that is not in a std::string (an embedded resource, say): the 'size'
+		/// characters at 'doc'. The sections and tokens are read where they are; the text is only
+		/// copied once, to keep for 'doc()'.
+		///
+		/// @throws DocoptLanguageError if the doc usage string had errors itself
+		Parser(char const* doc, size_t size);
+
+		/// Compile 'doc', sharing what it has in common with the other docs compiled with 'context'.
+		/// Results are the same as with a parser of its own; only slots are numbered differently.
+		///
+		/// @throws DocoptLanguageError if the doc usage string had errors itself
+		Parser(std::string const& doc, ParserContext const& context);
+
+		/// Compile the doc in the file at 'path', which is mapped into memory rather than read.
+		///
+		/// @throws std::runtime_error if the file cannot be opened or read
+		/// @throws DocoptLanguageError if the doc usage string had errors itself
+		static Parser from_file(std::string const& path);
+
+		/// A parser that only compiles the usage alternatives an argv can actually match, the first
+		/// time one is needed, and keeps them for later parses.
+		///
+		/// Alternatives that begin with a command word are only compiled for argv whose first
+		/// positional argument is that command. Argv that names no such command and that the other
+		/// alternatives reject is tried against all of them, compiling the whole usage. Results and
+		/// argument errors are the same as with a full compile: names of alternatives that were not
+		/// compiled get their defaults, and argv is read knowing every option the usage names. Errors
+		/// in an alternative's own syntax are only reported when it is first compiled.
+		///
+		/// @throws DocoptLanguageError if the doc has no (or several) usage sections
+		static Parser lazy(std::string const& doc);
+
+		std::string const& doc() const;
+
+		/// The usage lines for the command argv names, under the doc's "usage:" heading, or all of
+		/// them if argv names no command. The command is argv's first positional argument, read as
+		/// parse reads it (so the argument of an option before it is not taken for it); the lines
+		/// for each command are worked out when compiling.
+		std::string const& usageFor(std::vector<std::string> const& argv) const;
+
+		/// Same as 'docopt_parse', without re-reading the doc.
+		std::map<std::string, value> parse(std::vector<std::string> const& argv,
+						   bool help = true,
+						   bool version = true,
+						   bool options_first = false) const;
+
+		/// Whether 'parse' would accept argv, without working out what it sets: no values are
+		/// collected and no result is built. The last three kinds are the DocoptArgumentErrors
+		/// 'parse' would throw.
+		Validation validate(std::vector<std::string> const& argv,
+				    bool help = true,
+				    bool version = true,
+				    bool options_first = false) const;
+
+		/// 'validate' for each of 'argvs', spread over an executor's threads (NULL for
+		/// default_executor()). The verdicts are in the same order as 'argvs'. A failure that is not
+		/// about argv (std::bad_alloc, say) is thrown once the batch is done, not reported as NoMatch.
+		std::vector<Validation> validate_all(std::vector<std::vector<std::string> > const& argvs,
+						     bool help = true,
+						     bool version = true,
+						     bool options_first = false,
+						     Executor* executor = NULL) const;
+
+		/// Learn which usage alternatives match most often and try those first.
+		///
+		/// Results are exactly the same as without it; matching just stops as soon as no untried
+		/// alternative could beat one that consumed the whole argv. Do not toggle this while other
+		/// threads are parsing with this parser (or a copy of it).
+		void setAdaptiveOrdering(bool adaptive);
+
+		/// Like 'parse', but the result is shared and immutable, and comes from the cache when enabled.
+		Result parse_result(std::vector<std::string> const& argv,
+				    bool help = true,
+				    bool version = true,
+				    bool options_first = false) const;
+
+		/// Remember the results of up to 'maxBytes' worth of command lines, so parsing the same argv
+		/// again is only a hash and a compare. Least recently used entries are dropped first, and
+		/// argv that fail to parse are never cached. Pass 0 to turn the cache off again.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		void enableCache(size_t maxBytes);
+
+		CacheStats cacheStats() const;
+
+		/// Add a usage alternative: 'line' is what follows the program name on a usage line, and
+		/// 'options' holds the lines the options section would have for the options it brings
+		/// along. Returns the alternative's number, to remove it by; those of the doc's own
+		/// alternatives are 0, 1, ... in the order the doc has them.
+		///
+		/// Only the new alternative is read, when first needed; the others are just told about the
+		/// names it repeats and the options it names. 'doc()' stays what the parser was compiled
+		/// from. A parser that was not compiled lazily still gives results for every alternative.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		///
+		/// @throws DocoptLanguageError if 'options' has errors or describes an option again
+		size_t addUsage(std::string const& line, std::string const& options = std::string());
+
+		/// Take out an alternative that 'addUsage' returned, or one of the doc's own, along with
+		/// the options that were added with it.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		void removeUsage(size_t line);
+
+		/// Scope the options of a section headed "<command> options:" (say "Remote options:" in a
+		/// usage with a 'remote' command) to that subcommand: argv is read with the options of the
+		/// other sections until a positional argument names the command, and only then with its
+		/// own as well. Lookups before it skip them, and an abbreviation cannot be ambiguous with
+		/// options of a subcommand argv does not use. Before its command, such an option is read as
+		/// one the doc does not describe (so it takes no argument). Off by default.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		void setOptionScoping(bool scoped);
+
+		/// Have 'parse_result' also record each option, argument and command in the order argv had
+		/// them (see Result::occurrences). Off by default, since it costs a little on every match.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		void setRecordOccurrences(bool record);
+
+		/// The name an Occurrence's slot stands for.
+		///
+		/// Slots are numbered once, at compile time, in name order, so they can be looked up ahead of
+		/// parsing. Lazily compiled parsers number the names of each alternative as it is compiled,
+		/// and parsers compiled with a ParserContext share its numbering.
+		///
+		/// @throws std::out_of_range if no name has that slot (yet)
+		std::string const& slotName(size_t slot) const;
+
+		size_t slotCount() const;
+
+		/// Have 'parse_result', when parsing with options_first, leave everything after the first
+		/// positional argument to 'argument' as a whole, as Result::passThrough, instead of reading
+		/// it. This is for wrappers like 'prog [options] <command> [<args>...]' that hand the
+		/// rest of argv to another program: however long it is, it costs nothing to parse, and in
+		/// the result 'argument' is an empty list. Where the usage line argv fits takes other
+		/// arguments after the first positional one, argv is read as usual instead, and the range
+		/// covers what 'argument' took if that is the end of argv (else it is empty and 'argument'
+		/// keeps its values). 'validate' with options_first accepts the same argv. Pass an empty
+		/// name to turn this off again.
+		///
+		/// Do not call this while other threads are parsing with this parser (or a copy of it).
+		void setPassThrough(std::string const& argument);
+
+		/// What this compiled parser costs, including its result cache
+		Footprint footprint() const;
+
+	private:
+		friend class UsageBuilder;
+
+		void make_changeable();
+		void capture(std::vector<std::string> const& argv, bool help, bool version, bool options_first) const;
+		void compile(char const* doc, size_t size, ParserContext::Impl* context = NULL);
+
+		std::map<std::string, value> match(std::vector<std::string> const& argv,
+						   bool help,
+						   bool version,
+						   bool options_first,
+						   std::vector<Occurrence>* occurrences,
+						   ArgvRange* passThrough = NULL,
+						   uint64_t* fingerprint = NULL) const;
+
+		struct Impl;
+		Impl* fImpl; // shared by copies, like Result::fData
+	};
+
+	/// One piece of a usage pattern, for building a Parser in code instead of writing its doc.
+	///
+	/// Elements are values: 'add' returns a new group and leaves the one it was called on alone.
+	class DOCOPTAPI Element {
+	public:
+		/// A command word, like 'ship'
+		static Element command(std::string const& name);
+
+		/// A positional argument, like '<name>' or 'NAME'
+		static Element argument(std::string const& name);
+
+		/// An option by either of its names, like '-v' or '--verbose'. Options not declared with
+		/// UsageBuilder::flag or UsageBuilder::option are flags.
+		static Element option(std::string const& name);
+
+		/// The '[options]' shortcut: any declared option the usage does not name elsewhere
+		static Element options();
+
+		/// '( ... )': all of the children, in order
+		static Element required();
+		static Element required(Element const& child);
+
+		/// '[ ... ]': all of the children in order, or none of them
+		static Element optional();
+		static Element optional(Element const& child);
+
+		/// '( a | b | ... )': exactly one of the children
+		static Element either();
+		static Element either(Element const& first, Element const& second);
+
+		/// 'child...': the child at least once
+		static Element one_or_more(Element const& child);
+
+		/// This group with 'child' added at the end
+		///
+		/// @throws DocoptLanguageError if this is not a group
+		Element add(Element const& child) const;
+
+		Element(Element const& other);
+		Element& operator=(Element const& other);
+		~Element();
+
+		struct Node;
+		Node const& node() const { return *fNode; }
+
+	private:
+		// takes over the reference 'node' comes with
+		explicit Element(Node* node) : fNode(node) {}
+
+		Node* fNode; // shared by copies, like Result::fData
+	};
+
+	/// Builds a Parser directly from usage lines and option declarations, without writing out a
+	/// doc and reading it back. The parser behaves exactly as one compiled from 'doc()' would.
+	///
+	///     docopt::UsageBuilder builder("naval_fate");
+	///     builder.option("", "--speed", "<kn>", "Speed in knots.", "10");
+	///     builder.usage(docopt::Element::required()
+	///                   .add(docopt::Element::command("ship"))
+	///                   .add(docopt::Element::argument("<name>"))
+	///                   .add(docopt::Element::command("move"))
+	///                   .add(docopt::Element::optional(docopt::Element::option("--speed"))));
+	///     docopt::Parser parser = builder.compile();
+	class DOCOPTAPI UsageBuilder {
+	public:
+		explicit UsageBuilder(std::string const& program);
+
+		/// Text to show above the usage section in 'doc()'
+		UsageBuilder& description(std::string const& text);
+
+		/// Add a usage line. A 'required' group stands for its children, so it need not be parenthesized.
+		UsageBuilder& usage(Element const& line);
+
+		/// Declare an option that takes no argument. Either name may be empty, but not both.
+		UsageBuilder& flag(std::string const& shortName,
+				   std::string const& longName,
+				   std::string const& description);
+
+		/// Declare an option that takes an argument, like '--speed=<kn>'
+		UsageBuilder& option(std::string const& shortName,
+				     std::string const& longName,
+				     std::string const& argName,
+				     std::string const& description);
+
+		/// ... with a value to take when argv does not give it
+		UsageBuilder& option(std::string const& shortName,
+				     std::string const& longName,
+				     std::string const& argName,
+				     std::string const& description,
+				     std::string const& defaultValue);
+
+		/// The doc this usage would be written as, to show for '--help'
+		std::string doc() const;
+
+		/// @throws DocoptLanguageError if an element or option is malformed, or there are no usage lines
+		Parser compile() const;
+
+	private:
+		struct OptionSpec {
+			std::string shortName;
+			std::string longName;
+			std::string argName;
+			std::string description;
+			std::string defaultValue;
+			bool hasDefault;
+		};
+
+		UsageBuilder& declare(OptionSpec const& spec);
+
+		std::string fProgram;
+		std::string fDescription;
+		std::vector<Element> fLines;
+		std::vector<OptionSpec> fOptions;
+	};
+
+	/// Same as 'docopt', with a compiled parser.
+	///
+	/// Each exit writes its precomputed text with a single buffered write. With 'CompactUsage', an
+	/// argument error shows only the usage lines that apply, rather than the entire doc.
+	std::map<std::string, value> DOCOPTAPI docopt(Parser const& parser,
+						std::vector<std::string> const& argv,
+						bool help = true,
+						std::string const& version = "",
+						bool options_first = false,
+						ErrorOutput output = CompactUsage);
+
+	/// One parse, as a CaptureLog records it
+	struct CaptureRecord {
+		CaptureRecord() : doc(0), help(true), version(true), options_first(false) {}
+
+		uint64_t doc; // doc_fingerprint() of the parser's doc
+		std::vector<std::string> argv;
+		bool help;
+		bool version;
+		bool options_first;
+	};
+
+	/// The fingerprint capture records identify docs by: 64-bit FNV-1a over the doc's bytes
+	uint64_t DOCOPTAPI doc_fingerprint(std::string const& doc);
+
+	/// A compact binary log of the parses a program makes, for replaying them offline through
+	/// other builds of the library (see benchmarks/replay.cpp). Capturing is started and stopped
+	/// with 'setCapture'.
+	///
+	/// A log starts with the 8 bytes "docopt\0\1". Each record then holds the doc fingerprint
+	/// as 8 bytes little-endian, a flags byte (1 help, 2 version, 4 options_first), the number of
+	/// arguments, and each argument as its length followed by its bytes; numbers are unsigned
+	/// LEB128. Records are buffered, and written out in blocks of whole records.
+	class DOCOPTAPI CaptureLog {
+	public:
+		/// Append to the log at 'path', creating it if there is none
+		///
+		/// @throws std::runtime_error if the file cannot be opened or is not a capture log
+		explicit CaptureLog(std::string const& path);
+
+		/// Writes out what is still buffered
+		~CaptureLog();
+
+		/// Add a record. This never throws for the file: a failed write is reported by 'flush'.
+		void record(uint64_t doc,
+			    std::vector<std::string> const& argv,
+			    bool help,
+			    bool version,
+			    bool options_first);
+
+		/// Write out what is buffered
+		///
+		/// @throws std::runtime_error if this or an earlier write failed
+		void flush();
+
+		/// Every record of the log at 'path', in the order they were made
+		///
+		/// @throws std::runtime_error if the file cannot be read, is not a capture log or is cut short
+		static std::vector<CaptureRecord> read(std::string const& path);
+
+	private:
+		CaptureLog(CaptureLog const&);
+		CaptureLog& operator=(CaptureLog const&);
+
+		struct Impl;
+		Impl* fImpl;
+	};
+
+	/// Have Parser::parse and Parser::parse_result (and with them docopt_parse and docopt) record
+	/// every argv in 'log' from now on, or stop with NULL. While no log is set this costs a
+	/// single atomic load per parse. Stop capturing, and let parses under way finish, before
+	/// destroying the log.
+	void DOCOPTAPI setCapture(CaptureLog* log);
+
+	/// The outcome of compiling one doc of a batch: either 'parser' is usable, or 'error' says why not.
+	struct CompileResult {
+		CompileResult() : ok(false) {}
+
+		bool ok;
+		Parser parser;
+		std::string error;
+	};
+
+	/// Compile many usage strings at once, spread over an executor's threads.
+	///
+	/// @param docs      The usage strings
+	/// @param threads   At most how many threads to use, the calling one included; 0 uses as many as
+	///                  the executor runs at once
+	/// @param executor  Where to run the batch; NULL for default_executor()
+	///
+	/// A doc that fails to compile is reported in its own result; it does not stop the batch. The results
+	/// are in the same order as 'docs'. Any other failure (std::bad_alloc, say) is thrown once the batch
+	/// is done.
+	std::vector<CompileResult> DOCOPTAPI compile_all(std::vector<std::string> const& docs,
+						unsigned threads = 0,
+						Executor* executor = NULL);
 }
 
 #ifdef DOCOPT_HEADER_ONLY
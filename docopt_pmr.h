@@ -0,0 +1,315 @@
+//
+//  docopt_pmr.h
+//  docopt
+//
+//  Parse results that live in a caller-supplied std::pmr::memory_resource (C++17 and later).
+//  Everything here is inline, so the library itself can still be built as C++98/11.
+//
+
+#ifndef docopt__pmr_h_
+#define docopt__pmr_h_
+
+#include "docopt.h"
+
+#if __cplusplus < 201703L && (!defined(_MSVC_LANG) || _MSVC_LANG < 201703L)
+	#error "docopt_pmr.h needs C++17 (std::pmr); use docopt.h on its own in older builds"
+#endif
+
+#include <map>
+#include <memory_resource>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace docopt {
+namespace pmr {
+
+	using string = std::pmr::string;
+	using string_list = std::pmr::vector<string>;
+
+	/// docopt::value, with its strings allocated from a memory_resource.
+	///
+	/// It is allocator-aware, so inside a std::pmr container it takes the container's resource.
+	class value {
+	public:
+		using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+		/// An empty value
+		explicit value(allocator_type alloc = {});
+
+		/// A copy of 'v' in 'alloc'
+		value(docopt::value const& v, allocator_type alloc = {});
+
+		value(value const& other) = default;
+		value(value&& other) = default;
+		value(value const& other, allocator_type alloc);
+		value(value&& other, allocator_type alloc);
+
+		// assignment keeps this value's allocator
+		value& operator=(value const& other) = default;
+		value& operator=(value&& other) = default;
+
+		allocator_type get_allocator() const { return fStr.get_allocator(); }
+
+		// Test if this object has any contents at all
+		explicit operator bool() const { return fKind != Empty; }
+
+		// Test the type contained by this value object
+		bool isBool()       const { return fKind==Bool; }
+		bool isString()     const { return fKind==String; }
+		bool isLong()       const { return fKind==Long; }
+		bool isStringList() const { return fKind==StringList; }
+
+		// Throws std::runtime_error if the type does not match
+		bool asBool() const;
+		long asLong() const;
+		string const& asString() const;
+		string_list const& asStringList() const;
+
+		friend bool operator==(value const&, value const&);
+		friend bool operator!=(value const&, value const&);
+
+	private:
+		enum Kind {
+			Empty,
+			Bool,
+			Long,
+			String,
+			StringList
+		};
+
+		void throwIfNotKind(Kind expected) const;
+
+		Kind fKind;
+		bool fBool;
+		long fLong;
+		string fStr;
+		string_list fStrList;
+	};
+
+	/// What docopt_parse returns, with every node, key and value allocated from one resource
+	using map = std::pmr::map<string, value>;
+
+	/// A copy of 'args' allocated from 'resource'
+	map copy(std::map<std::string, docopt::value> const& args, std::pmr::memory_resource* resource);
+
+	/// Same as docopt::docopt_parse, with the result allocated from 'resource'.
+	///
+	/// The result holds nothing from the global heap, so it is freed along with the resource (a
+	/// monotonic_buffer_resource, say) without being destroyed first. Matching itself still uses
+	/// the heap for its scratch work, all of which is released before this returns.
+	map docopt_parse(std::string const& doc,
+			 std::vector<std::string> const& argv,
+			 std::pmr::memory_resource* resource,
+			 bool help = true,
+			 bool version = true,
+			 bool options_first = false);
+
+	/// Same as Parser::parse, with the result allocated from 'resource'
+	map parse(Parser const& parser,
+		  std::vector<std::string> const& argv,
+		  std::pmr::memory_resource* resource,
+		  bool help = true,
+		  bool version = true,
+		  bool options_first = false);
+
+	/// Write out the contents to the ostream
+	std::ostream& operator<<(std::ostream&, value const&);
+}
+}
+
+namespace docopt {
+namespace pmr {
+	inline
+	value::value(allocator_type alloc)
+	: fKind(Empty),
+	  fBool(false),
+	  fLong(0),
+	  fStr(alloc),
+	  fStrList(alloc)
+	{}
+
+	inline
+	value::value(docopt::value const& v, allocator_type alloc)
+	: value(alloc)
+	{
+		if (v.isBool()) {
+			fKind = Bool;
+			fBool = v.asBool();
+		} else if (v.isLong()) {
+			fKind = Long;
+			fLong = v.asLong();
+		} else if (v.isString()) {
+			fKind = String;
+			fStr.assign(v.asString().data(), v.asString().size());
+		} else if (v.isStringList()) {
+			fKind = StringList;
+			std::vector<std::string> const& list = v.asStringList();
+			fStrList.reserve(list.size());
+			for (std::string const& str : list)
+				fStrList.emplace_back(str.data(), str.size());
+		}
+	}
+
+	inline
+	value::value(value const& other, allocator_type alloc)
+	: fKind(other.fKind),
+	  fBool(other.fBool),
+	  fLong(other.fLong),
+	  fStr(other.fStr, alloc),
+	  fStrList(other.fStrList, alloc)
+	{}
+
+	inline
+	value::value(value&& other, allocator_type alloc)
+	: fKind(other.fKind),
+	  fBool(other.fBool),
+	  fLong(other.fLong),
+	  fStr(std::move(other.fStr), alloc),
+	  fStrList(std::move(other.fStrList), alloc)
+	{}
+
+	inline
+	void value::throwIfNotKind(Kind expected) const
+	{
+		if (fKind == expected)
+			return;
+
+		// reuse docopt::value's wording
+		static char const* const names[] = { "empty", "bool", "long", "string", "string-list" };
+		std::string error = "Illegal cast to ";
+		error += names[expected];
+		error += "; type is actually ";
+		error += names[fKind];
+		throw std::runtime_error(error);
+	}
+
+	inline
+	bool value::asBool() const
+	{
+		throwIfNotKind(Bool);
+		return fBool;
+	}
+
+	inline
+	long value::asLong() const
+	{
+		// Attempt to convert a string to a long, the way docopt::value does
+		if (fKind == String)
+			return docopt::value(std::string(fStr.data(), fStr.size())).asLong();
+		throwIfNotKind(Long);
+		return fLong;
+	}
+
+	inline
+	string const& value::asString() const
+	{
+		throwIfNotKind(String);
+		return fStr;
+	}
+
+	inline
+	string_list const& value::asStringList() const
+	{
+		throwIfNotKind(StringList);
+		return fStrList;
+	}
+
+	inline
+	bool operator==(value const& v1, value const& v2)
+	{
+		if (v1.fKind != v2.fKind)
+			return false;
+
+		switch (v1.fKind) {
+			case value::String:
+				return v1.fStr==v2.fStr;
+
+			case value::StringList:
+				return v1.fStrList==v2.fStrList;
+
+			case value::Bool:
+				return v1.fBool==v2.fBool;
+
+			case value::Long:
+				return v1.fLong==v2.fLong;
+
+			case value::Empty:
+			default:
+				return true;
+		}
+	}
+
+	inline
+	bool operator!=(value const& v1, value const& v2)
+	{
+		return !(v1 == v2);
+	}
+
+	inline
+	std::ostream& operator<<(std::ostream& os, value const& val)
+	{
+		// same output as for docopt::value
+		if (val.isBool()) {
+			os << (val.asBool() ? "true" : "false");
+		} else if (val.isLong()) {
+			os << val.asLong();
+		} else if (val.isString()) {
+			os << '"' << val.asString() << '"';
+		} else if (val.isStringList()) {
+			os << "[";
+			bool first = true;
+			for (string const& el : val.asStringList()) {
+				if (!first)
+					os << ", ";
+				os << '"' << el << '"';
+				first = false;
+			}
+			os << "]";
+		} else {
+			os << "null";
+		}
+		return os;
+	}
+
+	inline
+	map copy(std::map<std::string, docopt::value> const& args, std::pmr::memory_resource* resource)
+	{
+		map ret(resource);
+		for (auto const& arg : args) {
+			// the map hands its resource on to both the key and the value
+			ret.emplace_hint(ret.end(),
+					 std::piecewise_construct,
+					 std::forward_as_tuple(arg.first.data(), arg.first.size()),
+					 std::forward_as_tuple(arg.second));
+		}
+		return ret;
+	}
+
+	inline
+	map docopt_parse(std::string const& doc,
+			 std::vector<std::string> const& argv,
+			 std::pmr::memory_resource* resource,
+			 bool help,
+			 bool version,
+			 bool options_first)
+	{
+		return copy(docopt::docopt_parse(doc, argv, help, version, options_first), resource);
+	}
+
+	inline
+	map parse(Parser const& parser,
+		  std::vector<std::string> const& argv,
+		  std::pmr::memory_resource* resource,
+		  bool help,
+		  bool version,
+		  bool options_first)
+	{
+		return copy(parser.parse(argv, help, version, options_first), resource);
+	}
+}
+}
+
+#endif /* defined(docopt__pmr_h_) */
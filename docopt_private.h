@@ -12,18 +12,35 @@
 #include <vector>
 #include <memory>
 #include <set>
+#include <algorithm>
+#include <climits>
+#include <typeinfo>
 #include <assert.h>
 
 // Workaround GCC 4.8 not having boost::regex
 #include <boost/regex.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "docopt_value.h"
 
+namespace boost {
+	template <>
+	struct hash<std::type_info> {
+		size_t operator()(std::type_info const& val) const {
+			return boost::hash<std::string>()(std::string(val.name()));
+		}
+	};
+}
+
 namespace docopt {
 
 	class Pattern;
 	class LeafPattern;
+	class CaptureLog;
 
 	typedef std::vector<boost::shared_ptr<Pattern> > PatternList;
 
@@ -60,9 +77,141 @@ namespace docopt {
 		}
 	};
 
+	// The regexes used to read a doc. They are built exactly once (thread-safely) and are only ever
+	// read afterwards, so any number of docs can be compiled concurrently.
+	struct Grammar {
+		Grammar();
+
+		boost::regex usage_section;
+		boost::regex options_section;
+		boost::regex options_delimiter;
+		boost::regex option_description;
+		boost::regex option_default;
+		boost::regex pattern_separators;
+		boost::regex pattern_strings;
+	};
+
+	Grammar const& grammar();
+
 	// An ordered-set that uniques by hash value
 	typedef std::set<boost::shared_ptr<Pattern>, PatternLess, std::allocator<boost::shared_ptr<Pattern> > > UniquePatternSet;
 
+	// What matching has gathered so far: the value collected for each slot the pattern's leaves
+	// have, and the argv elements taken when recording them. Every alternative is tried on the one state; each
+	// change goes into a journal, so whatever a failed (or losing) alternative gathered is taken
+	// back to a mark rather than each alternative working on a copy.
+	struct MatchState {
+		// an argv element taken by a leaf: the leaf's slot, the element's position among the parsed
+		// argv, and the value it had there
+		struct Consumed {
+			Consumed(size_t slot, size_t position, value const& val)
+			: slot(slot), position(position), val(val)
+			{}
+
+			size_t slot;
+			size_t position;
+			value val;
+		};
+
+		// how far the journal had got, to take it back to
+		struct Mark {
+			size_t changes;
+			size_t consumed;
+		};
+
+		// what one alternative gathered, kept aside while the others are tried
+		struct Outcome {
+			std::vector<std::pair<size_t, value> > values;
+			std::vector<Consumed> consumed;
+		};
+
+		// 'slots' are the ones the pattern's leaves have, sorted. Values are kept for those alone,
+		// however many the parser's context numbers, so they never have to grow.
+		explicit MatchState(bool record = false, bool collect = true, std::vector<size_t> const& slots = std::vector<size_t>())
+		: record(record), collect(collect), fSlots(collect ? slots : std::vector<size_t>())
+		{
+			if (collect)
+				fValues.resize(fSlots.size());
+		}
+
+		// the value collected for 'slot'; empty if nothing has been
+		value const& get(size_t slot) const {
+			static value const none;
+			size_t const index = find(slot);
+			return index < fValues.size() && fSlots[index] == slot ? fValues[index] : none;
+		}
+
+		void set(size_t slot, value const& val) {
+			size_t index = find(slot);
+			if (index == fSlots.size() || fSlots[index] != slot) {
+				// not one of the slots it was made with
+				fSlots.insert(fSlots.begin() + static_cast<std::ptrdiff_t>(index), slot);
+				fValues.insert(fValues.begin() + static_cast<std::ptrdiff_t>(index), value());
+			}
+			fChanges.push_back(Change(slot, fValues[index]));
+			fValues[index] = val;
+		}
+
+		Mark mark() const {
+			Mark ret = { fChanges.size(), consumed.size() };
+			return ret;
+		}
+
+		// undo everything gathered since 'mark'
+		void undo(Mark const& mark) {
+			for (; fChanges.size() > mark.changes; fChanges.pop_back())
+				fValues[find(fChanges.back().slot)] = fChanges.back().previous;
+			consumed.erase(consumed.begin() + static_cast<std::ptrdiff_t>(mark.consumed), consumed.end());
+		}
+
+		// what was gathered since 'mark', to put back later with 'redo'
+		void save(Mark const& mark, Outcome& outcome) const {
+			// a slot changed many times (by '-vvv' or '<file>...') is saved once, as it ended up
+			std::vector<size_t> slots;
+			slots.reserve(fChanges.size() - mark.changes);
+			for (size_t change = mark.changes; change < fChanges.size(); ++change)
+				slots.push_back(fChanges[change].slot);
+			std::sort(slots.begin(), slots.end());
+			slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+			outcome.values.clear();
+			for (std::vector<size_t>::const_iterator slot = slots.begin(); slot != slots.end(); ++slot)
+				outcome.values.push_back(std::make_pair(*slot, fValues[find(*slot)]));
+			outcome.consumed.assign(consumed.begin() + static_cast<std::ptrdiff_t>(mark.consumed), consumed.end());
+		}
+
+		void redo(Outcome const& outcome) {
+			for (std::vector<std::pair<size_t, value> >::const_iterator val = outcome.values.begin(); val != outcome.values.end(); ++val)
+				set(val->first, val->second);
+			consumed.insert(consumed.end(), outcome.consumed.begin(), outcome.consumed.end());
+		}
+
+		std::vector<Consumed> consumed; // only filled in when 'record' is set
+		bool const record;
+		bool const collect; // cleared when only whether argv matches is wanted, not what it sets
+
+	private:
+		struct Change {
+			Change(size_t slot, value const& previous) : slot(slot), previous(previous) {}
+
+			size_t slot;
+			value previous;
+		};
+
+		// one state per match
+		MatchState(MatchState const&);
+		MatchState& operator=(MatchState const&);
+
+		// where 'slot' is (or would go) in 'fSlots'
+		size_t find(size_t slot) const {
+			return static_cast<size_t>(std::lower_bound(fSlots.begin(), fSlots.end(), slot) - fSlots.begin());
+		}
+
+		std::vector<size_t> fSlots;
+		std::vector<value> fValues; // by position in 'fSlots'; only collected values are never empty
+		std::vector<Change> fChanges;
+	};
+
 	class Pattern {
 	public:
 		// flatten out children, stopping descent when the given filter returns 'true'
@@ -74,8 +223,9 @@ namespace docopt {
 		// flatten out all children into a list of LeafPattern objects
 		std::vector<LeafPattern*> leaves();
 
-		// Attempt to find something in 'left' that matches this pattern's spec, and if so, move it to 'collected'
-		virtual bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const = 0;
+		// Attempt to find something in 'left' that matches this pattern's spec, and if so, move it to 'state'.
+		// If not, both are left as they were.
+		virtual bool match(PatternList& left, MatchState& state) const = 0;
 
 		virtual std::string const& name() const = 0;
 
@@ -89,7 +239,9 @@ namespace docopt {
 	public:
 		LeafPattern(std::string name, value v = value())
 		: fName(name),
-		  fValue(v)
+		  fValue(v),
+		  fSlot(0),
+		  fArgvPosition(0)
 		{}
 
 		virtual std::vector<Pattern*> flat(bool (*filter)(Pattern const*)) {
@@ -104,7 +256,7 @@ namespace docopt {
 			lst.push_back(this);
 		}
 
-		virtual bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const;
+		virtual bool match(PatternList& left, MatchState& state) const;
 
 		virtual bool hasValue() const { return static_cast<bool>(fValue); }
 
@@ -113,6 +265,14 @@ namespace docopt {
 
 		virtual std::string const& name() const { return fName; }
 
+		// the parser's number for this leaf's name, for compiled leaves
+		size_t slot() const { return fSlot; }
+		void setSlot(size_t slot) { fSlot = slot; }
+
+		// where this leaf sits among the parsed argv, for leaves read from argv
+		size_t argvPosition() const { return fArgvPosition; }
+		void setArgvPosition(size_t position) { fArgvPosition = position; }
+
 		virtual size_t hash() const {
 			size_t seed = boost::hash<std::type_info>()(typeid(*this));
 			boost::hash_combine(seed, fName);
@@ -121,11 +281,15 @@ namespace docopt {
 		}
 
 	protected:
-		virtual std::pair<size_t, boost::shared_ptr<LeafPattern> > single_match(PatternList const&) const = 0;
+		// The index in 'left' of what this matches, and the value that gives it (which lives as long
+		// as that element of 'left'); NULL if nothing matches
+		virtual std::pair<size_t, value const*> single_match(PatternList const&) const = 0;
 
 	private:
 		std::string fName;
 		value fValue;
+		size_t fSlot;
+		size_t fArgvPosition;
 	};
 
 	class BranchPattern
@@ -174,12 +338,15 @@ namespace docopt {
 			}
 		}
 
-		void setChildren(PatternList children) {
+		virtual void setChildren(PatternList children) {
 			fChildren = children;
 		}
 
 		PatternList const& children() const { return fChildren; }
 
+		// heap bytes of any lookup structures this node keeps besides its children
+		virtual size_t indexBytes() const { return 0; }
+
 		virtual void fix_identities(UniquePatternSet& patterns) {
 			for(PatternList::iterator child = fChildren.begin(); child != fChildren.end(); ++child)
 			{
@@ -220,7 +387,26 @@ namespace docopt {
 		Argument(std::string name, value v = value()) : LeafPattern(name, v) {}
 
 	protected:
-		virtual std::pair<size_t, boost::shared_ptr<LeafPattern> > single_match(PatternList const& left) const;
+		virtual std::pair<size_t, value const*> single_match(PatternList const& left) const;
+	};
+
+	// The argv elements [begin, end) after the first positional argument, when parsing with
+	// options_first for a parser that has a pass-through argument. Only that argument (named by
+	// this) matches it, taking all of it at once; the elements stay in argv, unread.
+	class ArgvTail : public Argument {
+	public:
+		ArgvTail(std::string const& owner, size_t begin, size_t end)
+		: Argument(owner, value(std::vector<std::string>())),
+		  fBegin(begin),
+		  fEnd(end)
+		{}
+
+		size_t begin() const { return fBegin; }
+		size_t end() const { return fEnd; }
+
+	private:
+		size_t fBegin;
+		size_t fEnd;
 	};
 
 	class Command : public Argument {
@@ -230,7 +416,7 @@ namespace docopt {
 		{}
 
 	protected:
-		virtual std::pair<size_t, boost::shared_ptr<LeafPattern> > single_match(PatternList const& left) const;
+		virtual std::pair<size_t, value const*> single_match(PatternList const& left) const;
 	};
 
 	class Option
@@ -270,7 +456,7 @@ namespace docopt {
 		}
 
 	protected:
-		virtual std::pair<size_t, boost::shared_ptr<LeafPattern> > single_match(PatternList const& left) const;
+		virtual std::pair<size_t, value const*> single_match(PatternList const& left) const;
 
 	private:
 		std::string fShortOption;
@@ -282,44 +468,203 @@ namespace docopt {
 	public:
 		Required(PatternList children = PatternList()) : BranchPattern(children) {}
 
-		bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const;
+		bool match(PatternList& left, MatchState& state) const;
 	};
 
 	class Optional : public BranchPattern {
 	public:
 		Optional(PatternList children = PatternList()) : BranchPattern(children) {}
 
-		bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const {
+		bool match(PatternList& left, MatchState& state) const {
 			for(PatternList::const_iterator pattern = fChildren.begin(); pattern != fChildren.end(); ++pattern)
 			{
-				(*pattern)->match(left, collected);
+				(*pattern)->match(left, state);
 			}
 			return true;
 		}
 	};
 
+	// Orders a branch's children (by index) by name, for looking them up
+	struct ChildNameLess {
+		explicit ChildNameLess(PatternList const& children) : fChildren(&children) {}
+
+		bool operator()(size_t a, size_t b) const { return (*fChildren)[a]->name() < (*fChildren)[b]->name(); }
+		bool operator()(size_t a, std::string const& b) const { return (*fChildren)[a]->name() < b; }
+		bool operator()(std::string const& a, size_t b) const { return a < (*fChildren)[b]->name(); }
+
+		PatternList const* fChildren;
+	};
+
 	class OptionsShortcut : public Optional {
 	public:
-		OptionsShortcut(PatternList children = PatternList()) : Optional(children) {}
+		OptionsShortcut(PatternList children = PatternList()) : Optional(children) { index(); }
+
+		virtual void setChildren(PatternList children) {
+			Optional::setChildren(children);
+			index();
+		}
+
+		// Same outcome as Optional::match, but only the options argv actually has are tried
+		bool match(PatternList& left, MatchState& state) const;
+
+		virtual size_t indexBytes() const { return fByName.capacity() * sizeof(size_t); }
+
+	private:
+		void index() {
+			fByName.clear();
+			for (size_t i = 0; i < fChildren.size(); ++i)
+				fByName.push_back(i);
+			std::stable_sort(fByName.begin(), fByName.end(), ChildNameLess(fChildren));
+		}
+
+		// child indexes sorted by name; fix_identities only swaps children for equal ones, so it stays valid
+		std::vector<size_t> fByName;
 	};
 
 	class OneOrMore : public BranchPattern {
 	public:
 		OneOrMore(PatternList children = PatternList()) : BranchPattern(children) {}
 
-		bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const;
+		bool match(PatternList& left, MatchState& state) const;
 	};
 
 	class Either : public BranchPattern {
 	public:
-		Either(PatternList children = PatternList()) : BranchPattern(children) {}
+		Either(PatternList children = PatternList()) : BranchPattern(children) { index(); }
+
+		virtual void setChildren(PatternList children) {
+			BranchPattern::setChildren(children);
+			index();
+		}
+
+		bool match(PatternList& left, MatchState& state) const;
+
+		// Start (or stop) counting which alternative wins, and trying the most frequent winners first
+		void setAdaptive(bool adaptive);
+
+		virtual size_t indexBytes() const {
+			size_t bytes = (fOptions.capacity() + fCommands.capacity()) * sizeof(size_t);
+			if (fWins)
+				bytes += sizeof(Wins) + 4 * sizeof(void*) + fChildren.size() * sizeof(boost::atomic<unsigned long>);
+			return bytes;
+		}
+
+	private:
+		// Sorts the alternatives into fOptions and fCommands if every one of them is a single option or command
+		void index();
+
+		// When every alternative is a single option or command, each one that matches consumes exactly one
+		// element of 'left', so the first declared of them wins. That one is found by looking up what is in
+		// 'left' instead of trying every alternative on a copy of it.
+		bool match_leaves(PatternList& left, MatchState& state) const;
+
+		// option and command alternatives, by name; both empty unless every alternative is one or the other
+		std::vector<size_t> fOptions;
+		std::vector<size_t> fCommands;
+
+		// How often each alternative has won. Shared by every thread matching against this node.
+		class Wins {
+		public:
+			explicit Wins(size_t alternatives)
+			: fCounts(new boost::atomic<unsigned long>[alternatives]),
+			  fSize(alternatives)
+			{
+				for (size_t i = 0; i < fSize; ++i)
+					fCounts[i].store(0, boost::memory_order_relaxed);
+			}
+
+			void record(size_t alternative) {
+				fCounts[alternative].fetch_add(1, boost::memory_order_relaxed);
+			}
 
-		bool match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const;
+			// alternatives by descending win count; ties keep declaration order
+			std::vector<size_t> order() const;
+
+		private:
+			boost::scoped_array<boost::atomic<unsigned long> > fCounts;
+			size_t fSize;
+		};
+
+		bool match_adaptive(PatternList& left, MatchState& state) const;
+
+		boost::shared_ptr<Wins> fWins;
 	};
 
 #pragma mark -
 #pragma mark inline implementations
 
+	static inline boost::regex section_regex(std::string const& name)
+	{
+		// ECMAScript regex only has "?=" for a non-matching lookahead. In order to make sure we always have
+		// a newline to anchor our matching, we have to avoid matching the final newline of each grouping.
+		// Therefore, our regex is adjusted from the docopt Python one to use ?= to match the newlines before
+		// the following lines, rather than after.
+		return boost::regex(
+			"(?:^|\\n)"  // anchored at a linebreak (or start of string)
+			"("
+			   "[^\\n]*" + name + "[^\\n]*(?=\\n?)" // a line that contains the name
+			   "(?:\\n[ \\t].*?(?=\\n|$))*"         // followed by any number of lines that are indented
+			")",
+			boost::regex::icase
+		);
+	}
+
+	inline Grammar::Grammar()
+	: usage_section(section_regex("usage:")),
+	  options_section(section_regex("options:")),
+	  // This pattern is a delimiter by which we split the options.
+	  // The delimiter is a new line followed by a whitespace(s) followed by one or two hyphens.
+	  options_delimiter(
+		"(?:^|\\n)[ \\t]*"  // a new line with leading whitespace
+		"(?=-{1,2})"        // [split happens here] (positive lookahead) ... and followed by one or two hyphes
+	  ),
+	  option_description("(-{1,2})?(.*?)([,= ]|$)"),
+	  option_default("\\[default: (.*)\\]", boost::regex::icase),
+	  pattern_separators(
+		"(?:\\s*)" // any spaces (non-matching subgroup)
+		"("
+		"[\\[\\]\\(\\)\\|]" // one character of brackets or parens or pipe character
+		"|"
+		"\\.\\.\\."  // elipsis
+		")"),
+	  pattern_strings(
+		"(?:\\s*)" // any spaces (non-matching subgroup)
+		"("
+		"\\S*<.*?>"  // strings, but make sure to keep "< >" strings together
+		"|"
+		"[^<>\\s]+"     // string without <>
+		")")
+	{}
+
+	// Not static, like grammar() itself: where several translation units include the library
+	// header-only, they all share the one instance
+	inline Grammar const*& grammar_instance()
+	{
+		static Grammar const* instance = NULL;
+		return instance;
+	}
+
+	inline void create_grammar()
+	{
+		// Intentionally never destroyed, so it outlives any static that compiles a doc
+		grammar_instance() = new Grammar();
+	}
+
+	inline Grammar const& grammar()
+	{
+		static boost::once_flag once = BOOST_ONCE_INIT;
+		boost::call_once(&create_grammar, once);
+		return *grammar_instance();
+	}
+
+	// The log parses are recorded in, if any (see setCapture). One for the whole program, even
+	// where several translation units include the library header-only.
+	inline boost::atomic<CaptureLog*>& capture_log()
+	{
+		static boost::atomic<CaptureLog*> log(NULL);
+		return log;
+	}
+
 	inline std::vector<LeafPattern*> Pattern::leaves()
 	{
 		std::vector<LeafPattern*> ret;
@@ -390,6 +735,37 @@ namespace docopt {
 		return result;
 	}
 
+	// Give a leaf that can occur several times a value that accumulates: a count or a list
+	static inline void make_repeatable(LeafPattern* leaf)
+	{
+		bool ensureList = false;
+		bool ensureInt = false;
+
+		if (dynamic_cast<Command*>(leaf)) {
+			ensureInt = true;
+		} else if (dynamic_cast<Argument*>(leaf)) {
+			ensureList = true;
+		} else if (Option* o = dynamic_cast<Option*>(leaf)) {
+			if (o->argCount()) {
+				ensureList = true;
+			} else {
+				ensureInt = true;
+			}
+		}
+
+		if (ensureList) {
+			std::vector<std::string> newValue;
+			if (leaf->getValue().isString()) {
+				newValue = split(leaf->getValue().asString());
+			}
+			if (!leaf->getValue().isStringList()) {
+				leaf->setValue(value(newValue));
+			}
+		} else if (ensureInt) {
+			leaf->setValue(value(0));
+		}
+	}
+
 	inline void BranchPattern::fix_repeating_arguments()
 	{
 		std::vector<PatternList> either = transform(children());
@@ -405,98 +781,64 @@ namespace docopt {
 				LeafPattern* leaf = dynamic_cast<LeafPattern*>(e->get());
 				if (!leaf) continue;
 
-				bool ensureList = false;
-				bool ensureInt = false;
-
-				if (dynamic_cast<Command*>(leaf)) {
-					ensureInt = true;
-				} else if (dynamic_cast<Argument*>(leaf)) {
-					ensureList = true;
-				} else if (Option* o = dynamic_cast<Option*>(leaf)) {
-					if (o->argCount()) {
-						ensureList = true;
-					} else {
-						ensureInt = true;
-					}
-				}
-
-				if (ensureList) {
-					std::vector<std::string> newValue;
-					if (leaf->getValue().isString()) {
-						newValue = split(leaf->getValue().asString());
-					}
-					if (!leaf->getValue().isStringList()) {
-						leaf->setValue(value(newValue));
-					}
-				} else if (ensureInt) {
-					leaf->setValue(value(0));
-				}
+				make_repeatable(leaf);
 			}
 		}
 	}
 
-	inline bool LeafPattern::match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const
+	inline bool LeafPattern::match(PatternList& left, MatchState& state) const
 	{
-		std::pair<size_t, boost::shared_ptr<LeafPattern> > match = single_match(left);
+		std::pair<size_t, value const*> match = single_match(left);
 		if (!match.second) {
 			return false;
 		}
 
-		left.erase(left.begin()+static_cast<std::ptrdiff_t>(match.first));
-
-		std::vector<boost::shared_ptr<LeafPattern> >::iterator same_name = collected.begin();
-		for(; same_name != collected.end(); ++same_name)
-		{
-			if((*same_name)->name() == name())
-				break;
+		if (state.record) {
+			LeafPattern const& consumed = static_cast<LeafPattern const&>(*left[match.first]);
+			state.consumed.push_back(MatchState::Consumed(fSlot, consumed.argvPosition(), consumed.getValue()));
 		}
-		if (getValue().isLong()) {
-			long val = 1;
-			if (same_name == collected.end()) {
-				collected.push_back(match.second);
-				match.second->setValue(value(val));
-			} else if ((**same_name).getValue().isLong()) {
-				val += (**same_name).getValue().asLong();
-				(**same_name).setValue(value(val));
-			} else {
-				(**same_name).setValue(value(val));
-			}
-		} else if (getValue().isStringList()) {
-			std::vector<std::string> val;
-			if (match.second->getValue().isString()) {
-				val.push_back(match.second->getValue().asString());
-			} else if (match.second->getValue().isStringList()) {
-				val = match.second->getValue().asStringList();
-			} else {
-				/// cant be!?
-			}
 
-			if (same_name == collected.end()) {
-				collected.push_back(match.second);
-				match.second->setValue(value(val));
-			} else if ((**same_name).getValue().isStringList()) {
-				std::vector<std::string> const& list = (**same_name).getValue().asStringList();
-				val.insert(val.begin(), list.begin(), list.end());
-				(**same_name).setValue(value(val));
+		// counts and lists add to what this slot has collected; anything else replaces it
+		if (state.collect) {
+			value const& matched = *match.second;
+			value const& collected = state.get(fSlot);
+			if (getValue().isLong()) {
+				long count = 1;
+				if (collected.isLong())
+					count += collected.asLong();
+				state.set(fSlot, value(count));
+			} else if (getValue().isStringList()) {
+				std::vector<std::string> list;
+				if (collected.isStringList())
+					list = collected.asStringList();
+				if (matched.isString()) {
+					list.push_back(matched.asString());
+				} else if (matched.isStringList()) {
+					list.insert(list.end(), matched.asStringList().begin(), matched.asStringList().end());
+				}
+				state.set(fSlot, value(list));
 			} else {
-				(**same_name).setValue(value(val));
+				state.set(fSlot, matched);
 			}
-		} else {
-			collected.push_back(match.second);
 		}
+
+		left.erase(left.begin()+static_cast<std::ptrdiff_t>(match.first));
 		return true;
 	}
 
-	inline std::pair<size_t, boost::shared_ptr<LeafPattern> > Argument::single_match(PatternList const& left) const
+	inline std::pair<size_t, value const*> Argument::single_match(PatternList const& left) const
 	{
-		std::pair<size_t, boost::shared_ptr<LeafPattern> > ret;
+		std::pair<size_t, value const*> ret(0, static_cast<value const*>(NULL));
 
 		for(size_t i = 0, size = left.size(); i < size; ++i)
 		{
 			const Argument* arg = dynamic_cast<Argument const*>(left[i].get());
 			if (arg) {
+				// a tail is only for the argument it was made for
+				if (dynamic_cast<ArgvTail const*>(arg) && arg->name() != name())
+					break;
 				ret.first = i;
-				ret.second = boost::make_shared<Argument>(name(), arg->getValue());
+				ret.second = &arg->getValue();
 				break;
 			}
 		}
@@ -504,9 +846,10 @@ namespace docopt {
 		return ret;
 	}
 
-	inline std::pair<size_t, boost::shared_ptr<LeafPattern> > Command::single_match(PatternList const& left) const
+	inline std::pair<size_t, value const*> Command::single_match(PatternList const& left) const
 	{
-		std::pair<size_t, boost::shared_ptr<LeafPattern> > ret;
+		static value const matched(true);
+		std::pair<size_t, value const*> ret(0, static_cast<value const*>(NULL));
 
 		for(size_t i = 0, size = left.size(); i < size; ++i)
 		{
@@ -514,7 +857,7 @@ namespace docopt {
 			if (arg) {
 				if (name() == arg->getValue()) {
 					ret.first = i;
-					ret.second = boost::make_shared<Command>(name(), value(true));
+					ret.second = &matched;
 				}
 				break;
 			}
@@ -535,8 +878,7 @@ namespace docopt {
 			options_end = option_description.begin() + static_cast<std::ptrdiff_t>(double_space);
 		}
 
-		static const boost::regex pattern("(-{1,2})?(.*?)([,= ]|$)");
-		for(boost::sregex_iterator i(option_description.begin(), options_end, pattern, boost::regex_constants::match_not_null),
+		for(boost::sregex_iterator i(option_description.begin(), options_end, grammar().option_description, boost::regex_constants::match_not_null),
 			e;
 			i != e;
 			++i)
@@ -567,7 +909,7 @@ namespace docopt {
 			boost::smatch match;
 			if (boost::regex_search(options_end, option_description.end(),
 						  match,
-						  boost::regex("\\[default: (.*)\\]", boost::regex::icase)))
+						  grammar().option_default))
 			{
 				val = match[1].str();
 			}
@@ -576,51 +918,69 @@ namespace docopt {
 		return Option(shortOption, longOption, argcount, val);
 	}
 
-	inline std::pair<size_t, boost::shared_ptr<LeafPattern> > Option::single_match(PatternList const& left) const
+	inline std::pair<size_t, value const*> Option::single_match(PatternList const& left) const
 	{
-		std::pair<size_t, boost::shared_ptr<LeafPattern> > ret;
+		std::pair<size_t, value const*> ret(0, static_cast<value const*>(NULL));
 
-		PatternList::const_iterator thematch = left.begin();
-		for (; thematch != left.end(); ++thematch)
+		for(size_t i = 0, size = left.size(); i < size; ++i)
 		{
-			boost::shared_ptr<LeafPattern> leaf = boost::dynamic_pointer_cast<LeafPattern>(*thematch);
-			if (leaf && this->name() == leaf->name())
+			LeafPattern const* leaf = dynamic_cast<LeafPattern const*>(left[i].get());
+			if (leaf && this->name() == leaf->name()) {
+				ret.first = i;
+				ret.second = &leaf->getValue();
 				break;
+			}
 		}
 
-		if (thematch == left.end())
+		return ret;
+	}
+
+	inline bool OptionsShortcut::match(PatternList& left, MatchState& state) const {
+		// An option that argv does not have cannot match, so rather than every child scanning
+		// 'left', look up the children named by what is in it...
+		std::vector<size_t> present;
+		for (PatternList::const_iterator arg = left.begin(); arg != left.end(); ++arg) {
+			LeafPattern const* leaf = dynamic_cast<LeafPattern const*>(arg->get());
+			if (!leaf)
+				continue;
+			std::pair<std::vector<size_t>::const_iterator, std::vector<size_t>::const_iterator> named
+				= std::equal_range(fByName.begin(), fByName.end(), leaf->name(), ChildNameLess(fChildren));
+			present.insert(present.end(), named.first, named.second);
+		}
+
+		// ... and match just those, in the order Optional::match would have tried them
+		std::sort(present.begin(), present.end());
+		present.erase(std::unique(present.begin(), present.end()), present.end());
+		for (std::vector<size_t>::const_iterator child = present.begin(); child != present.end(); ++child)
 		{
-			return ret;
+			fChildren[*child]->match(left, state);
 		}
-		ret.first = std::distance(left.begin(), thematch);
-		ret.second = boost::dynamic_pointer_cast<LeafPattern>(*thematch);
-		return ret;
+		return true;
 	}
 
-	inline bool Required::match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const {
+	inline bool Required::match(PatternList& left, MatchState& state) const {
 		PatternList l = left;
-		std::vector<boost::shared_ptr<LeafPattern> > c = collected;
+		MatchState::Mark const start = state.mark();
 
 		for(PatternList::const_iterator pattern = fChildren.begin(); pattern != fChildren.end(); ++pattern)
 		{
-			bool ret = (*pattern)->match(l, c);
+			bool ret = (*pattern)->match(l, state);
 			if (!ret) {
-				// leave (left, collected) untouched
+				// leave (left, state) as they were
+				state.undo(start);
 				return false;
 			}
 		}
 
-		left = l;
-		collected = c;
+		left.swap(l);
 		return true;
 	}
 
-	inline bool OneOrMore::match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const
+	inline bool OneOrMore::match(PatternList& left, MatchState& state) const
 	{
 		assert(fChildren.size() == 1);
 
 		PatternList l = left;
-		std::vector<boost::shared_ptr<LeafPattern> > c = collected;
 
 		bool matched = true;
 		size_t times = 0;
@@ -629,8 +989,8 @@ namespace docopt {
 		bool firstLoop = true;
 
 		while (matched) {
-			// could it be that something didn't match but changed l or c?
-			matched = fChildren[0]->match(l, c);
+			// a child that does not match leaves l and state as they were
+			matched = fChildren[0]->match(l, state);
 
 			if (matched)
 				++times;
@@ -648,48 +1008,185 @@ namespace docopt {
 			return false;
 		}
 
-		left = l;
-		collected = c;
+		left.swap(l);
 		return true;
 	}
 
 
-	inline bool Either::match(PatternList& left, std::vector<boost::shared_ptr<LeafPattern> >& collected) const
+	inline void Either::index()
+	{
+		fOptions.clear();
+		fCommands.clear();
+		for (size_t i = 0; i < fChildren.size(); ++i) {
+			Pattern const* child = fChildren[i].get();
+			if (dynamic_cast<Option const*>(child)) {
+				fOptions.push_back(i);
+			} else if (dynamic_cast<Command const*>(child)) {
+				fCommands.push_back(i);
+			} else {
+				fOptions.clear();
+				fCommands.clear();
+				return;
+			}
+		}
+		// stable, so the first of several same-named alternatives is the one declared first
+		std::stable_sort(fOptions.begin(), fOptions.end(), ChildNameLess(fChildren));
+		std::stable_sort(fCommands.begin(), fCommands.end(), ChildNameLess(fChildren));
+	}
+
+	inline bool Either::match_leaves(PatternList& left, MatchState& state) const
+	{
+		typedef std::vector<size_t>::const_iterator Iter;
+
+		size_t first = fChildren.size();
+		bool seenArgument = false;
+		for (PatternList::const_iterator arg = left.begin(); arg != left.end(); ++arg) {
+			LeafPattern const* leaf = dynamic_cast<LeafPattern const*>(arg->get());
+			if (!leaf)
+				continue;
+
+			// an option matches anything in 'left' with its name...
+			Iter named = std::lower_bound(fOptions.begin(), fOptions.end(), leaf->name(), ChildNameLess(fChildren));
+			if (named != fOptions.end() && fChildren[*named]->name() == leaf->name())
+				first = std::min(first, *named);
+
+			// ... and a command only the first positional argument
+			if (seenArgument || !dynamic_cast<Argument const*>(leaf))
+				continue;
+			seenArgument = true;
+			if (!leaf->getValue().isString())
+				continue;
+			named = std::lower_bound(fCommands.begin(), fCommands.end(), leaf->getValue().asString(), ChildNameLess(fChildren));
+			if (named != fCommands.end() && fChildren[*named]->name() == leaf->getValue().asString())
+				first = std::min(first, *named);
+		}
+
+		if (first == fChildren.size())
+			return false;
+		return fChildren[first]->match(left, state);
+	}
+
+	inline bool Either::match(PatternList& left, MatchState& state) const
 	{
-		typedef std::pair<PatternList, std::vector<boost::shared_ptr<LeafPattern> > > Outcome;
+		if (!fOptions.empty() || !fCommands.empty())
+			return match_leaves(left, state);
 
-		std::vector<Outcome> outcomes;
+		if (fWins)
+			return match_adaptive(left, state);
+
+		// Each alternative is tried from the same start, and taken back again unless it is the last one;
+		// the one leaving the fewest patterns (the earliest declared on a tie) is then put back.
+		MatchState::Mark const start = state.mark();
+		unsigned long currentMinimum = ULONG_MAX;
+		PatternList minLeft;
+		MatchState::Outcome minOutcome;
+		bool applied = false;
 
 		for (PatternList::const_iterator pattern = fChildren.begin(); pattern != fChildren.end(); ++pattern)
 		{
-			// need a copy so we apply the same one for every iteration
 			PatternList l = left;
-			std::vector<boost::shared_ptr<LeafPattern> > c = collected;
-			bool matched = (*pattern)->match(l, c);
-			if (matched) {
-				outcomes.push_back(Outcome(l, c));
+			if (!(*pattern)->match(l, state))
+				continue;
+
+			bool const better = l.size() < currentMinimum;
+			if (better) {
+				currentMinimum = l.size();
+				minLeft.swap(l);
+			}
+			if (better && pattern + 1 == fChildren.end()) {
+				applied = true;
+				break;
 			}
+			if (better)
+				state.save(start, minOutcome);
+			state.undo(start);
 		}
 
-		unsigned long currentMinimum = ULONG_MAX;
-		Outcome minOutcome;
+		if (currentMinimum == ULONG_MAX)
+		{
+			return false;
+		}
+
+		left.swap(minLeft);
+		if (!applied)
+			state.redo(minOutcome);
+
+		return true;
+	}
+
+	inline void Either::setAdaptive(bool adaptive)
+	{
+		if (!adaptive) {
+			fWins.reset();
+		} else if (!fWins) {
+			fWins = boost::make_shared<Wins>(fChildren.size());
+		}
+	}
+
+	namespace {
+		struct MoreWins {
+			explicit MoreWins(std::vector<unsigned long> const& counts) : fCounts(counts) {}
+
+			bool operator()(size_t a, size_t b) const {
+				return fCounts[a] > fCounts[b];
+			}
+
+			std::vector<unsigned long> const& fCounts;
+		};
+	}
+
+	inline std::vector<size_t> Either::Wins::order() const
+	{
+		std::vector<unsigned long> counts(fSize);
+		std::vector<size_t> ret(fSize);
+		for (size_t i = 0; i < fSize; ++i) {
+			counts[i] = fCounts[i].load(boost::memory_order_relaxed);
+			ret[i] = i;
+		}
+		std::stable_sort(ret.begin(), ret.end(), MoreWins(counts));
+		return ret;
+	}
 
-		for (std::vector<Outcome>::const_iterator it = outcomes.begin(); it != outcomes.end(); ++it)
+	inline bool Either::match_adaptive(PatternList& left, MatchState& state) const
+	{
+		// The exhaustive match picks the alternative leaving the fewest patterns, the earliest declared one on a tie.
+		// Trying the usual winners first picks the same one: once some alternative leaves nothing, only those
+		// declared before it could still tie and take precedence, so everything declared after it is skipped.
+		std::vector<size_t> const order = fWins->order();
+
+		MatchState::Mark const start = state.mark();
+		size_t best = 0;
+		unsigned long bestLeft = ULONG_MAX;
+		PatternList bestL;
+		MatchState::Outcome bestOutcome;
+
+		for (std::vector<size_t>::const_iterator alternative = order.begin(); alternative != order.end(); ++alternative)
 		{
-			if (it->first.size() < currentMinimum)
-			{
-				currentMinimum = it->first.size();
-				minOutcome = *it;
+			if (bestLeft == 0 && *alternative > best)
+				continue;
+
+			PatternList l = left;
+			if (!fChildren[*alternative]->match(l, state))
+				continue;
+
+			if (l.size() < bestLeft || (l.size() == bestLeft && *alternative < best)) {
+				best = *alternative;
+				bestLeft = l.size();
+				bestL.swap(l);
+				state.save(start, bestOutcome);
 			}
+			state.undo(start);
 		}
 
-		if (currentMinimum == ULONG_MAX)
+		if (bestLeft == ULONG_MAX)
 		{
 			return false;
 		}
 
-		left = minOutcome.first;
-		collected = minOutcome.second;
+		fWins->record(best);
+
+		left.swap(bestL);
+		state.redo(bestOutcome);
 
 		return true;
 	}
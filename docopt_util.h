@@ -11,6 +11,26 @@
 
 #include <boost/regex.hpp>
 
+// Vector kernels for scanning argv; define DOCOPT_NO_SIMD to use the plain loops only
+#if !defined(DOCOPT_NO_SIMD)
+	#if defined(__AVX2__)
+		#define DOCOPT_AVX2 1
+	#endif
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define DOCOPT_SSE2 1
+	#endif
+#endif
+
+#if defined(DOCOPT_AVX2)
+	#include <immintrin.h>
+#elif defined(DOCOPT_SSE2)
+	#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(DOCOPT_AVX2) || defined(DOCOPT_SSE2))
+	#include <intrin.h>
+#endif
+
 #pragma mark -
 #pragma mark General utility
 
@@ -30,18 +50,35 @@ namespace {
 				  str.begin());
 	}
 
-	std::string trim(std::string str,
-			 const std::string& whitespace = " \t\n")
-	{
-		const unsigned long strEnd = str.find_last_not_of(whitespace);
-		if (strEnd==std::string::npos)
-			return ""; // no content
-		str.erase(strEnd+1);
+	// Characters owned by someone else (a mapped file, say), to read text without copying it
+	class StringView {
+	public:
+		StringView(char const* data, size_t size) : fBegin(data), fEnd(data + size) {}
+		StringView(char const* begin, char const* end) : fBegin(begin), fEnd(end) {}
+		StringView(std::string const& str) : fBegin(str.data()), fEnd(str.data() + str.size()) {}
 
-		const unsigned long strBegin = str.find_first_not_of(whitespace);
-		str.erase(0, strBegin);
+		char const* begin() const { return fBegin; }
+		char const* end() const { return fEnd; }
+		size_t size() const { return static_cast<size_t>(fEnd - fBegin); }
+		bool empty() const { return fBegin == fEnd; }
 
-		return str;
+		std::string str() const { return std::string(fBegin, fEnd); }
+
+	private:
+		char const* fBegin;
+		char const* fEnd;
+	};
+
+	StringView trim(StringView text,
+			const std::string& whitespace = " \t\n")
+	{
+		char const* begin = text.begin();
+		char const* end = text.end();
+		while (begin != end && whitespace.find(*begin) != std::string::npos)
+			++begin;
+		while (end != begin && whitespace.find(*(end-1)) != std::string::npos)
+			--end;
+		return StringView(begin, end);
 	}
 
 	std::vector<std::string> split(std::string const& str, size_t pos = 0)
@@ -94,13 +131,60 @@ namespace {
 		return ret;
 	}
 
-	std::vector<std::string> regex_split(std::string const& text, boost::regex const& re)
+	// the index of the lowest set bit of a non-zero mask
+	inline unsigned lowest_bit(unsigned mask)
 	{
-		std::vector<std::string> ret;
-		for (boost::sregex_token_iterator it(text.begin(), text.end(), re, -1);
-			 it != boost::sregex_token_iterator();
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<unsigned>(index);
+#elif defined(__GNUC__)
+		return static_cast<unsigned>(__builtin_ctz(mask));
+#else
+		unsigned index = 0;
+		while (!(mask & 1u)) {
+			mask >>= 1;
+			++index;
+		}
+		return index;
+#endif
+	}
+
+	// Append the offset of every 'c' in [data, data+size) to 'found', in order, a vector at a time where possible
+	void find_all(char const* data, size_t size, char c, std::vector<size_t>& found)
+	{
+		size_t i = 0;
+#if defined(DOCOPT_AVX2)
+		__m256i const wide = _mm256_set1_epi8(c);
+		for (; i + 32 <= size; i += 32) {
+			__m256i const chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+			unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wide)));
+			for (; mask; mask &= mask - 1)
+				found.push_back(i + lowest_bit(mask));
+		}
+#endif
+#if defined(DOCOPT_SSE2)
+		__m128i const narrow = _mm_set1_epi8(c);
+		for (; i + 16 <= size; i += 16) {
+			__m128i const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+			unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, narrow)));
+			for (; mask; mask &= mask - 1)
+				found.push_back(i + lowest_bit(mask));
+		}
+#endif
+		for (; i < size; ++i) {
+			if (data[i] == c)
+				found.push_back(i);
+		}
+	}
+
+	std::vector<StringView> regex_split(StringView text, boost::regex const& re)
+	{
+		std::vector<StringView> ret;
+		for (boost::cregex_token_iterator it(text.begin(), text.end(), re, -1);
+			 it != boost::cregex_token_iterator();
 			 ++it) {
-			ret.push_back(*it);
+			ret.push_back(StringView(it->first, it->second));
 		}
 		return ret;
 	}
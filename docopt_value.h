@@ -9,25 +9,41 @@
 #ifndef docopt__value_h_
 #define docopt__value_h_
 
+// Only the standard library is included here, so a translation unit that includes docopt.h does
+// not pull in Boost; what needs it is defined in docopt.cpp.
+#include <cstddef>
 #include <string>
 #include <vector>
-#include <functional> // std::hash
 #include <iosfwd>
-#include <typeinfo>
 #include <stdexcept>
 
-#include <boost/config.hpp>
-#include <boost/functional/hash.hpp>
-#include <boost/lexical_cast.hpp>
+#ifdef DOCOPT_HEADER_ONLY
+	#define DOCOPT_INLINE inline
+	#define DOCOPTAPI
+#else 
+	#define DOCOPT_INLINE
+
+	// On Windows, export certain symbols so they are available
+	// to users of docopt.dll (shared library).
+	#ifdef WIN32
+		#ifdef DOCOPT_EXPORTS
+			#define DOCOPTAPI __declspec(dllexport)
+		#else
+			#define DOCOPTAPI __declspec(dllimport)
+		#endif
+	#else
+		#define DOCOPTAPI
+	#endif
+#endif
 
 namespace docopt {
 
 	/// A generic type to hold the various types that can be produced by docopt.
 	///
 	/// This type can be one of: {bool, long, string, vector<string>}, or empty.
-	struct value {
+	struct DOCOPTAPI value {
 		/// An empty value
-		value() : kind(Empty) {}
+		value() : kind(Empty), numeric(false) {}
 
 		value(std::string);
 		value(std::vector<std::string>);
@@ -47,6 +63,9 @@ namespace docopt {
 
 		// Throws std::invalid_argument if the type does not match
 		bool asBool() const;
+
+		// Strings that hold a number are converted once, when the value is made, so this never
+		// converts; it throws std::runtime_error for a string that is not a number
 		long asLong() const;
 		std::string const& asString() const;
 		std::vector<std::string> const& asStringList() const;
@@ -97,93 +116,50 @@ namespace docopt {
 
 	private:
 		Kind kind;
+		bool numeric; // for a String: whether variant.longValue holds its number (fits in kind's padding)
 		Variant variant;
 	};
 
 	/// Write out the contents to the ostream
 	std::ostream& operator<<(std::ostream&, value const&);
-}
-
-namespace boost {
-	template <>
-	struct hash<docopt::value> {
-		size_t operator()(docopt::value const& val) const {
-			return val.hash();
-		}
-	};
 
-	template <>
-	struct hash<std::type_info> {
-		size_t operator()(std::type_info const& val) const {
-			return boost::hash<std::string>()(std::string(val.name()));
-		}
-	};
+	/// Found by boost::hash (and anything else that looks up 'hash_value'), so values can be hashed keys
+	inline size_t hash_value(value const& val) { return val.hash(); }
 }
 
 namespace docopt {
 	inline
 	value::value(bool v)
-	: kind(Bool)
+	: kind(Bool),
+	  numeric(false)
 	{
 		variant.boolValue = v;
 	}
 
 	inline
 	value::value(long v)
-	: kind(Long)
+	: kind(Long),
+	  numeric(false)
 	{
 		variant.longValue = v;
 	}
 
 	inline
 	value::value(int v)
-	: kind(Long)
+	: kind(Long),
+	  numeric(false)
 	{
 		variant.longValue = static_cast<long>(v);
 	}
 
-	inline
-	value::value(std::string v)
-	: kind(String)
-	{
-		variant.strValue = v;
-	}
-
 	inline
 	value::value(std::vector<std::string> v)
-	: kind(StringList)
+	: kind(StringList),
+	  numeric(false)
 	{
 		variant.strList = v;
 	}
 
-	inline
-	size_t value::hash() const
-	{
-		switch (kind) {
-			case String:
-				return boost::hash<std::string>()(variant.strValue);
-
-			case StringList: {
-				size_t seed = boost::hash<size_t>()(variant.strList.size());
-				for(std::vector<std::string>::const_iterator it = variant.strList.begin(); it != variant.strList.end(); ++it)
-				{
-					boost::hash_combine(seed, *it);
-				}
-				return seed;
-			}
-
-			case Bool:
-				return boost::hash<bool>()(variant.boolValue);
-
-			case Long:
-				return boost::hash<long>()(variant.longValue);
-
-			case Empty:
-			default:
-				return boost::hash<void*>()(NULL);
-		}
-	}
-
 	inline
 	bool value::asBool() const
 	{
@@ -194,16 +170,10 @@ namespace docopt {
 	inline
 	long value::asLong() const
 	{
-		// Attempt to convert a string to a long
 		if (kind == String) {
-			const std::string& str = variant.strValue;
-            try {
-                long ret = boost::lexical_cast<long>(str);
-                return ret;
-            }
-            catch(const boost::bad_lexical_cast& e) {
-                throw std::runtime_error(str + " contains non-numeric characters");
-            }
+			if (!numeric)
+				throw std::runtime_error(variant.strValue + " contains non-numeric characters");
+			return variant.longValue;
 		}
 		throwIfNotKind(Long);
 		return variant.longValue;
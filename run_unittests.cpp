@@ -0,0 +1,1235 @@
+//
+//  run_unittests.cpp
+//  docopt
+//
+//  Checks for the parts of the API that the testcases.docopt fixtures cannot reach.
+//
+
+#include "docopt.h"
+#include "run_unittests.h"
+#if __cplusplus >= 201703L
+	#include "docopt_pmr.h"
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+
+#pragma mark -
+#pragma mark Allocation counting
+
+// Every allocation of the process goes through here, so tests can see how many bytes are live
+static boost::atomic<size_t> gLiveBytes(0);
+static boost::atomic<unsigned long> gAllocations(0);
+static boost::atomic<size_t> gAllocatedBytes(0); // ever, freed or not
+// when non-zero, the allocation that brings it down to zero throws std::bad_alloc
+static boost::atomic<unsigned long> gFailAllocationIn(0);
+
+// room in front of each block to remember its size, keeping the block suitably aligned
+static const size_t kHeaderSize = 16;
+
+void* operator new(std::size_t size)
+{
+	// remember the size in front of the block, so delete knows how much is released
+	if (gFailAllocationIn.load() && gFailAllocationIn.fetch_sub(1) == 1)
+		throw std::bad_alloc();
+	std::size_t* block = static_cast<std::size_t*>(std::malloc(size + kHeaderSize));
+	if (!block)
+		throw std::bad_alloc();
+	++gAllocations;
+	gAllocatedBytes += size;
+	*block = size;
+	gLiveBytes += size;
+	return reinterpret_cast<char*>(block) + kHeaderSize;
+}
+
+void operator delete(void* ptr) throw()
+{
+	if (!ptr)
+		return;
+	std::size_t* block = reinterpret_cast<std::size_t*>(static_cast<char*>(ptr) - kHeaderSize);
+	gLiveBytes -= *block;
+	std::free(block);
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete[](void* ptr) throw() { operator delete(ptr); }
+
+#pragma mark -
+#pragma mark Checks
+
+// 'reported' must account for 'measured' bytes to within 10%
+static bool close_enough(size_t reported, size_t measured)
+{
+	size_t const slack = measured / 10;
+	return reported + slack >= measured && reported <= measured + slack;
+}
+
+static bool throws_on_asLong(docopt::value const& val)
+{
+	try {
+		val.asLong();
+	} catch (std::runtime_error const&) {
+		return true;
+	}
+	return false;
+}
+
+static void test_value_conversions()
+{
+	docopt::value const number(std::string("42"));
+	CHECK(number.isString());
+	CHECK(number.asString() == "42");
+	for (int i = 0; i < 3; ++i)
+		CHECK(number.asLong() == 42);
+	CHECK(docopt::value(std::string("-7")).asLong() == -7);
+	CHECK(docopt::value(std::string("+007")).asLong() == 7);
+
+	// what lexical_cast rejects still throws, every time
+	char const* const notNumbers[] = { "", "-", "+", "4x", " 4", "0x10", "+-1", "99999999999999999999" };
+	for (size_t i = 0; i < sizeof(notNumbers) / sizeof(notNumbers[0]); ++i) {
+		docopt::value const val = docopt::value(std::string(notNumbers[i]));
+		CHECK(throws_on_asLong(val));
+		CHECK(throws_on_asLong(val));
+	}
+
+	// the converted number travels with copies and assignment
+	docopt::value copy(number);
+	CHECK(copy.asLong() == 42);
+	docopt::value assigned(std::string("x"));
+	CHECK(throws_on_asLong(assigned));
+	assigned = number;
+	CHECK(assigned.asLong() == 42);
+	assigned = docopt::value(std::string("x"));
+	CHECK(throws_on_asLong(assigned));
+
+	// equality still goes by kind and text
+	CHECK(copy == number);
+	CHECK(docopt::value(std::string("7")) != docopt::value(std::string("07")));
+	CHECK(docopt::value(std::string("7")) != docopt::value(7));
+	CHECK(number.hash() == docopt::value(std::string("42")).hash());
+}
+
+static void test_parser_footprint()
+{
+	std::string const doc = NAVAL_FATE;
+
+	// the first compile also builds the shared grammar, which no parser owns
+	docopt::Parser(doc).parse(args("ship", "new", "a-rather-long-ship-name-that-is-not-inline"));
+
+	size_t const before = gLiveBytes;
+	docopt::Parser* parser = new docopt::Parser(doc);
+	size_t const measured = gLiveBytes - before - sizeof(docopt::Parser);
+
+	docopt::Footprint const footprint = parser->footprint();
+	CHECK(footprint.nodes > 0);
+	CHECK(footprint.options > 0);
+	CHECK(footprint.strings >= doc.size());
+	CHECK(close_enough(footprint.total(), measured));
+	if (!close_enough(footprint.total(), measured))
+		std::cout << "  parser: reported " << footprint.total() << ", allocated " << measured << std::endl;
+
+	delete parser;
+}
+
+static void test_result_footprint()
+{
+	docopt::Parser parser(NAVAL_FATE);
+
+	size_t const before = gLiveBytes;
+	docopt::Result* result = new docopt::Result(parser.parse_result(args("ship", "new", "a-rather-long-ship-name-that-is-not-inline", "another-ship-name-that-needs-the-heap")));
+	size_t const measured = gLiveBytes - before - sizeof(docopt::Result);
+
+	docopt::Footprint const footprint = result->footprint();
+	CHECK(footprint.nodes > 0);
+	CHECK(footprint.strings > 0);
+	CHECK(footprint.options == 0);
+	CHECK(close_enough(footprint.total(), measured));
+	if (!close_enough(footprint.total(), measured))
+		std::cout << "  result: reported " << footprint.total() << ", allocated " << measured << std::endl;
+
+	delete result;
+}
+
+static void test_shared_result()
+{
+	docopt::Parser parser(NAVAL_FATE);
+	std::vector<std::string> const argv = args("ship", "new", "a-rather-long-ship-name-that-is-not-inline");
+	std::map<std::string, docopt::value> parsed = docopt::docopt_parse(NAVAL_FATE, argv);
+	std::map<std::string, docopt::value> const expected = parsed;
+
+	docopt::Result const result = docopt::Result::adopt(parsed);
+	CHECK(parsed.empty());
+	CHECK(result.args() == expected);
+	CHECK(result.occurrences().empty());
+	CHECK(result["<name>"] == expected.find("<name>")->second);
+
+	// handing copies out (to workers, say) shares the one snapshot
+	size_t const before = gLiveBytes;
+	std::vector<docopt::Result> workers(8, result);
+	CHECK(gLiveBytes - before == workers.capacity() * sizeof(docopt::Result));
+	for (size_t i = 0; i < workers.size(); ++i)
+		CHECK(&workers[i].args() == &result.args());
+	workers.clear();
+	CHECK(result.args() == expected);
+
+	CHECK(parser.parse_result(argv).args() == expected);
+}
+
+static void test_cache_footprint()
+{
+	docopt::Parser parser(NAVAL_FATE);
+	size_t const uncached = parser.footprint().total();
+
+	parser.enableCache(1 << 20);
+	parser.parse_result(args("ship", "new", "a-rather-long-ship-name-that-is-not-inline"));
+
+	CHECK(parser.cacheStats().entries == 1);
+	CHECK(parser.footprint().indexes >= parser.cacheStats().bytes);
+	CHECK(parser.footprint().total() > uncached);
+}
+
+static void check_occurrence(docopt::Parser const& parser, docopt::Occurrence const& occurrence,
+			     char const* name, size_t argvIndex, docopt::value const& val)
+{
+	CHECK(parser.slotName(occurrence.slot) == name);
+	CHECK(occurrence.argvIndex == argvIndex);
+	CHECK(occurrence.val == val);
+}
+
+static void test_occurrences()
+{
+	std::string const doc =
+		"Usage: prog [-vq]... <file>...\n"
+		"\n"
+		"Options:\n"
+		"  -v  Say more.\n"
+		"  -q  Say less.\n";
+	std::vector<std::string> const argv = args("-v", "a", "-qv", "b");
+
+	docopt::Parser parser(doc);
+	CHECK(parser.parse_result(argv).occurrences().empty());
+
+	docopt::Parser const parsers[] = { parser, docopt::Parser::lazy(doc) };
+	for (size_t i = 0; i < 2; ++i) {
+		docopt::Parser p = parsers[i];
+		p.setRecordOccurrences(true);
+		docopt::Result const result = p.parse_result(argv);
+		CHECK(result["-v"] == docopt::value(2l));
+
+		std::vector<docopt::Occurrence> const& occurrences = result.occurrences();
+		CHECK(occurrences.size() == 5);
+		if (occurrences.size() != 5)
+			continue;
+		check_occurrence(p, occurrences[0], "-v", 0, docopt::value(true));
+		check_occurrence(p, occurrences[1], "<file>", 1, docopt::value(std::string("a")));
+		check_occurrence(p, occurrences[2], "-q", 2, docopt::value(true));
+		check_occurrence(p, occurrences[3], "-v", 2, docopt::value(true));
+		check_occurrence(p, occurrences[4], "<file>", 3, docopt::value(std::string("b")));
+	}
+
+	// compiled parsers number their names in the order args() lists them
+	CHECK(parser.slotCount() == 3);
+	CHECK(parser.slotName(0) == "-q" && parser.slotName(1) == "-v" && parser.slotName(2) == "<file>");
+}
+
+// What parsing 'argv' gives, as one string to compare
+static std::string outcome(docopt::Parser const& parser, std::vector<std::string> const& argv)
+{
+	std::string ret;
+	try {
+		std::map<std::string, docopt::value> const result = parser.parse(argv, false, false);
+		for (std::map<std::string, docopt::value>::const_iterator arg = result.begin(); arg != result.end(); ++arg)
+			ret += arg->first + "=" + boost::lexical_cast<std::string>(arg->second) + " ";
+	} catch (docopt::DocoptArgumentError const& error) {
+		ret = std::string("error: ") + error.what();
+	}
+	return ret;
+}
+
+static std::vector<std::vector<std::string> > naval_fate_argvs()
+{
+	std::vector<std::vector<std::string> > ret;
+	ret.push_back(args("ship", "new", "a", "b"));
+	ret.push_back(args("ship", "a", "move", "1"));
+	ret.push_back(args("ship", "a", "move", "1", "2"));
+	ret.push_back(args("ship", "a", "move", "1", "2", "--speed=3"));
+	ret.push_back(args("ship", "shoot", "1", "2"));
+	ret.push_back(args("mine", "set", "1", "2", "--drifting"));
+	ret.push_back(args("mine", "remove", "1", "2", "--moored", "--drifting"));
+	ret.push_back(args("report", "-v", "home", "--output-directory=/tmp"));
+	ret.push_back(args("--help"));
+	ret.push_back(args("--version"));
+	ret.push_back(args("--speed"));
+	return ret;
+}
+
+static void test_doc_in_memory()
+{
+	std::string const doc = NAVAL_FATE;
+	docopt::Parser const compiled(doc);
+	std::vector<std::vector<std::string> > const argvs = naval_fate_argvs();
+
+	// only 'size' characters are read, so a doc need not end where its buffer does
+	std::string const buffer = doc + "\nUsage: not part of the doc\n";
+	docopt::Parser const embedded(buffer.data(), doc.size());
+	CHECK(embedded.doc() == doc);
+
+	char const* const path = "run_unittests_naval_fate.txt";
+	FILE* file = std::fopen(path, "wb");
+	CHECK(file != NULL);
+	if (file) {
+		std::fwrite(doc.data(), 1, doc.size(), file);
+		std::fclose(file);
+	}
+	docopt::Parser const mapped = docopt::Parser::from_file(path);
+	std::remove(path);
+	CHECK(mapped.doc() == doc);
+
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		CHECK(outcome(embedded, argvs[i]) == outcome(compiled, argvs[i]));
+		CHECK(outcome(mapped, argvs[i]) == outcome(compiled, argvs[i]));
+	}
+
+	bool missing = false;
+	try {
+		docopt::Parser::from_file(path);
+	} catch (std::runtime_error const&) {
+		missing = true;
+	}
+	CHECK(missing);
+}
+
+static void test_usage_for()
+{
+	docopt::Parser parser(NAVAL_FATE);
+	std::string const& all = parser.usageFor(args("--speed"));
+	CHECK(all.compare(0, 7, "Usage:\n") == 0);
+	CHECK(all.find("naval_fate ship new <name>...\n") != std::string::npos);
+	CHECK(all.find("naval_fate --version\n") != std::string::npos);
+	CHECK(all.find("Options:") == std::string::npos);
+	CHECK(&parser.usageFor(args("bogus")) == &all);
+
+	std::string const ships = parser.usageFor(args("-v", "ship", "x"));
+	CHECK(ships.find("naval_fate ship shoot <x> <y>\n") != std::string::npos);
+	CHECK(ships.find("mine") == std::string::npos);
+
+	size_t const line = parser.addUsage("mine list", "");
+	CHECK(parser.usageFor(args("mine")) == "Usage:\n"
+	      "    naval_fate mine (set|remove) <x> <y> [--moored | --drifting]\n"
+	      "    naval_fate mine list\n");
+	parser.removeUsage(line);
+	CHECK(parser.usageFor(args("mine")).find("list") == std::string::npos);
+
+	// an option's argument before the command is not taken for it
+	std::string const doc =
+		"Usage: prog build [--out=<dir>] <t>\n"
+		"       prog clean\n"
+		"\n"
+		"Options:\n"
+		"  -o --out=<dir>  Where to build.\n";
+	docopt::Parser const parsers[] = { docopt::Parser(doc), docopt::Parser::lazy(doc) };
+	for (size_t i = 0; i < 2; ++i) {
+		std::string const build = parsers[i].usageFor(args("build"));
+		CHECK(build == "Usage:\n    prog build [--out=<dir>] <t>\n");
+		CHECK(parsers[i].usageFor(args("-o", "/tmp", "build", "x")) == build);
+		CHECK(parsers[i].usageFor(args("--out", "/tmp", "build")) == build);
+		CHECK(parsers[i].usageFor(args("-o/tmp", "build")) == build);
+		CHECK(parsers[i].usageFor(args("--out=clean", "build")) == build);
+		CHECK(parsers[i].usageFor(args("-o", "clean")).find("build") != std::string::npos);
+	}
+}
+
+static void test_pass_through()
+{
+	std::string const doc =
+		"Usage: wrap [options] <command> [<args>...]\n"
+		"\n"
+		"Options:\n"
+		"  -v --verbose  Say more.\n";
+
+	docopt::Parser parser(doc);
+	parser.setPassThrough("<args>");
+	docopt::Parser lazy = docopt::Parser::lazy(doc);
+	lazy.setPassThrough("<args>");
+
+	std::vector<std::string> argv = args("-v", "run", "a", "--b", "-c");
+	docopt::Result const result = parser.parse_result(argv, true, true, true);
+	CHECK(result["--verbose"] == docopt::value(true));
+	CHECK(result["<command>"] == docopt::value(std::string("run")));
+	CHECK(result["<args>"].asStringList().empty());
+	CHECK(result.passThrough().begin == 2);
+	CHECK(result.passThrough().end == 5);
+	CHECK(lazy.parse_result(argv, true, true, true).passThrough().size() == 3);
+
+	// parse() and parsing without options_first still read the tail
+	CHECK(parser.parse(argv, true, true, true)["<args>"].asStringList().size() == 3);
+	CHECK(parser.parse_result(args("run", "a"), true, true, false)["<args>"].asStringList().size() == 1);
+
+	docopt::Result const bare = parser.parse_result(args("run"), true, true, true);
+	CHECK(bare.passThrough().empty());
+	CHECK(bare.passThrough().begin == 1);
+
+	// the result costs the same however long the tail is
+	size_t const shortTail = result.footprint().total();
+	for (int i = 0; i < 10000; ++i)
+		argv.push_back("forwarded-argument-that-is-not-copied");
+	docopt::Result const longTail = parser.parse_result(argv, true, true, true);
+	CHECK(longTail.passThrough().size() == argv.size() - 2);
+	CHECK(longTail.footprint().total() == shortTail);
+
+	parser.setPassThrough("");
+	CHECK(parser.parse_result(argv, true, true, true)["<args>"].asStringList().size() == argv.size() - 2);
+
+	// usage lines that take other arguments after the first positional one: parse_result, parse and
+	// validate all accept the same argv
+	std::string const alternatives =
+		"Usage: wrap run <cmd> [<args>...]\n"
+		"       wrap list <a> <b>\n";
+	docopt::Parser const forks[] = { docopt::Parser(alternatives), docopt::Parser::lazy(alternatives) };
+	for (size_t i = 0; i < 2; ++i) {
+		docopt::Parser fork = forks[i];
+		fork.setPassThrough("<args>");
+
+		argv = args("list", "x", "y");
+		docopt::Result const listed = fork.parse_result(argv, true, true, true);
+		CHECK(listed["<a>"] == docopt::value(std::string("x")));
+		CHECK(listed["<b>"] == docopt::value(std::string("y")));
+		CHECK(listed.passThrough().empty());
+		CHECK(fork.parse(argv, true, true, true)["<b>"] == docopt::value(std::string("y")));
+		CHECK(fork.validate(argv, true, true, true) == docopt::Accepted);
+
+		argv = args("run", "ls", "-l", "x");
+		docopt::Result const ran = fork.parse_result(argv, true, true, true);
+		CHECK(ran["<cmd>"] == docopt::value(std::string("ls")));
+		CHECK(ran["<args>"].asStringList().empty());
+		CHECK(ran.passThrough().begin == 2);
+		CHECK(ran.passThrough().end == 4);
+		CHECK(fork.validate(argv, true, true, true) == docopt::Accepted);
+
+		CHECK(fork.validate(args("list", "x"), true, true, true) == docopt::NoMatch);
+		CHECK(fork.validate(args("list", "x", "y", "z"), true, true, true) == docopt::UnexpectedArgument);
+	}
+
+	// the first positional argument is the pass-through argument's own
+	docopt::Parser rest("Usage: wrap [options] [<args>...]\n\nOptions:\n  -v  Verbose.\n");
+	rest.setPassThrough("<args>");
+	argv = args("-v", "a", "b", "c");
+	docopt::Result const all = rest.parse_result(argv, true, true, true);
+	CHECK(all["-v"] == docopt::value(true));
+	CHECK(all["<args>"].asStringList().empty());
+	CHECK(all.passThrough().begin == 1);
+	CHECK(all.passThrough().end == 4);
+	CHECK(rest.validate(argv, true, true, true) == docopt::Accepted);
+	CHECK(rest.parse_result(args("-v"), true, true, true).passThrough().begin == 1);
+
+	// a single-valued pass-through argument takes the tail whole, for validate() too
+	docopt::Parser single("Usage: wrap <cmd> <rest>\n");
+	single.setPassThrough("<rest>");
+	argv = args("a", "b", "c");
+	CHECK(single.parse_result(argv, true, true, true).passThrough().size() == 2);
+	CHECK(single.validate(argv, true, true, true) == docopt::Accepted);
+}
+
+static void test_fingerprint()
+{
+	// worked out by hand from the documented encoding, so any change to it shows up here
+	std::map<std::string, docopt::value> known;
+	known["--speed"] = docopt::value(std::string("15"));
+	known["--moored"] = docopt::value(false);
+	known["<name>"] = docopt::value(std::vector<std::string>(1, "Guardian"));
+	known["-v"] = docopt::value(2L);
+	known["<opt>"] = docopt::value();
+	CHECK(docopt::fingerprint(known) == 0x4581b932ff2a689fULL);
+
+	std::map<std::string, docopt::value> changed = known;
+	changed["--speed"] = docopt::value(std::string("16"));
+	CHECK(docopt::fingerprint(changed) != docopt::fingerprint(known));
+
+	// the one worked out while matching is the one of the map it produced
+	docopt::Parser const compiled(NAVAL_FATE);
+	docopt::Parser const lazy = docopt::Parser::lazy(NAVAL_FATE);
+	std::vector<std::vector<std::string> > const argvs = naval_fate_argvs();
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		try {
+			docopt::Result const result = compiled.parse_result(argvs[i], false, false);
+			CHECK(result.fingerprint() == docopt::fingerprint(result.args()));
+			docopt::Result const fromLazy = lazy.parse_result(argvs[i], false, false);
+			CHECK(fromLazy.fingerprint() == docopt::fingerprint(fromLazy.args()));
+		} catch (docopt::DocoptArgumentError const&) {
+		}
+	}
+
+	std::map<std::string, docopt::value> parsed = compiled.parse(args("ship", "new", "a"));
+	uint64_t const expected = docopt::fingerprint(parsed);
+	CHECK(docopt::Result::adopt(parsed).fingerprint() == expected);
+}
+
+// Tools that share one options section, each with a usage and an option of its own
+static std::vector<std::string> tool_docs(size_t tools, size_t common)
+{
+	std::string block;
+	for (size_t i = 0; i < common; ++i) {
+		std::string const n = boost::lexical_cast<std::string>(i);
+		block += "  --common-" + n + "=<v>  Common option " + n + " [default: " + n + "].\n";
+	}
+
+	std::vector<std::string> ret;
+	for (size_t t = 0; t < tools; ++t) {
+		std::string const n = boost::lexical_cast<std::string>(t);
+		ret.push_back("Usage: tool" + n + " [options] <file>\n"
+			      "       tool" + n + " run" + n + " [--own-" + n + "]\n"
+			      "\n"
+			      "Options:\n" + block +
+			      "  --own-" + n + "  Only this tool's.\n");
+	}
+	return ret;
+}
+
+static void test_parser_context()
+{
+	std::vector<std::string> const docs = tool_docs(20, 100);
+
+	size_t before = gLiveBytes;
+	std::vector<docopt::Parser>* alone = new std::vector<docopt::Parser>();
+	for (size_t i = 0; i < docs.size(); ++i)
+		alone->push_back(docopt::Parser(docs[i]));
+	size_t const aloneBytes = gLiveBytes - before;
+
+	before = gLiveBytes;
+	docopt::ParserContext* context = new docopt::ParserContext();
+	std::vector<docopt::Parser>* shared = new std::vector<docopt::Parser>();
+	for (size_t i = 0; i < docs.size(); ++i)
+		shared->push_back(docopt::Parser(docs[i], *context));
+	size_t const sharedBytes = gLiveBytes - before;
+
+	// the common options are held once rather than 20 times
+	CHECK(sharedBytes * 2 < aloneBytes);
+
+	// and reported once, by the context
+	size_t reported = context->footprint().total() + sizeof(docopt::ParserContext) + shared->capacity() * sizeof(docopt::Parser);
+	for (size_t i = 0; i < shared->size(); ++i)
+		reported += (*shared)[i].footprint().total();
+	CHECK(close_enough(reported, sharedBytes));
+	if (!close_enough(reported, sharedBytes))
+		std::cout << "  context: reported " << reported << ", allocated " << sharedBytes << std::endl;
+
+	// parsers outlive the handle they were compiled with, and parse just the same
+	delete context;
+	for (size_t i = 0; i < docs.size(); i += 7) {
+		std::string const run = "run" + boost::lexical_cast<std::string>(i);
+		std::string const own = "--own-" + boost::lexical_cast<std::string>(i);
+		CHECK(outcome((*shared)[i], args("--common-3=x", "f")) == outcome((*alone)[i], args("--common-3=x", "f")));
+		CHECK(outcome((*shared)[i], args(run.c_str(), own.c_str())) == outcome((*alone)[i], args(run.c_str(), own.c_str())));
+		CHECK(outcome((*shared)[i], args(run.c_str(), "--own-1")) == outcome((*alone)[i], args(run.c_str(), "--own-1")));
+	}
+
+	// a name has one slot across the context
+	CHECK((*shared)[0].slotCount() == (*shared)[19].slotCount());
+	CHECK((*shared)[0].slotName(7) == (*shared)[19].slotName(7));
+
+	delete shared;
+	delete alone;
+}
+
+static void test_context_parse_cost()
+{
+	char const* const DOC = "Usage: p [-v] <file>\n";
+	std::vector<std::string> const argv = args("-v", "f");
+
+	// a context numbering some 10000 names, the parser's own coming last
+	docopt::ParserContext context;
+	std::vector<docopt::Parser> others;
+	for (size_t t = 0; t < 400; ++t) {
+		std::string const n = boost::lexical_cast<std::string>(t);
+		std::string doc = "Usage: tool" + n + " [options]\n\nOptions:\n";
+		for (size_t i = 0; i < 25; ++i)
+			doc += "  --opt-" + n + "-" + boost::lexical_cast<std::string>(i) + "  An option.\n";
+		others.push_back(docopt::Parser(doc, context));
+	}
+	docopt::Parser const shared(DOC, context);
+	docopt::Parser const alone(DOC);
+	CHECK(shared.slotCount() > 10000);
+
+	// parsing allocates the same whatever the context numbers
+	size_t before = gAllocatedBytes;
+	std::map<std::string, docopt::value> const fromContext = shared.parse(argv);
+	size_t const sharedBytes = gAllocatedBytes - before;
+	before = gAllocatedBytes;
+	std::map<std::string, docopt::value> const fromAlone = alone.parse(argv);
+	size_t const aloneBytes = gAllocatedBytes - before;
+	CHECK(sharedBytes == aloneBytes);
+	if (sharedBytes != aloneBytes)
+		std::cout << "  context parse: allocated " << sharedBytes << ", alone " << aloneBytes << std::endl;
+	CHECK(fromContext == fromAlone);
+}
+
+static void test_capture()
+{
+	char const* const path = "run_unittests_capture.log";
+	std::remove(path);
+
+	CHECK(docopt::doc_fingerprint("") == 0xcbf29ce484222325ULL);
+	docopt::Parser const parser(NAVAL_FATE);
+
+	docopt::CaptureLog* log = new docopt::CaptureLog(path);
+	docopt::setCapture(log);
+	parser.parse(args("ship", "new", "a"));
+	parser.parse_result(args("mine", "set", "1", "2"), false, true, true);
+	try {
+		parser.parse(args("nonsense"));
+	} catch (docopt::DocoptArgumentError const&) {
+	}
+	docopt::setCapture(NULL);
+	parser.parse(args("ship", "new", "not-captured"));
+	delete log;
+
+	// a second log adds to the first
+	log = new docopt::CaptureLog(path);
+	docopt::setCapture(log);
+	docopt::docopt_parse(NAVAL_FATE, args("ship", "shoot", "1", "2"));
+	docopt::setCapture(NULL);
+	log->flush();
+	delete log;
+
+	std::vector<docopt::CaptureRecord> const records = docopt::CaptureLog::read(path);
+	std::remove(path);
+	CHECK(records.size() == 4);
+	if (records.size() == 4) {
+		uint64_t const doc = docopt::doc_fingerprint(NAVAL_FATE);
+		for (size_t i = 0; i < records.size(); ++i)
+			CHECK(records[i].doc == doc);
+		CHECK(records[0].argv == args("ship", "new", "a"));
+		CHECK(records[0].help && records[0].version && !records[0].options_first);
+		CHECK(records[1].argv == args("mine", "set", "1", "2"));
+		CHECK(!records[1].help && records[1].version && records[1].options_first);
+		CHECK(records[2].argv == args("nonsense"));
+		CHECK(records[3].argv == args("ship", "shoot", "1", "2"));
+	}
+
+	// anything else is not appended to, or read
+	FILE* file = std::fopen(path, "wb");
+	CHECK(file != NULL);
+	if (file) {
+		std::fputs("not a log\n", file);
+		std::fclose(file);
+	}
+	bool rejected = false;
+	try {
+		docopt::CaptureLog other(path);
+	} catch (std::runtime_error const&) {
+		rejected = true;
+	}
+	CHECK(rejected);
+	rejected = false;
+	try {
+		docopt::CaptureLog::read(path);
+	} catch (std::runtime_error const&) {
+		rejected = true;
+	}
+	CHECK(rejected);
+	std::remove(path);
+}
+
+// What Parser::validate should say, going by what parse does
+static docopt::Validation parse_verdict(docopt::Parser const& parser, std::vector<std::string> const& argv)
+{
+	try {
+		parser.parse(argv);
+		return docopt::Accepted;
+	} catch (docopt::DocoptExitHelp const&) {
+		return docopt::HelpRequested;
+	} catch (docopt::DocoptExitVersion const&) {
+		return docopt::VersionRequested;
+	} catch (docopt::DocoptArgumentError const& error) {
+		std::string const what = error.what();
+		if (what.compare(0, 20, "Unexpected argument:") == 0)
+			return docopt::UnexpectedArgument;
+		if (what == "Arguments did not match expected patterns")
+			return docopt::NoMatch;
+		return docopt::BadOption;
+	}
+}
+
+static void test_validate()
+{
+	docopt::Parser const compiled(NAVAL_FATE);
+	docopt::Parser const lazy = docopt::Parser::lazy(NAVAL_FATE);
+
+	std::vector<std::vector<std::string> > argvs = naval_fate_argvs();
+	argvs.push_back(args("ship", "a", "move", "1", "2", "3"));
+	argvs.push_back(args("mine"));
+	argvs.push_back(args("ship", "new", "a", "--output"));
+	argvs.push_back(args("ship", "new", "a", "--nonsense"));
+
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		CHECK(compiled.validate(argvs[i]) == parse_verdict(compiled, argvs[i]));
+		CHECK(lazy.validate(argvs[i]) == parse_verdict(lazy, argvs[i]));
+	}
+
+	CHECK(compiled.validate(args("ship", "new", "a")) == docopt::Accepted);
+	CHECK(compiled.validate(args("--version")) == docopt::VersionRequested);
+	CHECK(compiled.validate(args("--version"), true, false) == docopt::Accepted);
+	CHECK(compiled.validate(args("ship", "a", "move", "1", "2", "3")) == docopt::UnexpectedArgument);
+	CHECK(compiled.validate(args("mine")) == docopt::NoMatch);
+	CHECK(compiled.validate(args("ship", "new", "a", "--output")) == docopt::BadOption);
+}
+
+static void test_options_shortcut()
+{
+	std::string doc =
+		"Usage: p [options] <x>\n"
+		"       p [options] go <x>...\n"
+		"\n"
+		"Options:\n"
+		"  -v --verbose  Say more.\n"
+		"  --name=<n>    Name.\n"
+		"  --level=<l>   Level [default: 3].\n";
+	for (int i = 0; i < 500; ++i)
+		doc += "  --filler-" + boost::lexical_cast<std::string>(i) + "  Unused.\n";
+	docopt::Parser parser(doc);
+
+	std::map<std::string, docopt::value> const args1 = parser.parse(args("--name=z", "a", "-v"));
+	CHECK(args1.size() == 505);
+	CHECK(args1.find("--verbose")->second == docopt::value(true));
+	CHECK(args1.find("--name")->second == docopt::value(std::string("z")));
+	CHECK(args1.find("--level")->second == docopt::value(std::string("3")));
+	CHECK(args1.find("--filler-499")->second == docopt::value(false));
+	CHECK(args1.find("<x>")->second.asStringList().size() == 1);
+
+	std::map<std::string, docopt::value> const args2 = parser.parse(args("go", "a", "--filler-7", "b"));
+	CHECK(args2.find("--filler-7")->second == docopt::value(true));
+	CHECK(args2.find("<x>")->second.asStringList().size() == 2);
+
+	// an option the shortcut stands for still matches only once
+	CHECK(outcome(parser, args("-v", "a", "--verbose")).compare(0, 7, "error: ") == 0);
+}
+
+static void test_single_leaf_either()
+{
+	// the same usage twice: parenthesized, the alternatives are no longer single options and commands
+	docopt::Parser const leaves(
+		"Usage: p (--json | --yaml | -c | --json) [--fast | --slow]\n"
+		"       p (add | rm | --force | add) <x>\n"
+		"       p go [--speed=<kn> | --moored]\n");
+	docopt::Parser const groups(
+		"Usage: p ((--json) | (--yaml) | (-c) | (--json)) [(--fast) | (--slow)]\n"
+		"       p ((add) | (rm) | (--force) | (add)) <x>\n"
+		"       p go [(--speed=<kn>) | (--moored)]\n");
+
+	char const* const argvs[][4] = {
+		{ "--json", NULL },
+		{ "--yaml", "--slow", NULL },
+		{ "--yaml", "--json", NULL },
+		{ "-c", "--fast", "--slow", NULL },
+		{ "add", "x", NULL },
+		{ "x", "rm", NULL },
+		{ "rm", "--force", "x", NULL },
+		{ "--force", "add", NULL },
+		{ "go", "--speed=3", NULL },
+		{ "go", "--moored", "--speed=3", NULL },
+		{ "go", NULL },
+		{ NULL },
+	};
+	for (size_t i = 0; i < sizeof(argvs) / sizeof(argvs[0]); ++i) {
+		std::vector<std::string> argv;
+		for (char const* const* arg = argvs[i]; *arg; ++arg)
+			argv.push_back(*arg);
+		CHECK(outcome(leaves, argv) == outcome(groups, argv));
+	}
+	CHECK(outcome(leaves, args("--yaml", "--json")).compare(0, 7, "error: ") == 0);
+}
+
+static void test_usage_builder()
+{
+	typedef docopt::Element E;
+
+	docopt::UsageBuilder builder("naval_fate");
+	builder.description("Naval Fate.");
+	builder.usage(E::required().add(E::command("ship")).add(E::command("new")).add(E::one_or_more(E::argument("<name>"))));
+	builder.usage(E::required().add(E::command("ship")).add(E::argument("<name>")).add(E::command("move"))
+		      .add(E::argument("<x>")).add(E::argument("<y>")).add(E::optional(E::option("--speed"))));
+	builder.usage(E::required().add(E::command("ship")).add(E::command("shoot")).add(E::argument("<x>")).add(E::argument("<y>")));
+	builder.usage(E::required().add(E::command("mine")).add(E::either(E::command("set"), E::command("remove")))
+		      .add(E::argument("<x>")).add(E::argument("<y>")).add(E::optional(E::either(E::option("--moored"), E::option("--drifting")))));
+	builder.usage(E::required().add(E::options()).add(E::command("report")).add(E::argument("<destination-with-a-long-name>")));
+	builder.usage(E::either(E::option("-h"), E::option("--help")));
+	builder.usage(E::option("--version"));
+	builder.flag("-h", "--help", "Show this screen.");
+	builder.flag("", "--version", "Show version.");
+	builder.option("", "--speed", "<kn>", "Speed in knots.", "10");
+	builder.flag("", "--moored", "Moored (anchored) mine.");
+	builder.flag("", "--drifting", "Drifting mine.");
+	builder.option("", "--output-directory", "<dir>", "Where reports go.", "/var/spool/naval-fate/reports");
+	builder.flag("-v", "--verbose", "Say more.");
+
+	docopt::Parser const built = builder.compile();
+	docopt::Parser const written(NAVAL_FATE);
+	docopt::Parser const reread(builder.doc());
+	CHECK(built.doc() == builder.doc());
+
+	std::vector<std::vector<std::string> > const argvs = naval_fate_argvs();
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		std::string const outcomes[] = { outcome(built, argvs[i]), outcome(written, argvs[i]), outcome(reread, argvs[i]) };
+		CHECK(outcomes[0] == outcomes[1]);
+		CHECK(outcomes[0] == outcomes[2]);
+		if (outcomes[0] != outcomes[1] || outcomes[0] != outcomes[2])
+			std::cout << "  built: " << outcomes[0] << "\n  written: " << outcomes[1] << "\n  reread: " << outcomes[2] << std::endl;
+	}
+
+	bool rejected = false;
+	try {
+		E::command("<name>");
+	} catch (docopt::DocoptLanguageError const&) {
+		rejected = true;
+	}
+	CHECK(rejected);
+}
+
+static void check_same_outcomes(docopt::Parser const& changed, docopt::Parser const& compiled,
+				std::vector<std::vector<std::string> > const& argvs)
+{
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		std::string const got = outcome(changed, argvs[i]);
+		std::string const expected = outcome(compiled, argvs[i]);
+		CHECK(got == expected);
+		if (got != expected)
+			std::cout << "  changed: " << got << "\n  compiled: " << expected << std::endl;
+	}
+}
+
+static void test_lazy_parser()
+{
+	// a lazy parser gives the map a full compile gives, entries for uncompiled alternatives and all,
+	// and the same errors, including those that depend on options only other alternatives name
+	char const* const TOOL =
+		"Usage: tool build --speedy [-j]\n"
+		"       tool run --speed=<kn> [<x>...]\n"
+		"       tool run <x> <x> --count\n"
+		"       tool [options] go [-j]...\n"
+		"\n"
+		"Options:\n"
+		"  -q --quiet   Hush.\n"
+		"  --level=<n>  Level [default: 3].\n";
+
+	std::vector<std::vector<std::string> > toolArgvs;
+	toolArgvs.push_back(args("run", "--spee=3"));            // ambiguous with --speedy, from 'build'
+	toolArgvs.push_back(args("run", "--speed=3", "a"));
+	toolArgvs.push_back(args("run", "a", "b", "--count"));
+	toolArgvs.push_back(args("build", "--speedy", "-j"));
+	toolArgvs.push_back(args("build", "--speedy", "-j", "-j"));
+	toolArgvs.push_back(args("go", "-q", "-j", "-j"));
+	toolArgvs.push_back(args("go", "--level=5"));
+	toolArgvs.push_back(args("--quiet", "go"));
+	toolArgvs.push_back(args("run"));
+	toolArgvs.push_back(args("nothing"));
+
+	struct Case {
+		char const* doc;
+		std::vector<std::vector<std::string> > argvs;
+	} const cases[] = {
+		{ NAVAL_FATE, naval_fate_argvs() },
+		{ TOOL, toolArgvs },
+	};
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		docopt::Parser const compiled(cases[c].doc);
+		docopt::Parser const lazy = docopt::Parser::lazy(cases[c].doc);
+		check_same_outcomes(lazy, compiled, cases[c].argvs);
+
+		// and its results are the same through parse_result
+		for (size_t i = 0; i < cases[c].argvs.size(); ++i) {
+			try {
+				docopt::Result const result = lazy.parse_result(cases[c].argvs[i], false, false);
+				CHECK(result.args() == compiled.parse(cases[c].argvs[i], false, false));
+				CHECK(result.fingerprint() == docopt::fingerprint(result.args()));
+			} catch (docopt::DocoptArgumentError const&) {
+			}
+		}
+	}
+
+	// defaults are looked up in entries for alternatives argv never reached
+	std::map<std::string, docopt::value> const mine = docopt::Parser::lazy(NAVAL_FATE).parse(args("mine", "set", "1", "2"));
+	CHECK(mine.size() == docopt::Parser(NAVAL_FATE).parse(args("mine", "set", "1", "2")).size());
+	CHECK(mine.at("--speed").asString() == "10");
+	CHECK(mine.at("<name>").asStringList().empty());
+	CHECK(!mine.at("ship").asBool());
+
+	// argv that names a line's leading command and fails is not tried against the lines led by
+	// other commands: none of them can match it, so its error is the full compile's as it is
+	std::string commands = "Usage:";
+	for (char c = 'a'; c <= 'h'; ++c)
+		commands += std::string(" prog cmd") + c + " <x> [--flag]\n      ";
+	commands += " prog [--flag]\n";
+	std::vector<std::vector<std::string> > failing;
+	failing.push_back(args("cmdc"));
+	failing.push_back(args("cmdc", "x", "--bogus"));
+	failing.push_back(args("cmdc", "x", "y"));
+	docopt::Parser const compiled(commands);
+	docopt::Parser const rejecting = docopt::Parser::lazy(commands);
+	check_same_outcomes(rejecting, compiled, failing);
+	docopt::Parser const accepting = docopt::Parser::lazy(commands);
+	accepting.parse(args("cmdc", "x"), false, false);
+	CHECK(rejecting.footprint().nodes == accepting.footprint().nodes);
+
+	// argv that names no command still settles its error against every line
+	docopt::Parser const unnamed = docopt::Parser::lazy(commands);
+	check_same_outcomes(unnamed, compiled, std::vector<std::vector<std::string> >(1, args("cmdz")));
+	CHECK(unnamed.footprint().nodes > accepting.footprint().nodes);
+}
+
+static void test_incremental_usage()
+{
+	static const char SHIPS[] =
+		"Naval Fate.\n"
+		"\n"
+		"Usage:\n"
+		"  naval_fate ship new <name>...\n"
+		"  naval_fate ship <name> move <x> <y> [--speed=<kn>]\n"
+		"  naval_fate ship shoot <x> <y>\n"
+		"  naval_fate (-h | --help)\n"
+		"  naval_fate --version\n"
+		"\n"
+		"Options:\n"
+		"  -h --help                    Show this screen.\n"
+		"  --version                    Show version.\n"
+		"  --speed=<kn>                 Speed in knots [default: 10].\n";
+	static const char MINES[] =
+		"Usage:\n"
+		"  naval_fate ship new <name>...\n"
+		"  naval_fate ship <name> move <x> <y> [--speed=<kn>]\n"
+		"  naval_fate ship shoot <x> <y>\n"
+		"  naval_fate (-h | --help)\n"
+		"  naval_fate --version\n"
+		"  naval_fate mine (set|remove) <x> <y> [--moored | --drifting]\n"
+		"\n"
+		"Options:\n"
+		"  -h --help                    Show this screen.\n"
+		"  --version                    Show version.\n"
+		"  --speed=<kn>                 Speed in knots [default: 10].\n"
+		"  --moored                     Moored (anchored) mine.\n"
+		"  --drifting                   Drifting mine.\n";
+	std::vector<std::vector<std::string> > const argvs = naval_fate_argvs();
+
+	// a plugin adding the mines and reports, with their options
+	docopt::Parser const ships[] = { docopt::Parser(SHIPS), docopt::Parser::lazy(SHIPS) };
+	for (size_t i = 0; i < 2; ++i) {
+		docopt::Parser parser = ships[i];
+		outcome(parser, argvs[0]); // compiles (some of) it before the change
+		parser.addUsage("mine (set|remove) <x> <y> [--moored | --drifting]",
+				"  --moored                     Moored (anchored) mine.\n"
+				"  --drifting                   Drifting mine.\n");
+		size_t const report = parser.addUsage("[options] report <destination-with-a-long-name>",
+				"  --output-directory=<dir>     Where reports go [default: /var/spool/naval-fate/reports].\n"
+				"  -v --verbose                 Say more.\n");
+		if (i == 0)
+			check_same_outcomes(parser, docopt::Parser(NAVAL_FATE), argvs);
+
+		// and taking the reports away again
+		parser.removeUsage(report);
+		CHECK(outcome(parser, args("report", "-v", "home")) != outcome(docopt::Parser(NAVAL_FATE), args("report", "-v", "home")));
+		if (i == 0)
+			check_same_outcomes(parser, docopt::Parser(MINES), argvs);
+	}
+
+	// a name that starts repeating in a new alternative becomes a list in the others too
+	docopt::Parser go("Usage: prog go <x>\n");
+	CHECK(outcome(go, args("go", "a")) == outcome(docopt::Parser("Usage: prog go <x>\n"), args("go", "a")));
+	size_t const copy = go.addUsage("copy <x> <x>");
+	docopt::Parser const both("Usage: prog go <x>\n       prog copy <x> <x>\n");
+	CHECK(outcome(go, args("go", "a")) == outcome(both, args("go", "a")));
+	CHECK(outcome(go, args("copy", "a", "b")) == outcome(both, args("copy", "a", "b")));
+	go.removeUsage(copy);
+	CHECK(outcome(go, args("go", "a")) == outcome(docopt::Parser("Usage: prog go <x>\n"), args("go", "a")));
+
+	bool rejected = false;
+	try {
+		go.removeUsage(copy);
+	} catch (std::runtime_error const&) {
+		rejected = true;
+	}
+	CHECK(rejected);
+}
+
+static void test_option_scoping()
+{
+	char const* const TOOL =
+		"Usage: tool [-v] remote add [--fetch] [--force-push] <name>\n"
+		"       tool [-v] build [--force] [--jobs=<n>] <target>\n"
+		"\n"
+		"Options:\n"
+		"  -v --verbose  Say more.\n"
+		"\n"
+		"Remote options:\n"
+		"  --fetch       Fetch at once.\n"
+		"  --force-push  Push over what is there.\n"
+		"\n"
+		"Build options:\n"
+		"  --force       Rebuild everything.\n"
+		"  --jobs=<n>    How many at once [default: 1].\n";
+	docopt::Parser const flat(TOOL);
+	docopt::Parser const parsers[] = { docopt::Parser(TOOL), docopt::Parser::lazy(TOOL) };
+
+	for (size_t i = 0; i < 2; ++i) {
+		docopt::Parser scoped = parsers[i];
+		scoped.setOptionScoping(true);
+
+		// the same results where both accept argv
+		CHECK(outcome(scoped, args("-v", "build", "--jobs", "4", "t")) == outcome(flat, args("-v", "build", "--jobs", "4", "t")));
+		CHECK(outcome(scoped, args("remote", "add", "--fetch", "origin")) == outcome(flat, args("remote", "add", "--fetch", "origin")));
+
+		// '--forc' abbreviates only one option in scope
+		CHECK(outcome(flat, args("build", "--forc", "t")).compare(0, 7, "error: ") == 0);
+		CHECK(outcome(scoped, args("build", "--forc", "t")) == outcome(flat, args("build", "--force", "t")));
+		CHECK(scoped.validate(args("build", "--forc", "t")) == docopt::Accepted);
+
+		// before its command, a scoped option is not known
+		CHECK(outcome(flat, args("--jobs", "4", "build", "t")).compare(0, 7, "error: ") != 0);
+		CHECK(outcome(scoped, args("--jobs", "4", "build", "t")).compare(0, 7, "error: ") == 0);
+		CHECK(flat.validate(args("--fe", "remote", "add", "o")) == docopt::Accepted);
+		CHECK(scoped.validate(args("--fe", "remote", "add", "o")) != docopt::Accepted);
+
+		// used again once its command opens the scope, it is the described option, not two of them
+		CHECK(outcome(scoped, args("--force", "build", "--force", "t")) == outcome(flat, args("--force", "build", "--force", "t")));
+		CHECK(outcome(scoped, args("--jobs=3", "build", "--jobs", "4", "t")) == outcome(flat, args("--jobs=3", "build", "--jobs", "4", "t")));
+		CHECK(scoped.validate(args("--force", "build", "--force", "t")) == flat.validate(args("--force", "build", "--force", "t")));
+
+		scoped.setOptionScoping(false);
+		CHECK(outcome(scoped, args("build", "--forc", "t")) == outcome(flat, args("build", "--forc", "t")));
+	}
+}
+
+// Runs each task as soon as it is submitted, counting them
+class InlineExecutor : public docopt::Executor {
+public:
+	InlineExecutor() : submitted(0) {}
+
+	void submit(Task* task) {
+		++submitted;
+		task->run();
+		delete task;
+	}
+
+	unsigned concurrency() const { return 4; }
+
+	unsigned submitted;
+};
+
+static void test_compile_all()
+{
+	// each doc names its own program, so a result in the wrong place parses under the wrong name
+	std::vector<std::string> docs;
+	for (int i = 0; i < 12; ++i) {
+		std::string const program = "prog" + boost::lexical_cast<std::string>(i);
+		if (i % 4 == 1)
+			docs.push_back("Usage: " + program + " (<x>\n");
+		else if (i % 4 == 3)
+			docs.push_back("No usage section here.\n");
+		else
+			docs.push_back("Usage: " + program + " [-v] <x>\n");
+	}
+
+	for (unsigned threads = 1; threads <= 4; threads += 3) {
+		std::vector<docopt::CompileResult> const results = docopt::compile_all(docs, threads);
+		CHECK(results.size() == docs.size());
+		for (size_t i = 0; i < docs.size(); ++i) {
+			std::string expected;
+			switch (i % 4) {
+			case 1: expected = "Mismatched '('"; break;
+			case 3: expected = "'usage:' (case-insensitive) not found."; break;
+			}
+			CHECK(results[i].ok == expected.empty());
+			CHECK(results[i].error == expected);
+			if (!results[i].ok)
+				continue;
+			CHECK(results[i].parser.doc() == docs[i]);
+			CHECK(outcome(results[i].parser, args("-v", "a")) == outcome(docopt::Parser(docs[i]), args("-v", "a")));
+		}
+	}
+}
+
+static void test_executor()
+{
+	std::vector<std::string> docs;
+	for (int i = 0; i < 3; ++i) {
+		docs.push_back(NAVAL_FATE);
+		docs.push_back("Usage: prog [-v] <x>\n");
+		docs.push_back("Usage: prog (<x>\n");
+	}
+
+	InlineExecutor executor;
+	std::vector<docopt::CompileResult> const compiled = docopt::compile_all(docs, 0, &executor);
+	CHECK(executor.submitted == 3); // the calling thread is the fourth
+	std::vector<docopt::CompileResult> const pooled = docopt::compile_all(docs);
+	CHECK(compiled.size() == docs.size() && pooled.size() == docs.size());
+	for (size_t i = 0; i < docs.size(); ++i) {
+		CHECK(compiled[i].ok == (i % 3 != 2));
+		CHECK(pooled[i].ok == compiled[i].ok);
+		CHECK(compiled[i].ok || !compiled[i].error.empty());
+	}
+	docopt::compile_all(docs, 2, &executor);
+	CHECK(executor.submitted == 4);
+
+	docopt::Parser const parser(NAVAL_FATE);
+	std::vector<std::vector<std::string> > argvs;
+	for (int i = 0; i < 20; ++i) {
+		std::vector<std::vector<std::string> > const more = naval_fate_argvs();
+		argvs.insert(argvs.end(), more.begin(), more.end());
+	}
+	std::vector<docopt::Validation> const verdicts = parser.validate_all(argvs, false, false, false, &executor);
+	std::vector<docopt::Validation> const pooledVerdicts = parser.validate_all(argvs, false, false);
+	CHECK(verdicts.size() == argvs.size());
+	for (size_t i = 0; i < argvs.size(); ++i) {
+		CHECK(verdicts[i] == parser.validate(argvs[i], false, false));
+		CHECK(pooledVerdicts[i] == verdicts[i]);
+	}
+
+	// running out of memory half way through is not a verdict on argv
+	unsigned long const allocations = gAllocations;
+	parser.validate_all(argvs, false, false, false, &executor);
+	gFailAllocationIn = (gAllocations - allocations) / 2;
+	bool threw = false;
+	try {
+		parser.validate_all(argvs, false, false, false, &executor);
+	} catch (std::bad_alloc const&) {
+		threw = true;
+	}
+	gFailAllocationIn = 0;
+	CHECK(threw);
+}
+
+static void test_adaptive_ordering()
+{
+	// the first two alternatives tie on "a b" (and give different values); the third takes '--all' too
+	char const* const DOC =
+		"Usage: p [-v]... ((<x> <y>) | (<x> [<z>]) | (<x> <y> --all) | (go <x>...)) [--n=<k>]...\n";
+	docopt::Parser const exhaustive(DOC);
+	docopt::Parser adaptive(DOC);
+	adaptive.setAdaptiveOrdering(true);
+	docopt::Parser lazy = docopt::Parser::lazy(DOC);
+	lazy.setAdaptiveOrdering(true);
+
+	char const* const argvs[][6] = {
+		{ "a", NULL },                          // only the second matches: trains it to go first
+		{ "a", "b", NULL },                     // a tie, which the first declared wins
+		{ "-v", "a", "-v", "b", NULL },         // the same, with a count on the side
+		{ "a", "--all", "b", NULL },            // the usual winner leaves '--all': the third is still tried
+		{ "go", "a", "--n=1", "b", "--n=2", NULL },
+		{ "a", "b", "c", NULL },                // nothing leaves fewer than one
+		{ NULL },
+	};
+	for (int round = 0; round < 4; ++round) {
+		// round 0 trains nothing; later rounds repeat the first argv to reorder the alternatives
+		for (int train = 0; train < round * 5; ++train) {
+			adaptive.parse(args("a"), false, false);
+			lazy.parse(args("a"), false, false);
+		}
+		for (size_t i = 0; i < sizeof(argvs) / sizeof(argvs[0]); ++i) {
+			std::vector<std::string> argv;
+			for (char const* const* arg = argvs[i]; *arg; ++arg)
+				argv.push_back(*arg);
+			std::string const expected = outcome(exhaustive, argv);
+			CHECK(outcome(adaptive, argv) == expected);
+			CHECK(outcome(lazy, argv) == expected);
+			// and again, now that this argv has counted too
+			CHECK(outcome(adaptive, argv) == expected);
+		}
+	}
+
+	std::map<std::string, docopt::value> const tie = adaptive.parse(args("-v", "a", "-v", "b"), false, false);
+	CHECK(tie.at("<y>") && tie.at("<y>").asString() == "b");
+	CHECK(!tie.at("<z>"));
+	CHECK(tie.at("-v").asLong() == 2);
+	std::map<std::string, docopt::value> const third = adaptive.parse(args("a", "--all", "b"), false, false);
+	CHECK(third.at("--all").asBool() && third.at("<y>").asString() == "b");
+}
+
+static void test_match_undo()
+{
+	// the first alternative takes every <f> (and 'go' with them) before failing on '--stop': all
+	// of that has to be taken back before the second one is tried
+	char const* const DOC = "Usage: p [-v]... (<f>... --stop | <f> <f> go)\n";
+	docopt::Parser plain(DOC);
+	docopt::Parser adaptive(DOC);
+	adaptive.setAdaptiveOrdering(true);
+	adaptive.setRecordOccurrences(true);
+
+	docopt::Parser const* const parsers[] = { &plain, &adaptive };
+	for (size_t i = 0; i < 2; ++i) {
+		for (int round = 0; round < 3; ++round) {
+			docopt::Result const result = parsers[i]->parse_result(args("-v", "a", "-v", "b", "go"));
+			CHECK(result["<f>"].asStringList().size() == 2);
+			CHECK(result["<f>"].asStringList()[1] == "b");
+			CHECK(result["-v"].asLong() == 2);
+			CHECK(result["go"].asBool());
+			CHECK(!result["--stop"].asBool());
+			CHECK(result.occurrences().size() == (i == 0 ? 0u : 5u));
+		}
+		docopt::Result const stopped = parsers[i]->parse_result(args("a", "b", "c", "--stop"));
+		CHECK(stopped["<f>"].asStringList().size() == 3);
+		CHECK(stopped["-v"].asLong() == 0);
+	}
+}
+
+#if __cplusplus >= 201703L
+static void test_pmr_result()
+{
+	docopt::Parser parser(NAVAL_FATE);
+	std::vector<std::string> const argv = args("ship", "new", "a-rather-long-ship-name-that-is-not-inline", "another-ship-name-that-needs-the-heap");
+
+	// an arena that may not fall back on the heap: anything left on the heap afterwards was not put in it
+	static char buffer[1 << 14];
+	std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+	size_t const before = gLiveBytes;
+	docopt::pmr::map* result = new (arena.allocate(sizeof(docopt::pmr::map), alignof(docopt::pmr::map)))
+		docopt::pmr::map(docopt::pmr::parse(parser, argv, &arena));
+	CHECK(gLiveBytes == before);
+
+	std::map<std::string, docopt::value> const expected = parser.parse(argv);
+	CHECK(result->size() == expected.size());
+	CHECK(result->at("<name>").asStringList().size() == 2);
+	CHECK(result->at("<name>").asStringList()[1] == "another-ship-name-that-needs-the-heap");
+	CHECK(result->at("<name>").asStringList()[1].get_allocator().resource() == &arena);
+	CHECK(result->at("--speed").asLong() == 10);
+	CHECK(result->at("new").asBool());
+	CHECK(!result->at("<x>"));
+	// dropped along with the arena, without running any destructors
+}
+#endif
+
+int main()
+{
+	test_value_conversions();
+	test_parser_footprint();
+	test_parser_context();
+	test_context_parse_cost();
+	test_result_footprint();
+	test_shared_result();
+	test_cache_footprint();
+	test_occurrences();
+	test_doc_in_memory();
+	test_usage_for();
+	test_pass_through();
+	test_validate();
+	test_fingerprint();
+	test_capture();
+	test_options_shortcut();
+	test_option_scoping();
+	test_single_leaf_either();
+	test_adaptive_ordering();
+	test_match_undo();
+	test_usage_builder();
+	test_incremental_usage();
+	test_lazy_parser();
+	test_compile_all();
+	test_executor();
+#if __cplusplus >= 201703L
+	test_pmr_result();
+#endif
+
+	return report_failures();
+}
@@ -0,0 +1,74 @@
+//
+//  run_unittests.h
+//  docopt
+//
+//  What run_unittests.cpp shares with the test programs built in several configurations, each of
+//  which is one source file of its own so that it holds only the tests it runs.
+//
+
+#ifndef docopt_run_unittests_h
+#define docopt_run_unittests_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#pragma mark -
+#pragma mark Checks
+
+static int gFailures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+			++gFailures; \
+		} \
+	} while (0)
+
+// What main returns, once it has said how the checks went
+inline int report_failures()
+{
+	if (gFailures) {
+		std::cout << gFailures << " failures" << std::endl;
+		return 1;
+	}
+	std::cout << "PASS" << std::endl;
+	return 0;
+}
+
+#pragma mark -
+#pragma mark Fixtures
+
+static const char NAVAL_FATE[] =
+"Naval Fate.\n"
+"\n"
+"Usage:\n"
+"  naval_fate ship new <name>...\n"
+"  naval_fate ship <name> move <x> <y> [--speed=<kn>]\n"
+"  naval_fate ship shoot <x> <y>\n"
+"  naval_fate mine (set|remove) <x> <y> [--moored | --drifting]\n"
+"  naval_fate [options] report <destination-with-a-long-name>\n"
+"  naval_fate (-h | --help)\n"
+"  naval_fate --version\n"
+"\n"
+"Options:\n"
+"  -h --help                    Show this screen.\n"
+"  --version                    Show version.\n"
+"  --speed=<kn>                 Speed in knots [default: 10].\n"
+"  --moored                     Moored (anchored) mine.\n"
+"  --drifting                   Drifting mine.\n"
+"  --output-directory=<dir>     Where reports go [default: /var/spool/naval-fate/reports].\n"
+"  -v --verbose                 Say more.\n";
+
+inline std::vector<std::string> args(char const* a, char const* b = NULL, char const* c = NULL, char const* d = NULL,
+				     char const* e = NULL, char const* f = NULL)
+{
+	std::vector<std::string> ret;
+	char const* all[] = { a, b, c, d, e, f };
+	for (size_t i = 0; i < 6 && all[i]; ++i)
+		ret.push_back(all[i]);
+	return ret;
+}
+
+#endif /* defined(docopt_run_unittests_h) */
@@ -0,0 +1,78 @@
+//
+//  run_unittests_argv.cpp
+//  docopt
+//
+//  Checks for how argv is classified before matching. Built once as it ships, and header-only on
+//  the plain loops (DOCOPT_NO_SIMD) and, where the machine runs it, on AVX2, where the vector kernel
+//  the build picked is also checked against a plain loop.
+//
+
+#include "docopt.h"
+#include "run_unittests.h"
+
+static void test_argv_classification()
+{
+	// every '=' in argv is found in one sweep over the elements packed together; the padding moves
+	// them (and the '=' the padding is made of, which belong to it) across every vector boundary
+	docopt::Parser const parser(
+		"Usage: p [options] [<arg>...]\n"
+		"\n"
+		"Options:\n"
+		"  -c                                    C.\n"
+		"  --x=<v>                               X.\n"
+		"  --a-long-option-name-past-32-bytes=<v>  Long.\n");
+	char const* const values[] = { "", "=", "a=b", "a-value-long-enough-to-span-two-blocks=" };
+	for (size_t pad = 0; pad < 80; ++pad) {
+		std::string const padding(pad, '=');
+		for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+			std::vector<std::string> argv;
+			argv.push_back(padding);                       // positional, empty at first
+			argv.push_back(std::string("--x=") + values[v]);
+			argv.push_back("-");
+			argv.push_back("--a-long-option-name-past-32-bytes=" + padding);
+			argv.push_back("-c");
+			argv.push_back("--");
+			argv.push_back("--x=z");
+
+			std::map<std::string, docopt::value> result;
+			try {
+				result = parser.parse(argv, false, false);
+			} catch (docopt::DocoptArgumentError const&) {
+			}
+			CHECK(!result.empty());
+			if (result.empty())
+				continue;
+			CHECK(result.at("--x").asString() == values[v]);
+			CHECK(result.at("--a-long-option-name-past-32-bytes").asString() == padding);
+			CHECK(result.at("-c").asBool());
+			std::vector<std::string> const& positional = result.at("<arg>").asStringList();
+			CHECK(positional.size() == 4 && positional[0] == padding && positional[1] == "-");
+			CHECK(positional.size() == 4 && positional[2] == "--" && positional[3] == "--x=z");
+		}
+	}
+
+#if defined(DOCOPT_HEADER_ONLY)
+	// the vector kernel this build has against a plain loop, over every length and alignment
+	std::string buffer(200, 'a');
+	for (size_t i = 0; i < buffer.size(); i += 1 + i % 7)
+		buffer[i] = '=';
+	for (size_t begin = 0; begin < 40; ++begin) {
+		for (size_t size = 0; begin + size <= buffer.size(); ++size) {
+			std::vector<size_t> found;
+			find_all(buffer.data() + begin, size, '=', found);
+			std::vector<size_t> expected;
+			for (size_t i = 0; i < size; ++i) {
+				if (buffer[begin + i] == '=')
+					expected.push_back(i);
+			}
+			CHECK(found == expected);
+		}
+	}
+#endif
+}
+
+int main()
+{
+	test_argv_classification();
+	return report_failures();
+}
@@ -0,0 +1,92 @@
+//
+//  run_unittests_cache.cpp
+//  docopt
+//
+//  Checks for Parser's result cache. Built once as it ships, and once header-only with
+//  DOCOPT_CACHE_HASH_BITS=2, so that different argv share a handful of hash values between them.
+//
+
+#include "docopt.h"
+#include "run_unittests.h"
+
+#include <cstdio>
+
+static std::string ship_name(size_t i)
+{
+	// all the same length, so that their cache entries are the same size
+	char name[16];
+	std::sprintf(name, "ship%04lu", static_cast<unsigned long>(i));
+	return name;
+}
+
+static void test_result_cache()
+{
+	docopt::Parser const uncached(NAVAL_FATE);
+	docopt::Parser parser(NAVAL_FATE);
+	parser.enableCache(1 << 20);
+
+	// a miss, then hits; the cached result is the one parsed
+	docopt::Result const first = parser.parse_result(args("ship", "new", "a"));
+	CHECK(parser.cacheStats().misses == 1 && parser.cacheStats().hits == 0 && parser.cacheStats().entries == 1);
+	docopt::Result const again = parser.parse_result(args("ship", "new", "a"));
+	CHECK(&again.args() == &first.args());
+	CHECK(parser.cacheStats().misses == 1 && parser.cacheStats().hits == 1);
+
+	// the flags are part of the key
+	parser.parse_result(args("ship", "new", "a"), false);
+	CHECK(parser.cacheStats().misses == 2 && parser.cacheStats().entries == 2);
+
+	// argv that fail to parse are not kept
+	bool rejected = false;
+	try {
+		parser.parse_result(args("ship", "new"));
+	} catch (docopt::DocoptArgumentError const&) {
+		rejected = true;
+	}
+	CHECK(rejected && parser.cacheStats().entries == 2);
+
+	// different argv never get each other's result, however their hashes fall (built with
+	// DOCOPT_CACHE_HASH_BITS, they share a handful of hash values between them)
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < 64; ++i) {
+			std::vector<std::string> const argv = i % 2 ? args("ship", ship_name(i).c_str(), "move", "1", "2")
+								    : args("ship", "new", ship_name(i).c_str());
+			docopt::Result const result = parser.parse_result(argv);
+			CHECK(result.fingerprint() == uncached.parse_result(argv).fingerprint());
+			CHECK(result["<name>"].asStringList()[0] == ship_name(i));
+		}
+	}
+	docopt::CacheStats const stats = parser.cacheStats();
+	CHECK(stats.entries == 66 && stats.evictions == 0);
+	CHECK(stats.hits == 1 + 64 && stats.misses == 2 + 1 + 64);
+
+	// least recently used first: room for two entries, then a third
+	docopt::Parser lru(NAVAL_FATE);
+	lru.enableCache(1 << 20);
+	lru.parse_result(args("ship", "new", ship_name(0).c_str()));
+	size_t const entryBytes = lru.cacheStats().bytes;
+	lru.enableCache(entryBytes * 5 / 2);
+	lru.parse_result(args("ship", "new", ship_name(1).c_str()));
+	lru.parse_result(args("ship", "new", ship_name(2).c_str()));
+	lru.parse_result(args("ship", "new", ship_name(1).c_str()));       // 2 is now the oldest
+	lru.parse_result(args("ship", "new", ship_name(3).c_str()));       // and goes
+	CHECK(lru.cacheStats().entries == 2 && lru.cacheStats().evictions == 1);
+	CHECK(lru.cacheStats().bytes <= entryBytes * 5 / 2);
+	unsigned long const hits = lru.cacheStats().hits;
+	lru.parse_result(args("ship", "new", ship_name(1).c_str()));
+	lru.parse_result(args("ship", "new", ship_name(3).c_str()));
+	CHECK(lru.cacheStats().hits == hits + 2);
+	lru.parse_result(args("ship", "new", ship_name(2).c_str()));
+	CHECK(lru.cacheStats().hits == hits + 2 && lru.cacheStats().evictions == 2);
+
+	// an entry bigger than the whole budget is never kept
+	lru.enableCache(entryBytes / 2);
+	lru.parse_result(args("ship", "new", ship_name(0).c_str()));
+	CHECK(lru.cacheStats().entries == 0 && lru.cacheStats().misses == 1);
+}
+
+int main()
+{
+	test_result_cache();
+	return report_failures();
+}